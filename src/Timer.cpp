@@ -15,6 +15,25 @@
 
 #include "Timer.h"
 #include <stdlib.h>
+#include <time.h>
+
+#ifndef WIN32
+// NOTE: changed from gettimeofday() to the monotonic clock (if available), so
+// elapsed times are not affected when the system time is set.
+static void getCurrentTime(timeval *tv)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    {
+        tv->tv_sec = ts.tv_sec;
+        tv->tv_usec = ts.tv_nsec / 1000;
+        return;
+    }
+#endif
+    gettimeofday(tv, NULL);
+}
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 // constructor
@@ -56,7 +75,7 @@ void Timer::start()
 #ifdef WIN32
     QueryPerformanceCounter(&startCount);
 #else
-    gettimeofday(&startCount, NULL);
+    getCurrentTime(&startCount);
 #endif
 }
 
@@ -73,7 +92,7 @@ void Timer::stop()
 #ifdef WIN32
     QueryPerformanceCounter(&endCount);
 #else
-    gettimeofday(&endCount, NULL);
+    getCurrentTime(&endCount);
 #endif
 }
 
@@ -93,7 +112,7 @@ double Timer::getElapsedTimeInMicroSec()
     endTimeInMicroSec = endCount.QuadPart * (1000000.0 / frequency.QuadPart);
 #else
     if(!stopped)
-        gettimeofday(&endCount, NULL);
+        getCurrentTime(&endCount);
 
     startTimeInMicroSec = (startCount.tv_sec * 1000000.0) + startCount.tv_usec;
     endTimeInMicroSec = (endCount.tv_sec * 1000000.0) + endCount.tv_usec;
@@ -7,6 +7,8 @@
  */
 
 #include <errno.h>
+#include <string.h>
+#include <unistd.h>
 #include <algorithm>
 #include <iostream>
 #include <sstream>
@@ -21,9 +23,10 @@ using std::size_t;
 
 //STATIC
 //Note: the state names are used all the way on the other end in javascript, consider this when changing them.
-const string AbstractDriver::STATE_NAMES[] = { "unknown", "disconnected", "connecting", "idle", "buffering", "printing", "stopping" };
+const string AbstractDriver::STATE_NAMES[] = { "unknown", "disconnected", "connecting", "idle", "buffering", "printing", "stopping", "reconnecting" };
 const bool AbstractDriver::REQUEST_EXIT_ON_PORT_FAIL = true;
 const int AbstractDriver::VERBOSE_LOG_NEXT_LINE_EVERY_N_LINES = 25;
+const int AbstractDriver::RECONNECT_POLL_INTERVAL = 1000;
 
 AbstractDriver::AbstractDriver(Server& server, const string& serialPortPath, const uint32_t& baudrate)
 : heating_(false),
@@ -35,10 +38,12 @@ AbstractDriver::AbstractDriver(Server& server, const string& serialPortPath, con
   log_(Logger::getInstance()),
   server_(server),
   serialPortPath_(serialPortPath),
-  baudrate_(baudrate) { }
+  baudrate_(baudrate),
+  reconnectEnabled_(false) { }
 
 AbstractDriver::~AbstractDriver() {
 	serial_.close();
+	deviceWatcher_.stop();
 }
 
 
@@ -61,6 +66,7 @@ int AbstractDriver::openConnection() {
 
 int AbstractDriver::closeConnection() {
 	setState(DISCONNECTED);
+	scheduler_.cancelAll();
 	server_.unregisterFileDescriptor(serial_.getFileDescriptor());
 	return serial_.close();
 }
@@ -69,6 +75,22 @@ bool AbstractDriver::isConnected() const {
 	return serial_.isOpen();
 }
 
+/*
+ * Record all serial traffic to the given file (see SerialTrace), pass an empty name to stop capturing.
+ */
+int AbstractDriver::setSerialCapture(const std::string& file) {
+	if (file.empty()) return serial_.closeCapture();
+	return serial_.openCapture(file.c_str());
+}
+
+/*
+ * When enabled, losing the port (e.g. after a USB reset) does not make the server exit. Instead, the driver
+ * waits in the reconnecting state for the device to return, keeping buffered gcode and clients connected.
+ */
+void AbstractDriver::setReconnectEnabled(bool enabled) {
+	reconnectEnabled_ = enabled;
+}
+
 
 /*************************************
  ******** Manage GCode buffer ********
@@ -98,6 +120,31 @@ GCodeBuffer::GCODE_SET_RESULT AbstractDriver::appendGCode(const std::string& gco
 	return gsr;
 }
 
+/*
+ * Adds a chunk of gcode to the staging (see GCodeBuffer::stage()), for gcode arriving in parts
+ */
+GCodeBuffer::GCODE_SET_RESULT AbstractDriver::stageGCode(GCodeBuffer::Staging& staging, const char* gcode, size_t len) {
+	return gcodeBuffer_.stage(staging, gcode, len);
+}
+
+/*
+ * Adds all staged gcode to the GCode buffer, the staging is empty afterwards (see GCodeBuffer::commit())
+ */
+GCodeBuffer::GCODE_SET_RESULT AbstractDriver::commitGCode(GCodeBuffer::Staging& staging, int32_t totalLines, GCodeBuffer::MetaData *metaData) {
+	GCodeBuffer::GCODE_SET_RESULT gsr = gcodeBuffer_.prepareCommit(staging, metaData);
+	if (gsr != GCodeBuffer::GSR_OK) {
+		staging.clear();
+		return gsr;
+	}
+
+	for (size_t i = 0; i < staging.getNumParts(); i++) extractGCodeInfo(staging.getPart(i));
+	stagingAccepted(staging, metaData);
+
+	gcodeBuffer_.commitPrepared(staging, totalLines, metaData);
+	if (getState() == IDLE) setState(BUFFERING);
+	return gsr;
+}
+
 /*
  * Clear (empty) GCode buffer
  */
@@ -253,13 +300,18 @@ void AbstractDriver::printNextLine() {
 
 	string line;
 	if(gcodeBuffer_.getNextLine(line) > 0) {
-		sendCode(line);
+		sendPrintLine(line);
 		gcodeBuffer_.setCurrentLine(gcodeBuffer_.getCurrentLine() + 1);
 	} else { // print finished
 		resetPrint();
 	}
 }
 
+//drivers can override this to decorate or track lines sent as part of a print (e.g. to add line numbers)
+void AbstractDriver::sendPrintLine(const std::string& line) {
+	sendCode(line);
+}
+
 bool AbstractDriver::resetPrint() {
 	if (!isPrinterOnline()) {
 		LOG(Logger::VERBOSE, "resetPrint: printer not online (state==%s)", getStateString(getState()).c_str());
@@ -273,13 +325,16 @@ bool AbstractDriver::resetPrint() {
 }
 
 void AbstractDriver::setState(STATE state) {
+	//gcode may have been appended (or kept after a reconnect) while not yet online
+	if (state == IDLE && state_ == CONNECTING && gcodeBuffer_.getBufferedLines() > 0) state = BUFFERING;
+
 	LOG(Logger::INFO, "setState(): %i:%s > %i:%s",state_,getStateString(state_).c_str(),state,getStateString(state).c_str());//TEMP was BULK
 	state_ = state;
 }
 
 bool AbstractDriver::isPrinterOnline() const {
 	STATE s = getState();
-	return s != UNKNOWN && s != DISCONNECTED && s != CONNECTING;
+	return s != UNKNOWN && s != DISCONNECTED && s != CONNECTING && s != RECONNECTING;
 }
 
 int AbstractDriver::readData() {
@@ -289,28 +344,76 @@ int AbstractDriver::readData() {
 	int rv = serial_.readData();
 	log_.checkError(rv, "ABSD", "cannot read from device");
 	if (rv == -2) {
-		LOG(Logger::ERROR, "remote end closed connection, closing port");
-		closeConnection();
-		if (REQUEST_EXIT_ON_PORT_FAIL) server_.requestExit(1);
+		handlePortFailure("remote end closed connection");
 	} else if (rv == -1 && errno == ENXIO) {
-		LOG(Logger::ERROR, "port was disconnected, closing port");
-		closeConnection();
-		if (REQUEST_EXIT_ON_PORT_FAIL) server_.requestExit(1);
+		handlePortFailure("port was disconnected");
 	} else if (rv == -1 && errno == EBADF) {
-		LOG(Logger::ERROR, "port file descriptor became invalid, closing port");
-		closeConnection();
-		if (REQUEST_EXIT_ON_PORT_FAIL) server_.requestExit(1);
+		handlePortFailure("port file descriptor became invalid");
+	} else if (rv == -1 && errno == EIO) {
+		handlePortFailure("port was hung up");
 	} else if (rv >= 0) {
 		//LOG(Logger::BULK, "read %i bytes from device", rv);
 	}
 	return rv;
 }
 
+/*
+ * Closes the port after it failed and either requests the server to exit or, if reconnecting is enabled,
+ * starts waiting for the device to return. An interrupted print is not resumed automatically (the
+ * printer will most likely have been reset), but the remaining gcode stays buffered.
+ */
+void AbstractDriver::handlePortFailure(const char *reason) {
+	STATE s = getState();
+	if (s == RECONNECTING) return; //already handled (e.g. by a retry loop reading from the closed port)
+
+	LOG(Logger::ERROR, "%s, closing port", reason);
+	closeConnection();
+
+	if (!reconnectEnabled_) {
+		if (REQUEST_EXIT_ON_PORT_FAIL) server_.requestExit(1);
+		return;
+	}
+
+	if (s == PRINTING || s == STOPPING) {
+		LOG(Logger::WARNING, "print interrupted at line %i, keeping %i buffered lines", getCurrentLine(), getBufferedLines());
+	}
+
+	deviceWatcher_.start(serialPortPath_);
+	if (deviceWatcher_.getFileDescriptor() >= 0) server_.registerFileDescriptor(deviceWatcher_.getFileDescriptor());
+	reconnectTimer_.start();
+	setState(RECONNECTING);
+}
+
+/*
+ * To be called from update() while in the reconnecting state. The port is reopened as soon as the
+ * device watcher reports the device node, with a periodic retry in case it was not accessible yet.
+ * Returns the number of milliseconds after which it wants to be called again.
+ */
+int AbstractDriver::updateReconnect() {
+	bool appeared = deviceWatcher_.checkAppeared();
+	double elapsed = reconnectTimer_.getElapsedTimeInMilliSec();
+	if (!appeared && elapsed < RECONNECT_POLL_INTERVAL) return RECONNECT_POLL_INTERVAL - elapsed;
+
+	reconnectTimer_.start();
+	if (::access(serialPortPath_.c_str(), F_OK) < 0) return RECONNECT_POLL_INTERVAL;
+
+	LOG(Logger::INFO, "device '%s' is back, reconnecting", serialPortPath_.c_str());
+	if (openConnection() < 0) {
+		LOG(Logger::WARNING, "could not reopen port yet (%s), retrying", strerror(errno));
+		return RECONNECT_POLL_INTERVAL;
+	}
+
+	if (deviceWatcher_.getFileDescriptor() >= 0) server_.unregisterFileDescriptor(deviceWatcher_.getFileDescriptor());
+	deviceWatcher_.stop();
+	return 0;
+}
+
 void AbstractDriver::setBaudrate(uint32_t baudrate) {
 	baudrate_ = baudrate;
 	Serial::ESERIAL_SET_SPEED_RESULT ssr = serial_.setSpeed(baudrate_);
 	if(ssr == Serial::SSR_OK) {
 		setState(CONNECTING);
+		startConnectionCheck();
 	} else {
 		LOG(Logger::ERROR,"  setting speed error");
 	}
@@ -321,6 +424,51 @@ void AbstractDriver::switchBaudrate() {
 	setBaudrate((baudrate_ == B250000)? B115200 : B250000);
 }
 
+uint32_t AbstractDriver::getBaudrate() const {
+	return baudrate_;
+}
+
+/*
+ * Parses temperature reports in the format used by Marlin (and other firmware like Smoothieware).
+ */
+void AbstractDriver::parseTemperatures(string& code) {
+	// Examples:
+	//   ok T:19.1 /0.0 B:0.0 /0.0 @:0 B@:0
+	//   T:19.51 B:-1.00 @:0
+	//   T:19.5 E:0 W:?
+
+	//LOG(Logger::VERBOSE, "parseTemperatures(): '%s'", code.c_str());
+	// temperature hotend
+	size_t posT = code.find("T:");
+
+	//status variant _not_ prefixed with 'ok ' indicates the printer is heating
+	heating_ = (posT == 0);
+
+	temperature_ = findNumber(code, posT + 2);
+	//LOG(Logger::VERBOSE, "  temperature '%i'", temperature_);
+
+	// target temperature hotend
+	size_t posTT = code.find('/', posT);
+	if (posTT != string::npos) {
+		targetTemperature_ = findNumber(code, posTT+1);
+		//LOG(Logger::VERBOSE, "  targetTemperature '%i'", targetTemperature_);
+	}
+
+	// bed temperature
+	size_t posB = code.find("B:");
+	if (posB != string::npos) {
+		bedTemperature_ = findNumber(code, posB + 2);
+		//LOG(Logger::VERBOSE, "  bedTemperature '%i'", bedTemperature_);
+
+		// target bed temperature
+		size_t posTBT = code.find('/', posB);
+		if (posTBT != string::npos) {
+			targetBedTemperature_ = findNumber(code, posTBT + 1);
+			//LOG(Logger::VERBOSE, "  targetBedTemperature '%i'", targetBedTemperature_);
+		}
+	}
+}
+
 int AbstractDriver::findNumber(const string& code, size_t startPos) const {
 	//LOG(Logger::BULK, "  findValue()");
 	std::size_t posEnd = code.find('\n',startPos);
@@ -340,15 +488,19 @@ void AbstractDriver::extractGCodeInfo(const string& gcode) {
 	//LOG(Logger::VERBOSE, "extractGCodeInfo()");
 	//LOG(Logger::BULK, "  gcode: %s", gcode.c_str());
 
-	// check for a heat command (M109 S... / M109 R...)
-	std::size_t posHeat = gcode.rfind("M109");
+	// find the last heat command (M109 S... / M109 R...) and bed heat command (M190 S... / M190 R...)
+	// in a single forward pass, skipping from 'M' to 'M' is a lot quicker than rfind() on large gcode
+	std::size_t posHeat = std::string::npos, posBedHeat = std::string::npos;
+	for (std::size_t pos = gcode.find('M'); pos != std::string::npos; pos = gcode.find('M', pos + 1)) {
+		if (gcode.compare(pos + 1, 3, "109") == 0) posHeat = pos;
+		else if (gcode.compare(pos + 1, 3, "190") == 0) posBedHeat = pos;
+	}
+
 	if(posHeat != std::string::npos) {
 		targetTemperature_ = findNumber(gcode, posHeat + 6);
 		LOG(Logger::VERBOSE, "  targetTemperature_: %i", targetTemperature_);
 	}
 
-	// check for a bed heat command (M190 S... / M190 R...)
-	std::size_t posBedHeat = gcode.rfind("M190");
 	if(posBedHeat != std::string::npos) {
 		targetBedTemperature_ = findNumber(gcode, posBedHeat + 6);
 		LOG(Logger::VERBOSE, "  targetBedTemperature_: %i", targetBedTemperature_);
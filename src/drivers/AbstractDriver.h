@@ -12,28 +12,32 @@
 #include <inttypes.h>
 #include <string>
 #include <vector>
+#include "DeviceWatcher.h"
 #include "GCodeBuffer.h"
+#include "Scheduler.h"
 #include "Serial.h"
+#include "../Timer.h"
 
 class Server;
 
 class AbstractDriver {
 public:
 
+	// typedef (shorthand) for create instance function of driver
+	typedef AbstractDriver* (*creatorFunc)(Server& server, const std::string& serialPortPath, const uint32_t& baudrate);
+
 	// description of firmware a driver supports. TODO: add human readable names
 	struct FirmwareDescription {
 		std::string name;
-		FirmwareDescription(const std::string& n)
-		: name(n)
+		creatorFunc creator; //used instead of the driver's create function if set, for firmware needing different settings
+		FirmwareDescription(const std::string& n, creatorFunc c = 0)
+		: name(n), creator(c)
 		{}
 	};
 
 	// typedef (shorthand) for list of firmware descriptions
 	typedef std::vector<FirmwareDescription> vec_FirmwareDescription;
 
-	// typedef (shorthand) for create instance function of driver
-	typedef AbstractDriver* (*creatorFunc)(Server& server, const std::string& serialPortPath, const uint32_t& baudrate);
-
 	// driver info per driver (used in DriverFactory)
 	struct DriverInfo {
 		std::string name;
@@ -51,7 +55,8 @@ public:
 		IDLE,
 		BUFFERING,
 		PRINTING, /* executing commands */
-		STOPPING
+		STOPPING,
+		RECONNECTING /* port was lost, waiting for the device to return (buffered gcode is kept) */
 	} STATE;
 
 	explicit AbstractDriver(Server& server, const std::string& serialPortPath, const uint32_t& baudrate);
@@ -63,12 +68,16 @@ public:
 	int openConnection();
 	int closeConnection();
 	bool isConnected() const;
+	int setSerialCapture(const std::string& file);
+	void setReconnectEnabled(bool enabled);
 
 	// should return in how much milliseconds it wants to be called again
 	virtual int update() = 0;
 
 	virtual GCodeBuffer::GCODE_SET_RESULT setGCode(const std::string& gcode, int32_t totalLines = -1, GCodeBuffer::MetaData *metaData = 0);
 	virtual GCodeBuffer::GCODE_SET_RESULT appendGCode(const std::string& gcode, int32_t totalLines = -1, GCodeBuffer::MetaData *metaData = 0);
+	GCodeBuffer::GCODE_SET_RESULT stageGCode(GCodeBuffer::Staging& staging, const char* gcode, size_t len);
+	virtual GCodeBuffer::GCODE_SET_RESULT commitGCode(GCodeBuffer::Staging& staging, int32_t totalLines = -1, GCodeBuffer::MetaData *metaData = 0);
 	virtual void clearGCode();
 
 	virtual bool startPrint(const std::string& gcode, STATE state = PRINTING);
@@ -97,6 +106,7 @@ public:
 protected:
 	static const bool REQUEST_EXIT_ON_PORT_FAIL;
 	static const int VERBOSE_LOG_NEXT_LINE_EVERY_N_LINES;
+	static const int RECONNECT_POLL_INTERVAL;
 
 	bool heating_;
 	uint16_t temperature_;
@@ -110,11 +120,13 @@ protected:
 	Serial serial_;
 	Logger& log_;
 	Server& server_;
+	Scheduler scheduler_; //timed work of the driver, cleared when the port is closed
 
 	virtual void sendCode(const std::string& code, bool logAsInfo = false) = 0;
 	virtual void readResponseCode(std::string& code) = 0;
 
 	void printNextLine();
+	virtual void sendPrintLine(const std::string& line);
 	virtual bool resetPrint();
 
 	void setState(STATE state);
@@ -122,9 +134,19 @@ protected:
 	bool isPrinterOnline() const;
 
 	int readData();
+	void handlePortFailure(const char *reason);
+	int updateReconnect();
 	void setBaudrate(uint32_t baudrate);
 	void switchBaudrate();
+	uint32_t getBaudrate() const;
+
+	// called each time the port has been set to a (new) speed, drivers can (re)start their connection detection here
+	virtual void startConnectionCheck() {}
 
+	// called by commitGCode() once staged gcode has been checked, right before it is added to the buffer
+	virtual void stagingAccepted(const GCodeBuffer::Staging&, const GCodeBuffer::MetaData*) {}
+
+	void parseTemperatures(std::string& code);
 	int findNumber(const std::string& code, std::size_t startPos) const;
 	void extractGCodeInfo(const std::string& gcode);
 
@@ -138,6 +160,10 @@ private:
 
 	const std::string serialPortPath_;
 	uint32_t baudrate_;
+
+	bool reconnectEnabled_;
+	DeviceWatcher deviceWatcher_;
+	Timer reconnectTimer_;
 };
 
 #endif /* ! ABSTRACT_DRIVER_H_SEEN */
@@ -0,0 +1,106 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux
+# include <sys/inotify.h>
+#endif
+#include "DeviceWatcher.h"
+#include "../server/Logger.h"
+
+using std::string;
+
+//NOTE: see Server.cpp for comments on this macro
+#define LOG(lvl, fmt, ...) Logger::getInstance().log(lvl, "DEVW", fmt, ##__VA_ARGS__)
+
+DeviceWatcher::DeviceWatcher()
+: watching_(false), notifyFd_(-1) { }
+
+DeviceWatcher::~DeviceWatcher() {
+	stop();
+}
+
+/*
+ * Starts watching for the given device node. Returns 0 on success (also when falling back to polling) or -1 on error.
+ */
+int DeviceWatcher::start(const string& devicePath) {
+	stop();
+
+	devicePath_ = devicePath;
+	size_t slashPos = devicePath.rfind('/');
+	string dir = (slashPos == string::npos) ? "." : devicePath.substr(0, slashPos + 1);
+	deviceName_ = (slashPos == string::npos) ? devicePath : devicePath.substr(slashPos + 1);
+	if (deviceName_.empty()) return -1;
+
+#ifdef __linux
+	notifyFd_ = inotify_init();
+	if (notifyFd_ >= 0) {
+		int flags = fcntl(notifyFd_, F_GETFL, 0);
+		if (flags < 0 || fcntl(notifyFd_, F_SETFL, flags | O_NONBLOCK) < 0 ||
+				inotify_add_watch(notifyFd_, dir.c_str(), IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0) {
+			LOG(Logger::WARNING, "could not watch '%s' (%s), polling for device instead", dir.c_str(), strerror(errno));
+			::close(notifyFd_);
+			notifyFd_ = -1;
+		}
+	} else {
+		LOG(Logger::WARNING, "could not initialize inotify (%s), polling for device instead", strerror(errno));
+	}
+#endif
+
+	watching_ = true;
+	return 0;
+}
+
+void DeviceWatcher::stop() {
+	if (notifyFd_ >= 0) ::close(notifyFd_);
+	notifyFd_ = -1;
+	watching_ = false;
+}
+
+bool DeviceWatcher::isWatching() const {
+	return watching_;
+}
+
+//returns -1 if no file descriptor is available for watching (i.e., polling is required)
+int DeviceWatcher::getFileDescriptor() const {
+	return notifyFd_;
+}
+
+/*
+ * Returns true if the device node has (re)appeared. When inotify is used, this also drains pending events,
+ * so it must be called when the file descriptor becomes readable. Note that a node which appears does not
+ * have to be accessible yet (udev may still be adjusting its permissions).
+ */
+bool DeviceWatcher::checkAppeared() {
+	if (!watching_) return false;
+
+	bool appeared = false;
+
+#ifdef __linux
+	if (notifyFd_ >= 0) {
+		char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+		ssize_t len;
+
+		while ((len = ::read(notifyFd_, buf, sizeof(buf))) > 0) {
+			for (char *p = buf; p < buf + len; ) {
+				const struct inotify_event *event = (const struct inotify_event*)p;
+				if (event->len > 0 && deviceName_.compare(event->name) == 0) appeared = true;
+				p += sizeof(struct inotify_event) + event->len;
+			}
+		}
+
+		if (appeared) LOG(Logger::VERBOSE, "device node '%s' has been created or changed", devicePath_.c_str());
+		return appeared;
+	}
+#endif
+
+	return ::access(devicePath_.c_str(), F_OK) == 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#ifndef DEVICE_WATCHER_H_SEEN
+#define DEVICE_WATCHER_H_SEEN
+
+#include <string>
+
+/*
+ * Notices when a device node (re)appears, e.g. after a USB reset.
+ * On Linux, the directory containing the node is watched using inotify and the file descriptor
+ * returned by getFileDescriptor() becomes readable on changes. Elsewhere (or when inotify is not
+ * available) the fd is -1 and the caller should call checkAppeared() periodically instead.
+ */
+class DeviceWatcher {
+public:
+	DeviceWatcher();
+	~DeviceWatcher();
+
+	int start(const std::string& devicePath);
+	void stop();
+	bool isWatching() const;
+	int getFileDescriptor() const;
+
+	bool checkAppeared();
+
+private:
+	DeviceWatcher(const DeviceWatcher& o);
+	void operator=(const DeviceWatcher& o);
+
+	std::string devicePath_;
+	std::string deviceName_;
+	bool watching_;
+	int notifyFd_;
+};
+
+#endif /* ! DEVICE_WATCHER_H_SEEN */
@@ -8,6 +8,7 @@
 
 #include "MarlinDriver.h"
 #include "MakerbotDriver.h"
+#include "GrblDriver.h"
 #include "DriverFactory.h"
 
 //NOTE: see Server.cpp for comments on this macro
@@ -35,7 +36,8 @@ AbstractDriver* DriverFactory::createDriver(const std::string& driverName, Serve
 			// if match create driver instance
 			if((*f).name == driverName) {
 				LOG(Logger::INFO, "Created firmware: %s",(*f).name.c_str());
-				return di.creator(server, serialPortPath, baudrate);
+				AbstractDriver::creatorFunc creator = (*f).creator ? (*f).creator : di.creator;
+				return creator(server, serialPortPath, baudrate);
 			}
 		}
 	}
@@ -49,6 +51,7 @@ const DriverFactory::vec_DriverInfoP& DriverFactory::getDriverInfo() {
 	if(driverInfos.empty()) {
 		driverInfos.push_back( &MarlinDriver::getDriverInfo());
 		driverInfos.push_back(&MakerbotDriver::getDriverInfo());
+		driverInfos.push_back(&GrblDriver::getDriverInfo());
 	}
 
 	return driverInfos;
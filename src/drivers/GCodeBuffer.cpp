@@ -60,6 +60,41 @@ GCodeBuffer::GCodeBuffer()
 		MAX_BUFFER_SIZE / (float)1024, MAX_BUCKET_SIZE / (float)1024, BUFFER_SPLIT_SIZE / (float)1024);
 }
 
+GCodeBuffer::Staging::Staging()
+: size_(0), lines_(0)
+{ /* empty */ }
+
+GCodeBuffer::Staging::~Staging() {
+	clear();
+}
+
+void GCodeBuffer::Staging::clear() {
+	while (buckets_.size() > 0) {
+		delete buckets_.front();
+		buckets_.pop_front();
+	}
+	partialLine_.clear();
+	size_ = lines_ = 0;
+}
+
+//returns the size of the staged gcode after cleaning, an incomplete last line is not included
+int32_t GCodeBuffer::Staging::getSize() const {
+	return size_;
+}
+
+int32_t GCodeBuffer::Staging::getLines() const {
+	return lines_;
+}
+
+//the staged gcode is kept in parts, which consist of complete lines
+size_t GCodeBuffer::Staging::getNumParts() const {
+	return buckets_.size();
+}
+
+const string &GCodeBuffer::Staging::getPart(size_t index) const {
+	return *buckets_[index];
+}
+
 /**
  * When passed true, gcode cleanup will not touch GPX macro comments (';@...').
  */
@@ -97,6 +132,8 @@ GCodeBuffer::GCODE_SET_RESULT GCodeBuffer::set(const string &gcode, int32_t tota
  *
  * NOTE: this function splits given code into chunk of approximately BUFFER_SPLIT_SIZE.
  * without this, huge chunks (>1MB) would make repeated erase operations very inefficient.
+ * It is a shorthand for stage() followed by commit(), which can be used instead to add
+ * gcode arriving in parts without keeping all of it around until it is complete.
  */
 GCodeBuffer::GCODE_SET_RESULT GCodeBuffer::append(const string &gcode, int32_t totalLines, const MetaData *metaData) {
 	if (!metaData) {
@@ -110,96 +147,142 @@ GCodeBuffer::GCODE_SET_RESULT GCodeBuffer::append(const string &gcode, int32_t t
 	}
 
 
-	/* sanity checks */
-	GCODE_SET_RESULT sanity = GSR_OK;
+	GCODE_SET_RESULT gsr = checkSequence(metaData);
+	if (gsr != GSR_OK) return gsr;
 
-	if (md_.seqNumber > -1) {
-		if (!metaData || metaData->seqNumber < 0) sanity = GSR_SEQ_NUM_MISSING;
-		else if (md_.seqNumber + 1 != metaData->seqNumber) sanity = GSR_SEQ_NUM_MISMATCH; //each next one must be previous + 1
-	} else if (metaData && metaData->seqNumber >= 0) { //further checks if we have metaData _and_ sequence number is specified
-		if (metaData->seqNumber > 0) sanity = GSR_SEQ_NUM_MISMATCH; //first one to be sent must be 0
-		else if (getBufferSize() > 0) sanity = GSR_SEQ_NUM_MISMATCH; //first one must also be sent with first chunk
-	}
+	uint32_t startTime = getMillis();
+	Staging staging;
 
-	if (sanity == GSR_OK && md_.seqTotal > -1) {
-		if (!metaData || metaData->seqTotal < 0) sanity = GSR_SEQ_TTL_MISSING;
-		else if (md_.seqTotal != metaData->seqTotal) sanity = GSR_SEQ_TTL_MISMATCH;
-		else if (metaData->seqNumber + 1 > metaData->seqTotal) sanity = GSR_SEQ_NUM_MISMATCH;
-	}
+	gsr = stage(staging, gcode.data(), gcode.size());
+	if (gsr == GSR_OK) gsr = finishStaging(staging);
+	if (gsr == GSR_OK) commitPrepared(staging, totalLines, metaData);
 
-	if (sanity == GSR_OK && md_.source) {
-		if (!metaData || !metaData->source) sanity = GSR_SRC_MISSING;
-		else if (*md_.source != *metaData->source) sanity = GSR_SRC_MISMATCH;
+	if (gsr == GSR_OK) LOG(Logger::VERBOSE, "append() - added %zu bytes of gcode in %lu ms", gcode.size(), getMillis() - startTime);
+
+	return gsr;
+}
+
+void GCodeBuffer::clear() {
+	LOG(Logger::VERBOSE, "clear");
+
+	while (buckets_.size() > 0) {
+		string *b = buckets_.front();
+		delete b;
+		buckets_.pop_front();
 	}
 
-	if (sanity != GSR_OK) {
-		LOG(Logger::ERROR, "append() - sequence numbering error %i; num/ttl/src stats: own=%i/%i/%s, received=%i/%i/%s",
-				sanity, md_.seqNumber, md_.seqTotal, md_.source ? md_.source->c_str() : "(null)",
-				metaData->seqNumber, metaData->seqTotal, metaData->source ? metaData->source->c_str() : "(null)");
-		return sanity;
+	currentLine_ = bufferedLines_ = totalLinesSent_ = 0;
+	explicitTotalLines_ = -1;
+	bufferSize_ = 0;
+
+	md_.seqNumber = -1;
+	md_.seqTotal = -1;
+	if (md_.source) {
+		delete md_.source;
+		md_.source = 0;
 	}
+}
 
-	if (MAX_BUFFER_SIZE > 0 && getBufferSize() + gcode.length() > MAX_BUFFER_SIZE) {
-		LOG(Logger::ERROR, "append() - buffer full, rejecting gcode; codelen=%i, bufsize=%i, bufsizemax=%i",
-				gcode.length(), getBufferSize(), MAX_BUFFER_SIZE);
+/**
+ * Cleans given gcode and adds it to the staging, from which commit() adds it to the buffer.
+ * Only complete lines are cleaned, the rest is kept until more gcode is staged or the staging is committed.
+ *
+ * @return GSR_BUFFER_FULL if the buffer would not be able to take all staged gcode (the staging is left
+ * 		as it was), GSR_OK otherwise.
+ */
+GCodeBuffer::GCODE_SET_RESULT GCodeBuffer::stage(Staging &staging, const char *gcode, size_t len) const {
+	size_t stagedLen = staging.size_ + staging.partialLine_.length();
+	if (MAX_BUFFER_SIZE > 0 && getBufferSize() + stagedLen + len > MAX_BUFFER_SIZE) {
+		LOG(Logger::ERROR, "stage() - buffer full, rejecting gcode; codelen=%zu, staged=%zu, bufsize=%i, bufsizemax=%i",
+				len, stagedLen, getBufferSize(), MAX_BUFFER_SIZE);
 		return GSR_BUFFER_FULL;
 	}
 
+	const char *end = gcode + len;
+	const char *linesEnd = end;
+	while (linesEnd > gcode && linesEnd[-1] != '\n' && linesEnd[-1] != '\r') linesEnd--;
 
-	/* housekeeping */
+	if (linesEnd == gcode) {
+		staging.partialLine_.append(gcode, len);
+		return GSR_OK;
+	}
 
-	if (totalLines >= 0) explicitTotalLines_ = totalLines;
-	if (metaData) {
-		md_.seqNumber = metaData->seqNumber;
-		md_.seqTotal = metaData->seqTotal;
-		if (!md_.source && metaData->source) {
-			md_.source = new string(*metaData->source);
-		}
+	//complete the line left over from the previous chunk first
+	if (!staging.partialLine_.empty()) {
+		const char *lineEnd = gcode;
+		while (*lineEnd != '\n' && *lineEnd != '\r') lineEnd++;
+
+		string line;
+		line.swap(staging.partialLine_);
+		line.append(gcode, lineEnd + 1 - gcode);
+		stageLines(staging, line.data(), line.length());
+		gcode = lineEnd + 1;
 	}
 
+	stageLines(staging, gcode, linesEnd - gcode);
+	staging.partialLine_.assign(linesEnd, end - linesEnd);
 
-	/* finally add the gcode */
+	return GSR_OK;
+}
 
-	uint32_t startTime = getMillis();
-	int count = 0;
-	size_t size = gcode.size();
-	size_t start = 0;
+/**
+ * Cleans the incomplete line left in the staging, if any, and checks if the staged gcode can be committed
+ * with given meta data (see append()). If this returns GSR_OK, commit() will succeed as long as the buffer
+ * is not modified in the meantime.
+ */
+GCodeBuffer::GCODE_SET_RESULT GCodeBuffer::prepareCommit(Staging &staging, const MetaData *metaData) const {
+	GCODE_SET_RESULT gsr = checkSequence(metaData);
+	if (gsr != GSR_OK) return gsr;
 
-	while(start < gcode.size()) {
-		size_t len = BUFFER_SPLIT_SIZE;
-		size_t nl = gcode.find('\n', start + len);
+	return finishStaging(staging);
+}
 
-		len = (nl != string::npos) ? nl - start + 1 : gcode.size() - start;
-		appendChunk(gcode.substr(start, len));
-		count++;
-		start += len;
+/**
+ * Adds all staged gcode to the buffer at once, by moving its buckets over. If the gcode is rejected, the
+ * staging is discarded. Either way it is empty afterwards. See append() for the parameters.
+ */
+GCodeBuffer::GCODE_SET_RESULT GCodeBuffer::commit(Staging &staging, int32_t totalLines, const MetaData *metaData) {
+	GCODE_SET_RESULT gsr = prepareCommit(staging, metaData);
+	if (gsr != GSR_OK) {
+		staging.clear();
+		return gsr;
 	}
 
-	LOG(Logger::VERBOSE, "append() - added %zu bytes of gcode (%i chunks) in %lu ms",
-		size, count, getMillis() - startTime);
-
+	commitPrepared(staging, totalLines, metaData);
 	return GSR_OK;
 }
 
-void GCodeBuffer::clear() {
-	LOG(Logger::VERBOSE, "clear");
+/**
+ * Like commit(), but without checking anything; only to be used after prepareCommit() has returned GSR_OK
+ * for the same staging and meta data, without the buffer being modified in between.
+ */
+void GCodeBuffer::commitPrepared(Staging &staging, int32_t totalLines, const MetaData *metaData) {
+	if (totalLines >= 0) explicitTotalLines_ = totalLines;
+	if (metaData) {
+		md_.seqNumber = metaData->seqNumber;
+		md_.seqTotal = metaData->seqTotal;
+		if (!md_.source && metaData->source) {
+			md_.source = new string(*metaData->source);
+		}
+	}
 
-	while (buckets_.size() > 0) {
-		string *b = buckets_.front();
-		delete b;
-		buckets_.pop_front();
+	//the first staged bucket is merged into the last one if it fits, so small transactions do not fragment the buffer
+	deque_stringP::iterator first = staging.buckets_.begin();
+	if (!buckets_.empty() && first != staging.buckets_.end() && buckets_.back()->length() + (*first)->length() <= MAX_BUCKET_SIZE) {
+		buckets_.back()->append(**first);
+		delete *first;
+		++first;
 	}
+	buckets_.insert(buckets_.end(), first, staging.buckets_.end());
+	staging.buckets_.clear();
 
-	currentLine_ = bufferedLines_ = totalLinesSent_ = 0;
-	explicitTotalLines_ = -1;
-	bufferSize_ = 0;
+	bufferSize_ += staging.size_;
+	bufferedLines_ += staging.lines_;
+	totalLinesSent_ += staging.lines_;
+	if (currentLine_ > totalLinesSent_) currentLine_ = totalLinesSent_;
 
-	md_.seqNumber = -1;
-	md_.seqTotal = -1;
-	if (md_.source) {
-		delete md_.source;
-		md_.source = 0;
-	}
+	LOG(Logger::BULK, "commit() - added %i bytes (%i lines) of staged gcode", staging.size_, staging.lines_);
+	staging.clear();
 }
 
 int32_t GCodeBuffer::getCurrentLine() const {
@@ -274,6 +357,33 @@ int32_t GCodeBuffer::getNextLine(string &line, size_t amount) const {
 	return counter;
 }
 
+/*
+ * Looks up the line offset lines after the first one without removing anything, this does work across
+ * bucket boundaries (buckets always end with a complete line). Returns 1 if the line exists, 0 otherwise.
+ */
+int32_t GCodeBuffer::peekLine(string &line, size_t offset) const {
+	for (deque_stringP::const_iterator it = buckets_.begin(); it != buckets_.end(); ++it) {
+		const string *b = *it;
+		size_t start = 0;
+
+		while (start < b->length()) {
+			size_t end = b->find('\n', start);
+			if (end == string::npos) end = b->length();
+
+			if (offset == 0) {
+				line = b->substr(start, end - start);
+				return 1;
+			}
+
+			offset--;
+			start = end + 1;
+		}
+	}
+
+	line = "";
+	return 0;
+}
+
 //FIXME: this function does currently not operate across bucket boundaries
 //NOTE: if amount of lines is not present, remove as many as possible
 int32_t GCodeBuffer::eraseLine(size_t amount) {
@@ -318,37 +428,95 @@ const std::string &GCodeBuffer::getGcodeSetResultString(GCODE_SET_RESULT gsr) {
  * PRIVATE FUNCTIONS *
  *********************/
 
-void GCodeBuffer::appendChunk(const string &gcode) {
-	if (buckets_.size() == 0) buckets_.push_back(new string());
-	string *b = buckets_.back();
-	if (b->length() >= MAX_BUCKET_SIZE) {
-		b = new string();
-		buckets_.push_back(b);
+//returns GSR_OK if metaData is consistent with the meta data given before, see append()
+GCodeBuffer::GCODE_SET_RESULT GCodeBuffer::checkSequence(const MetaData *metaData) const {
+	GCODE_SET_RESULT sanity = GSR_OK;
+
+	if (md_.seqNumber > -1) {
+		if (!metaData || metaData->seqNumber < 0) sanity = GSR_SEQ_NUM_MISSING;
+		else if (md_.seqNumber + 1 != metaData->seqNumber) sanity = GSR_SEQ_NUM_MISMATCH; //each next one must be previous + 1
+	} else if (metaData && metaData->seqNumber >= 0) { //further checks if we have metaData _and_ sequence number is specified
+		if (metaData->seqNumber > 0) sanity = GSR_SEQ_NUM_MISMATCH; //first one to be sent must be 0
+		else if (getBufferSize() > 0) sanity = GSR_SEQ_NUM_MISMATCH; //first one must also be sent with first chunk
+	}
+
+	if (sanity == GSR_OK && md_.seqTotal > -1) {
+		if (!metaData || metaData->seqTotal < 0) sanity = GSR_SEQ_TTL_MISSING;
+		else if (md_.seqTotal != metaData->seqTotal) sanity = GSR_SEQ_TTL_MISMATCH;
+		else if (metaData->seqNumber + 1 > metaData->seqTotal) sanity = GSR_SEQ_NUM_MISMATCH;
+	}
+
+	if (sanity == GSR_OK && md_.source) {
+		if (!metaData || !metaData->source) sanity = GSR_SRC_MISSING;
+		else if (*md_.source != *metaData->source) sanity = GSR_SRC_MISMATCH;
+	}
+
+	if (sanity != GSR_OK) {
+		LOG(Logger::ERROR, "append() - sequence numbering error %i; num/ttl/src stats: own=%i/%i/%s, received=%i/%i/%s",
+				sanity, md_.seqNumber, md_.seqTotal, md_.source ? md_.source->c_str() : "(null)",
+				metaData ? metaData->seqNumber : -1, metaData ? metaData->seqTotal : -1,
+				metaData && metaData->source ? metaData->source->c_str() : "(null)");
 	}
 
+	return sanity;
+}
+
+//cleans the incomplete line left in the staging, if any, and checks if the buffer can take all staged gcode
+GCodeBuffer::GCODE_SET_RESULT GCodeBuffer::finishStaging(Staging &staging) const {
+	if (!staging.partialLine_.empty()) {
+		string line;
+		line.swap(staging.partialLine_);
+		stageLines(staging, line.data(), line.length());
+	}
+
+	if (MAX_BUFFER_SIZE > 0 && getBufferSize() + (size_t)staging.size_ > MAX_BUFFER_SIZE) {
+		LOG(Logger::ERROR, "prepareCommit() - buffer full, rejecting gcode; staged=%i, bufsize=%i, bufsizemax=%i",
+				staging.size_, getBufferSize(), MAX_BUFFER_SIZE);
+		return GSR_BUFFER_FULL;
+	}
+
+	return GSR_OK;
+}
+
+//stages complete lines, split in parts of about BUFFER_SPLIT_SIZE (see append())
+void GCodeBuffer::stageLines(Staging &staging, const char *gcode, size_t len) const {
+	size_t start = 0;
+
+	while (start < len) {
+		size_t partLen = len - start;
+		if (partLen > BUFFER_SPLIT_SIZE) {
+			const char *nl = (const char*)memchr(gcode + start + BUFFER_SPLIT_SIZE, '\n', partLen - BUFFER_SPLIT_SIZE);
+			if (nl) partLen = nl - (gcode + start) + 1;
+		}
+
+		stageChunk(staging, gcode + start, partLen);
+		start += partLen;
+	}
+}
+
+void GCodeBuffer::stageChunk(Staging &staging, const char *gcode, size_t len) const {
+	deque_stringP &buckets = staging.buckets_;
+	if (buckets.size() == 0 || buckets.back()->length() >= MAX_BUCKET_SIZE) buckets.push_back(new string());
+	string *b = buckets.back();
+
 	size_t pos = b->length();
-	b->append(gcode);
+	b->append(gcode, len);
 	cleanupGCode(b, pos);
-	bufferSize_ += gcode.length();
-	updateStats(b, pos);
-}
+	staging.size_ += (int32_t)b->length() - (int32_t)pos;
 
-void GCodeBuffer::updateStats(string *buffer, size_t pos) {
-	int32_t addedLineCount = std::count(buffer->begin() + pos, buffer->end(), '\n');
-	if (buffer->length() > 0 && buffer->at(buffer->length() - 1) != '\n') addedLineCount++;
-	bufferedLines_ += addedLineCount;
-	totalLinesSent_ += addedLineCount;
-	if (currentLine_ > totalLinesSent_) currentLine_ = totalLinesSent_;
+	if (pos > b->length()) pos = b->length();
+	int32_t addedLineCount = std::count(b->begin() + pos, b->end(), '\n');
+	if (b->length() > 0 && b->at(b->length() - 1) != '\n') addedLineCount++;
+	staging.lines_ += addedLineCount;
 }
 
-void GCodeBuffer::cleanupGCode(string *buffer, size_t pos) {
+void GCodeBuffer::cleanupGCode(string *buffer, size_t pos) const {
 	uint32_t startTime = getMillis(), commentDelta, doubleNLDelta, endTime;
 
 //	LOG(Logger::BULK, "cleanupGCode");
 //	LOG(Logger::BULK, "  pos: %i",pos);
 //	LOG(Logger::BULK, "  ////////// buffer: ");
 //	LOG(Logger::BULK, "  \n%s\n////////// end buffer",buffer->c_str());
-	size_t buflen = buffer->length();
 
 	//replace \r with \n
 	std::replace(buffer->begin() + pos, buffer->end(), '\r', '\n');
@@ -405,8 +573,6 @@ void GCodeBuffer::cleanupGCode(string *buffer, size_t pos) {
 //	LOG(Logger::BULK, "  ////////// >>>buffer: ");
 //	LOG(Logger::BULK, "  \n%s\n////////// end >>>buffer",buffer->c_str());
 
-	bufferSize_ -= (buflen - buffer->length());
-
 	endTime = getMillis();
 	LOG(Logger::BULK, "cleanupGCode(): took %lu ms (%lu removing comments, %lu removing double newlines)",
 		endTime - startTime, commentDelta - startTime, doubleNLDelta - commentDelta);
@@ -39,6 +39,36 @@ public:
 	};
 
 
+	/*
+	 * Gcode which has been cleaned and split into buckets like buffered gcode, but is not part of the buffer yet.
+	 * It is filled by GCodeBuffer::stage() as chunks come in and handed over as a whole by GCodeBuffer::commit(),
+	 * or thrown away with clear().
+	 */
+	class Staging {
+	public:
+		Staging();
+		~Staging();
+
+		void clear();
+
+		int32_t getSize() const;
+		int32_t getLines() const;
+		size_t getNumParts() const;
+		const std::string &getPart(size_t index) const;
+
+	private:
+		friend class GCodeBuffer;
+
+		Staging(const Staging& o);
+		void operator=(const Staging& o);
+
+		deque_stringP buckets_;
+		std::string partialLine_; //a line is only cleaned once it is complete, this holds the start of the next one
+		int32_t size_;
+		int32_t lines_;
+	};
+
+
 	GCodeBuffer();
 
 	void setKeepGpxMacroComments(bool keep);
@@ -47,6 +77,11 @@ public:
 	GCODE_SET_RESULT append(const std::string &gcode, int32_t totalLines = -1, const MetaData *metaData = 0);
 	void clear();
 
+	GCODE_SET_RESULT stage(Staging &staging, const char *gcode, size_t len) const;
+	GCODE_SET_RESULT prepareCommit(Staging &staging, const MetaData *metaData = 0) const;
+	GCODE_SET_RESULT commit(Staging &staging, int32_t totalLines = -1, const MetaData *metaData = 0);
+	void commitPrepared(Staging &staging, int32_t totalLines = -1, const MetaData *metaData = 0);
+
 	int32_t getCurrentLine() const;
 	int32_t getBufferedLines() const;
 	int32_t getTotalLinesSent() const;
@@ -60,6 +95,7 @@ public:
 	void setCurrentLine(int32_t line);
 
 	int32_t getNextLine(std::string &line, size_t amount = 1) const;
+	int32_t peekLine(std::string &line, size_t offset) const;
 	int32_t eraseLine(size_t amount = 1);
 
 	static const std::string &getGcodeSetResultString(GCODE_SET_RESULT gsr);
@@ -85,9 +121,11 @@ private:
 
 	Logger& log_;
 
-	void appendChunk(const std::string &gcode);
-	void updateStats(std::string *buffer, size_t pos);
-	void cleanupGCode(std::string *buffer, const size_t pos);
+	GCODE_SET_RESULT checkSequence(const MetaData *metaData) const;
+	GCODE_SET_RESULT finishStaging(Staging &staging) const;
+	void stageLines(Staging &staging, const char *gcode, size_t len) const;
+	void stageChunk(Staging &staging, const char *gcode, size_t len) const;
+	void cleanupGCode(std::string *buffer, const size_t pos) const;
 };
 
 #endif /* ! GCODE_BUFFER_H_SEEN */
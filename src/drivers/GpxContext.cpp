@@ -0,0 +1,93 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#include "GpxContext.h"
+#include "../aux/GPX.git/libgpx.h"
+
+using std::string;
+
+const int GpxContext::ERR_IN_USE = -1000;
+
+pthread_mutex_t GpxContext::mutex_ = PTHREAD_MUTEX_INITIALIZER;
+const GpxContext *GpxContext::owner_ = 0;
+
+GpxContext::GpxContext()
+: suppressEpilogue_(false), clearPending_(true) { }
+
+GpxContext::~GpxContext() {
+	pthread_mutex_lock(&mutex_);
+	if (owner_ == this) owner_ = 0;
+	pthread_mutex_unlock(&mutex_);
+}
+
+void GpxContext::setSuppressEpilogue(bool suppress) {
+	pthread_mutex_lock(&mutex_);
+	suppressEpilogue_ = suppress;
+	if (owner_ == this) gpx_setSuppressEpilogue(suppress ? 1 : 0);
+	pthread_mutex_unlock(&mutex_);
+}
+
+void GpxContext::setBuildName(const string& name) {
+	pthread_mutex_lock(&mutex_);
+	buildName_ = name;
+	if (owner_ == this) gpx_setBuildName(buildName_.c_str());
+	pthread_mutex_unlock(&mutex_);
+}
+
+//takes GPX for this context unless another one owns it, returns true if this context owns it
+bool GpxContext::acquire() {
+	pthread_mutex_lock(&mutex_);
+	if (owner_ == 0) owner_ = this;
+	bool owned = (owner_ == this);
+	pthread_mutex_unlock(&mutex_);
+	return owned;
+}
+
+//lets other contexts use GPX, this context starts with a clean machine state once it gets it again
+void GpxContext::release() {
+	pthread_mutex_lock(&mutex_);
+	clearPending_ = true;
+	if (owner_ == this) owner_ = 0;
+	pthread_mutex_unlock(&mutex_);
+}
+
+//the next conversion starts with a clean machine state, GPX stays owned by this context
+void GpxContext::clearState() {
+	pthread_mutex_lock(&mutex_);
+	clearPending_ = true;
+	pthread_mutex_unlock(&mutex_);
+}
+
+/*
+ * Converts gcode to x3g like gpx_convert() (the caller must free() the result), using this context's settings and state.
+ * Takes GPX if nobody owns it, returns ERR_IN_USE without converting anything if another context does.
+ */
+int GpxContext::convert(const char *gcode, long len, unsigned char **x3g, long *x3gLen) {
+	pthread_mutex_lock(&mutex_);
+
+	if (owner_ != 0 && owner_ != this) {
+		pthread_mutex_unlock(&mutex_);
+		*x3g = 0;
+		*x3gLen = 0;
+		return ERR_IN_USE;
+	}
+
+	if (owner_ != this || clearPending_) {
+		gpx_clear_state();
+		gpx_setSuppressEpilogue(suppressEpilogue_ ? 1 : 0);
+		if (!buildName_.empty()) gpx_setBuildName(buildName_.c_str());
+
+		owner_ = this;
+		clearPending_ = false;
+	}
+
+	int rv = gpx_convert(gcode, len, x3g, x3gLen);
+
+	pthread_mutex_unlock(&mutex_);
+	return rv;
+}
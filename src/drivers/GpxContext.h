@@ -0,0 +1,48 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#ifndef GPX_CONTEXT_H_SEEN
+#define GPX_CONTEXT_H_SEEN
+
+#include <pthread.h>
+#include <string>
+
+/*
+ * Per-printer front for GPX, which serializes GPX use between printers. GPX keeps its machine state
+ * and settings in globals and cannot save them, so only one job can be converted at a time: a context
+ * owns GPX from acquire() (or its first conversion) until release(), other contexts have to wait for
+ * that. Each context keeps its own settings, which are applied when GPX's state is cleared for it.
+ */
+class GpxContext {
+public:
+	static const int ERR_IN_USE; //returned by convert() while another context owns GPX
+
+	GpxContext();
+	~GpxContext();
+
+	void setSuppressEpilogue(bool suppress);
+	void setBuildName(const std::string& name);
+
+	bool acquire();
+	void release();
+	void clearState();
+	int convert(const char *gcode, long len, unsigned char **x3g, long *x3gLen);
+
+private:
+	static pthread_mutex_t mutex_;
+	static const GpxContext *owner_; //the context which owns GPX, if any
+
+	GpxContext(const GpxContext& o);
+	void operator=(const GpxContext& o);
+
+	bool suppressEpilogue_;
+	std::string buildName_;
+	bool clearPending_; //GPX state must be cleared before the next conversion
+};
+
+#endif /* ! GPX_CONTEXT_H_SEEN */
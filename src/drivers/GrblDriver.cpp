@@ -0,0 +1,327 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#include "GrblDriver.h"
+
+using std::string;
+using std::size_t;
+
+//NOTE: see Server.cpp for comments on this macro
+#define LOG(lvl, fmt, ...) log_.log(lvl, "GRBL", fmt, ##__VA_ARGS__)
+
+const uint32_t GrblDriver::DEFAULT_BAUDRATE = 115200;
+const size_t GrblDriver::GRBL_RX_BUFFER_SIZE = 128;
+const size_t GrblDriver::SMOOTHIEWARE_RX_BUFFER_SIZE = 256;
+const int GrblDriver::STATUS_INTERVAL_PRINTING = 250;
+const int GrblDriver::STATUS_INTERVAL_IDLE = 1000;
+const int GrblDriver::TEMPERATURE_INTERVAL = 2000;
+const int GrblDriver::CONNECT_PROBE_INTERVAL = 500;
+const int GrblDriver::CONNECT_BAUDRATE_TIMEOUT = 3000;
+
+GrblDriver::GrblDriver(Server& server, const string& serialPortPath, size_t rxBufferSize)
+: AbstractDriver(server, serialPortPath, DEFAULT_BAUDRATE),
+  checkConnection_(true),
+  pollTemperature_(true),
+  statusAfterLastAck_(false),
+  printLinesInFlight_(0),
+  bytesInFlight_(0),
+  rxBufferSize_(rxBufferSize),
+  errorCount_(0) {
+}
+
+/*
+ * Lines are streamed whenever acknowledgements come in (the serial port is part of the server's event loop),
+ * status and temperature polls as well as the connection check run from scheduler_.
+ */
+int GrblDriver::update() {
+	if (!isConnected()) return (state_ == RECONNECTING) ? updateReconnect() : -1;
+
+	if (readData() > 0) {
+		string* line;
+		while((line = serial_.extractLine()) != NULL) {
+			readResponseCode(*line);
+			delete line;
+		}
+	}
+
+	if (!isConnected()) return 0; //the port failed while reading
+
+	int task;
+	while ((task = scheduler_.popDueTask()) != Scheduler::NO_TASK) runTask((TASK)task);
+
+	if (!checkConnection_) {
+		streamLines();
+		if (state_ == PRINTING || state_ == STOPPING) finishPrintIfDone();
+	}
+
+	return scheduler_.getTimeout();
+}
+
+
+/***********************
+ * PROTECTED FUNCTIONS *
+ ***********************/
+
+bool GrblDriver::startPrint(STATE state) {
+	if (!AbstractDriver::startPrint(state)) return false;
+	errorCount_ = 0;
+	scheduler_.schedule(TASK_STATUS, STATUS_INTERVAL_PRINTING);
+	streamLines();
+	return true;
+}
+
+//print lines still in flight stay in the gcode buffer, acknowledgements arriving for them later do not remove them
+bool GrblDriver::resetPrint() {
+	for (std::deque<SentLine>::iterator it = inFlight_.begin(); it != inFlight_.end(); ++it) it->printLine = false;
+	printLinesInFlight_ = 0;
+	return AbstractDriver::resetPrint();
+}
+
+void GrblDriver::readResponseCode(string& code) {
+	LOG(checkConnection_ ? Logger::INFO : Logger::BULK, "readResponseCode(): '%s'", code.c_str());
+
+	if (code.empty()) return;
+
+	bool connectionResponse = true;
+
+	if (code[0] == '<') {
+		parseStatusReport(code);
+
+	} else if (code.find("ok") == 0) {
+		if (code.find("T:") != string::npos) parseTemperatures(code); //Smoothieware's M105 response
+		handleAck(code, false);
+
+	} else if (code.find("error") == 0) {
+		handleAck(code, true);
+
+	} else if (code.find("ALARM") == 0) {
+		LOG(Logger::ERROR, "firmware alarm '%s', the machine has to be unlocked before it accepts commands", code.c_str());
+		if (state_ == PRINTING || state_ == STOPPING) {
+			LOG(Logger::WARNING, "print aborted, keeping %i buffered lines", getBufferedLines());
+			resetPrint();
+		}
+
+	} else if (code.find("Grbl") == 0) {
+		LOG(Logger::INFO, "firmware: %s", code.c_str());
+		pollTemperature_ = false;
+
+		//the banner is printed after a reset, which discards everything in the receive buffer
+		inFlight_.clear();
+		printLinesInFlight_ = 0;
+		bytesInFlight_ = 0;
+		if (!checkConnection_ && (state_ == PRINTING || state_ == STOPPING)) {
+			LOG(Logger::WARNING, "firmware was reset during print, keeping %i buffered lines", getBufferedLines());
+			resetPrint();
+		}
+
+	} else if (code[0] == '[') {
+		LOG(Logger::INFO, "firmware message: %s", code.c_str());
+
+	} else if (code.find("T:") == 0) {
+		parseTemperatures(code);
+
+	} else {
+		connectionResponse = false;
+	}
+
+	if (checkConnection_ && connectionResponse) {
+		checkConnection_ = false;
+		LOG(Logger::INFO, "connected at %i baud after %.0f ms", getBaudrate(), connectTimer_.getElapsedTimeInMilliSec());
+		setState(IDLE);
+		scheduler_.cancel(TASK_CONNECT_TIMEOUT);
+		scheduler_.schedule(TASK_STATUS, STATUS_INTERVAL_IDLE);
+		scheduler_.schedule(TASK_TEMPERATURE, TEMPERATURE_INTERVAL);
+	}
+}
+
+void GrblDriver::sendCode(const string& code, bool logAsInfo) {
+	LOG(logAsInfo ? Logger::INFO : Logger::BULK, "sendCode(): %s", code.c_str());
+	if (isConnected()) {
+		AbstractDriver::extractGCodeInfo(code);
+		commandQueue_.push_back(code);
+		streamLines();
+	}
+}
+
+void GrblDriver::startConnectionCheck() {
+	checkConnection_ = true;
+	machineState_ = "";
+	commandQueue_.clear();
+	inFlight_.clear();
+	printLinesInFlight_ = 0;
+	bytesInFlight_ = 0;
+	connectTimer_.start();
+	scheduler_.cancelAll();
+	scheduler_.schedule(TASK_STATUS, CONNECT_PROBE_INTERVAL);
+	scheduler_.schedule(TASK_CONNECT_TIMEOUT, CONNECT_BAUDRATE_TIMEOUT);
+}
+
+/*
+ * Parses status reports, which are returned in response to a '?'. Examples:
+ *   <Idle|MPos:0.000,0.000,0.000|FS:0,0|WCO:0.000,0.000,0.000> (grbl 1.1)
+ *   <Run,MPos:10.000,0.000,0.000,WPos:10.000,0.000,0.000>       (grbl 0.9, Smoothieware)
+ */
+void GrblDriver::parseStatusReport(const string& report) {
+	size_t end = report.find_first_of("|,>", 1);
+	string state = report.substr(1, (end == string::npos) ? string::npos : end - 1);
+
+	//drop sub states like in 'Hold:0'
+	size_t colonPos = state.find(':');
+	if (colonPos != string::npos) state.erase(colonPos);
+
+	if (state != machineState_) LOG(Logger::VERBOSE, "machine state: '%s'", state.c_str());
+	machineState_ = state;
+	statusAfterLastAck_ = true;
+}
+
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+void GrblDriver::runTask(TASK task) {
+	bool printing = (state_ == PRINTING || state_ == STOPPING);
+
+	switch (task) {
+		case TASK_STATUS:
+			probe();
+			if (checkConnection_) scheduler_.schedule(TASK_STATUS, CONNECT_PROBE_INTERVAL);
+			else scheduler_.schedule(TASK_STATUS, printing ? STATUS_INTERVAL_PRINTING : STATUS_INTERVAL_IDLE);
+			break;
+		case TASK_TEMPERATURE:
+			if (!pollTemperature_ || checkConnection_) break;
+			sendCode("M105");
+			scheduler_.schedule(TASK_TEMPERATURE, TEMPERATURE_INTERVAL);
+			break;
+		case TASK_CONNECT_TIMEOUT:
+			if (!checkConnection_) break;
+			LOG(Logger::INFO, "no response at %i baud, switching baud rate", getBaudrate());
+			serial_.clearBuffer();
+			serial_.flushReadBuffer();
+			switchBaudrate(); //restarts the connection check
+			break;
+	}
+}
+
+/*
+ * Sends queued commands and, while printing, buffered gcode lines for as long as they fit in the
+ * firmware's receive buffer. All lines are collected into a single write. Print lines are left in
+ * the gcode buffer until they have been acknowledged (see handleAck()), so none are lost when the
+ * firmware is reset.
+ */
+void GrblDriver::streamLines() {
+	bool printing = (state_ == PRINTING || state_ == STOPPING);
+	string batch;
+	int numPrintLines = 0;
+
+	while (true) {
+		bool fromQueue = !commandQueue_.empty();
+		string line;
+
+		if (fromQueue) line = commandQueue_.front();
+		else if (!printing || gcodeBuffer_.peekLine(line, printLinesInFlight_) <= 0) break;
+
+		//a line longer than the receive buffer is sent on its own, the firmware will report an error for it
+		size_t len = line.length() + 1;
+		if (bytesInFlight_ > 0 && bytesInFlight_ + len > rxBufferSize_) break;
+
+		if (fromQueue) {
+			commandQueue_.pop_front();
+		} else {
+			AbstractDriver::extractGCodeInfo(line);
+			printLinesInFlight_++;
+			numPrintLines++;
+		}
+
+		batch += line;
+		batch += '\n';
+		inFlight_.push_back(SentLine(line, !fromQueue));
+		bytesInFlight_ += len;
+	}
+
+	if (batch.empty()) return;
+
+	LOG(Logger::BULK, "streaming %i bytes (%i print lines), %i bytes in flight", batch.length(), numPrintLines, bytesInFlight_);
+	serial_.send(batch.c_str());
+}
+
+void GrblDriver::handleAck(const string& response, bool error) {
+	if (inFlight_.empty()) {
+		LOG(Logger::VERBOSE, "received '%s' without any line in flight", response.c_str());
+		return;
+	}
+
+	const SentLine& sent = inFlight_.front();
+
+	if (error) {
+		if (sent.line.find("M105") == 0) {
+			LOG(Logger::INFO, "firmware does not report temperatures, no longer polling them");
+			pollTemperature_ = false;
+		} else {
+			errorCount_++;
+			LOG(Logger::WARNING, "firmware reported '%s' for line '%s' (errors: %i)", response.c_str(), sent.line.c_str(), errorCount_);
+		}
+	}
+
+	//the firmware is done with the line (also when it reported an error for it), so it counts as printed;
+	//unless the buffer has been cleared in the meantime, which ends the print
+	if (sent.printLine) {
+		printLinesInFlight_--;
+		if (state_ == PRINTING || state_ == STOPPING) {
+			gcodeBuffer_.eraseLine();
+			gcodeBuffer_.setCurrentLine(gcodeBuffer_.getCurrentLine() + 1);
+		}
+	}
+
+	bytesInFlight_ -= sent.line.length() + 1;
+	inFlight_.pop_front();
+	statusAfterLastAck_ = false;
+}
+
+//the print is done when all lines have been acknowledged and a status report received afterwards says the machine is idle
+void GrblDriver::finishPrintIfDone() {
+	if (gcodeBuffer_.getBufferedLines() > 0 || !commandQueue_.empty() || !inFlight_.empty()) return;
+	if (!statusAfterLastAck_ || machineState_ != "Idle") return;
+
+	LOG(Logger::INFO, "print finished (%i errors reported)", errorCount_);
+	resetPrint();
+}
+
+//requests a status report, '?' is handled immediately by the firmware and does not take up receive buffer space
+void GrblDriver::probe() {
+	serial_.write((unsigned char)'?');
+}
+
+
+
+//STATIC
+const AbstractDriver::DriverInfo& GrblDriver::getDriverInfo() {
+	static AbstractDriver::vec_FirmwareDescription supportedFirmware;
+	static AbstractDriver::DriverInfo info;
+
+	if (supportedFirmware.empty()) {
+		info.name = "Grbl";
+
+		supportedFirmware.push_back( AbstractDriver::FirmwareDescription("grbl_generic") );
+		supportedFirmware.push_back( AbstractDriver::FirmwareDescription("smoothieware_generic", &GrblDriver::createSmoothieware) );
+
+		info.supportedFirmware = supportedFirmware;
+		info.creator = &GrblDriver::create;
+	};
+
+	return info;
+}
+
+//the baud rate is not used, connecting always starts at grbl's default rate (see switchBaudrate() for the others tried)
+AbstractDriver* GrblDriver::create(Server& server, const string& serialPortPath, const uint32_t&) {
+	return new GrblDriver(server, serialPortPath, GRBL_RX_BUFFER_SIZE);
+}
+
+AbstractDriver* GrblDriver::createSmoothieware(Server& server, const string& serialPortPath, const uint32_t&) {
+	return new GrblDriver(server, serialPortPath, SMOOTHIEWARE_RX_BUFFER_SIZE);
+}
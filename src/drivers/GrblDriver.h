@@ -0,0 +1,90 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#ifndef GRBL_DRIVER_H_SEEN
+#define GRBL_DRIVER_H_SEEN
+
+#include <deque>
+#include <string>
+#include "../Timer.h"
+#include "AbstractDriver.h"
+#include "../server/Logger.h"
+
+/*
+ * Driver for grbl and firmware streaming the same way (like Smoothieware). Instead of waiting for an
+ * 'ok' after each line, lines are streamed as long as they fit in the firmware's receive buffer
+ * ('character counting'), so its planner never runs dry.
+ */
+class GrblDriver : public AbstractDriver {
+public:
+	GrblDriver(Server& server, const std::string& serialPortPath, size_t rxBufferSize);
+
+	static const AbstractDriver::DriverInfo& getDriverInfo();
+	virtual int update();
+
+	static AbstractDriver* create(Server& server, const std::string& serialPortPath, const uint32_t& baudrate);
+	static AbstractDriver* createSmoothieware(Server& server, const std::string& serialPortPath, const uint32_t& baudrate);
+
+protected:
+	bool startPrint(STATE state);
+	bool resetPrint();
+
+	void readResponseCode(std::string& code);
+	void sendCode(const std::string& code, bool logAsInfo = false);
+	void startConnectionCheck();
+
+	void parseStatusReport(const std::string& report);
+
+	std::string machineState_; //as reported in status reports (e.g. 'Idle', 'Run' or 'Alarm')
+
+private:
+	//timed work, see runTask()
+	typedef enum TASK {
+		TASK_STATUS,         /* status report request, also used to probe for the firmware while connecting */
+		TASK_TEMPERATURE,
+		TASK_CONNECT_TIMEOUT /* switches the baud rate if the firmware did not respond */
+	} TASK;
+
+	//a line sent but not yet acknowledged, print lines are only removed from the gcode buffer once acknowledged
+	struct SentLine {
+		std::string line;
+		bool printLine;
+		SentLine(const std::string& l, bool p)
+		: line(l), printLine(p)
+		{}
+	};
+
+	static const uint32_t DEFAULT_BAUDRATE;
+	static const size_t GRBL_RX_BUFFER_SIZE;
+	static const size_t SMOOTHIEWARE_RX_BUFFER_SIZE;
+	static const int STATUS_INTERVAL_PRINTING;
+	static const int STATUS_INTERVAL_IDLE;
+	static const int TEMPERATURE_INTERVAL;
+	static const int CONNECT_PROBE_INTERVAL;
+	static const int CONNECT_BAUDRATE_TIMEOUT;
+
+	Timer connectTimer_;
+	bool checkConnection_;
+	bool pollTemperature_;         //disabled for grbl, which has no heaters
+	bool statusAfterLastAck_;      //used to tell whether 'Idle' really means all sent commands have been executed
+
+	std::deque<std::string> commandQueue_; //commands not being part of a print, sent before any print lines
+	std::deque<SentLine> inFlight_;        //lines sent but not yet acknowledged
+	size_t printLinesInFlight_;            //number of entries in inFlight_ which are still at the front of the gcode buffer
+	size_t bytesInFlight_;
+	const size_t rxBufferSize_;            //size of the firmware's receive buffer
+	int errorCount_;
+
+	void runTask(TASK task);
+	void streamLines();
+	void handleAck(const std::string& response, bool error);
+	void finishPrintIfDone();
+	void probe();
+};
+
+#endif /* ! GRBL_DRIVER_H_SEEN */
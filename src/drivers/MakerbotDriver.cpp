@@ -8,8 +8,7 @@
 
 /*
  * TODO:
- * - Implement progress approximation (see cmdToLineRatio_, currently commented out because they contain bugs).
- * - In convertGCode: instead of separating the conversion buffer into separate commands again (with the parser), it would be better to adapt gpx to emit() these commands one by one (or something similar)...
+ * - In X3GConverter: instead of separating the conversion buffer into separate commands again (with the parser), it would be better to adapt gpx to emit() these commands one by one (or something similar)...
  * - only build aux/uci.git on osx (with BUILD_LUA disabled, and possibly patch the makefile to disable building the executable?). for openwrt, add a dependency on libuci instead
  * - read uci config in server to create the correct type of driver (see lua frontend for reference)
  *   -> also read baud rate to allow setting it to a fixed value? (i.e., disable auto-switching in marlindriver)
@@ -30,128 +29,158 @@
 #include <unistd.h>
 #include <cstring>
 #include "MakerbotDriver.h"
+#include "config.h"
 #include "../server/Server.h"
-#include "../aux/GPX.git/libgpx.h"
 
 using std::cout;
 using std::endl;
 using std::string;
-using std::vector;
 
 //NOTE: see Server.cpp for comments on this macro
 #ifndef LOG
 # define LOG(lvl, fmt, ...) log_.log(lvl, "MBTD", fmt, ##__VA_ARGS__)
 #endif
 
+#ifndef X3G_CACHE_DIR
+# define X3G_CACHE_DIR "/tmp/print3d-x3g"
+#endif
+#ifndef X3G_CACHE_MAX_SIZE_KB
+# define X3G_CACHE_MAX_SIZE_KB 4096
+#endif
+
 const int MakerbotDriver::PRINTER_BUFFER_SIZE = 512;
+const size_t MakerbotDriver::LOOKAHEAD_BYTES = 8 * 1024; //converted commands to keep ready to send
 const int MakerbotDriver::GCODE_CVT_LINES = 25;
-
-//Note: these values are quite small in order to reduce accuracy errors in progress reports.
-const size_t MakerbotDriver::QUEUE_MIN_SIZE = 10;
-const size_t MakerbotDriver::QUEUE_FILL_SIZE = 30;
+const int MakerbotDriver::MAX_PENDING_CONVERSIONS = 8; //must not exceed X3GConverter::MAX_PENDING
+const int MakerbotDriver::RESPONSE_TIMEOUT = 1000; //value taken from s3g python script (StreamWriter.py)
+const int MakerbotDriver::MAX_RETRIES = 5;
+const int MakerbotDriver::STATUS_INTERVAL = 1000;
+const int MakerbotDriver::BUFFER_POLL_INTERVAL = 1000 / 30;
+const int MakerbotDriver::BUFFER_RESYNC_INTERVAL = 5000;
+const int MakerbotDriver::GPX_WAIT_INTERVAL = 500;
+const uint32_t MakerbotDriver::REFILL_MIN_SPACE = MakerbotDriver::PRINTER_BUFFER_SIZE / 4;
+const size_t MakerbotDriver::MAX_FRAME_SIZE = 258; //header, length, 255 payload bytes and crc
+
+//iButton CRC-8 (polynomial 0x8C, reflected) for every byte value, see _crc_ibutton_update()
+const uint8_t MakerbotDriver::CRC_TABLE[256] = {
+	0x00, 0x5e, 0xbc, 0xe2, 0x61, 0x3f, 0xdd, 0x83, 0xc2, 0x9c, 0x7e, 0x20, 0xa3, 0xfd, 0x1f, 0x41,
+	0x9d, 0xc3, 0x21, 0x7f, 0xfc, 0xa2, 0x40, 0x1e, 0x5f, 0x01, 0xe3, 0xbd, 0x3e, 0x60, 0x82, 0xdc,
+	0x23, 0x7d, 0x9f, 0xc1, 0x42, 0x1c, 0xfe, 0xa0, 0xe1, 0xbf, 0x5d, 0x03, 0x80, 0xde, 0x3c, 0x62,
+	0xbe, 0xe0, 0x02, 0x5c, 0xdf, 0x81, 0x63, 0x3d, 0x7c, 0x22, 0xc0, 0x9e, 0x1d, 0x43, 0xa1, 0xff,
+	0x46, 0x18, 0xfa, 0xa4, 0x27, 0x79, 0x9b, 0xc5, 0x84, 0xda, 0x38, 0x66, 0xe5, 0xbb, 0x59, 0x07,
+	0xdb, 0x85, 0x67, 0x39, 0xba, 0xe4, 0x06, 0x58, 0x19, 0x47, 0xa5, 0xfb, 0x78, 0x26, 0xc4, 0x9a,
+	0x65, 0x3b, 0xd9, 0x87, 0x04, 0x5a, 0xb8, 0xe6, 0xa7, 0xf9, 0x1b, 0x45, 0xc6, 0x98, 0x7a, 0x24,
+	0xf8, 0xa6, 0x44, 0x1a, 0x99, 0xc7, 0x25, 0x7b, 0x3a, 0x64, 0x86, 0xd8, 0x5b, 0x05, 0xe7, 0xb9,
+	0x8c, 0xd2, 0x30, 0x6e, 0xed, 0xb3, 0x51, 0x0f, 0x4e, 0x10, 0xf2, 0xac, 0x2f, 0x71, 0x93, 0xcd,
+	0x11, 0x4f, 0xad, 0xf3, 0x70, 0x2e, 0xcc, 0x92, 0xd3, 0x8d, 0x6f, 0x31, 0xb2, 0xec, 0x0e, 0x50,
+	0xaf, 0xf1, 0x13, 0x4d, 0xce, 0x90, 0x72, 0x2c, 0x6d, 0x33, 0xd1, 0x8f, 0x0c, 0x52, 0xb0, 0xee,
+	0x32, 0x6c, 0x8e, 0xd0, 0x53, 0x0d, 0xef, 0xb1, 0xf0, 0xae, 0x4c, 0x12, 0x91, 0xcf, 0x2d, 0x73,
+	0xca, 0x94, 0x76, 0x28, 0xab, 0xf5, 0x17, 0x49, 0x08, 0x56, 0xb4, 0xea, 0x69, 0x37, 0xd5, 0x8b,
+	0x57, 0x09, 0xeb, 0xb5, 0x36, 0x68, 0x8a, 0xd4, 0x95, 0xcb, 0x29, 0x77, 0xf4, 0xaa, 0x48, 0x16,
+	0xe9, 0xb7, 0x55, 0x0b, 0x88, 0xd6, 0x34, 0x6a, 0x2b, 0x75, 0x97, 0xc9, 0x4a, 0x14, 0xf6, 0xa8,
+	0x74, 0x2a, 0xc8, 0x96, 0x15, 0x4b, 0xa9, 0xf7, 0xb6, 0xe8, 0x0a, 0x54, 0xd7, 0x89, 0x6b, 0x35
+};
 
 
 MakerbotDriver::MakerbotDriver(Server& server, const std::string& serialPortPath, const uint32_t& baudrate)
-: AbstractDriver(server, serialPortPath, baudrate), bufferSpace_(PRINTER_BUFFER_SIZE),
-  cmdToLineRatio_(0.0f), validResponseReceived_(false), firmwareVersion_(0)
+: AbstractDriver(server, serialPortPath, baudrate),
+  x3gCache_(X3G_CACHE_DIR, 1024ULL * X3G_CACHE_MAX_SIZE_KB), jobKeyState_(JKS_NONE), jobKey_(0), jobLinesConverted_(0), waitingForGpx_(false),
+  bufferSpace_(PRINTER_BUFFER_SIZE),
+  bufferSpaceFresh_(false), bufferSpaceKnown_(false), frameState_(FS_HEADER), frameLength_(0), framePos_(0), frameCrc_(0),
+  convertingLines_(0), queuedLines_(0), sentBytes_(0), sentLines_(0), validResponseReceived_(false), firmwareVersion_(0), temperatureQueryIndex_(0)
 {
-	gpx_clear_state();
-	gpx_setSuppressEpilogue(1); // prevent commands like build is complete. only necessary once
-	gpx_setBuildName("    Doodle3D"); //NOTE: 4 spaces seem to fix some display offset issue on at least one r2x
+	GpxContext& gpx = converter_.getGpxContext();
+	gpx.setSuppressEpilogue(true); // prevent commands like build is complete
+	gpx.setBuildName("    Doodle3D"); //NOTE: 4 spaces seem to fix some display offset issue on at least one r2x
 	gcodeBuffer_.setKeepGpxMacroComments(true);
 }
 
-static int lastCode = -1;
-static int counter = 0;
+MakerbotDriver::~MakerbotDriver() {
+	if (converter_.isRunning()) server_.unregisterFileDescriptor(converter_.getFileDescriptor());
+}
 
-int MakerbotDriver::update() {
-	if (!isConnected()) return -1;
-
-	if ((state_ == PRINTING || state_ == STOPPING) && queue_.size() < QUEUE_MIN_SIZE) {
-		int32_t amt = -1;
-		while (amt != 0 && queue_.size() < QUEUE_FILL_SIZE) {
-			string lines;
-			amt = gcodeBuffer_.getNextLine(lines, GCODE_CVT_LINES);
-			int cmds = convertGCode(lines);
-			//if (!lines.empty()) LOG(Logger::BULK, "converted %i lines into %i commands: '%s'", amt, cmds, lines.c_str()); //TEMP
-			if (!lines.empty()) LOG(Logger::BULK, "converted %i lines into %i commands", amt, cmds);
-
-			if (amt > 0) {
-				gcodeBuffer_.eraseLine(amt);
-				gcodeBuffer_.setCurrentLine(getCurrentLine() + amt);
-
-				//update approximation of s3g commands per line
-				float newRatio = (float)amt / cmds;
-				float weight = cmds > 0 ? (float)cmds / queue_.size() : 0.0f;
-				cmdToLineRatio_ = cmdToLineRatio_ * (1.0f - weight) + newRatio * weight;
-			}
-		}
-	}
+void MakerbotDriver::startConnectionCheck() {
+	//the printer might have been reset, so forget what we knew about it
+	validResponseReceived_ = false;
+	bufferSpace_ = PRINTER_BUFFER_SIZE;
+	bufferSpaceFresh_ = false;
+	bufferSpaceKnown_ = false;
+	clearRequests(false);
+	resetFraming();
 
-	if (state_ == PRINTING || state_ == STOPPING) {
-		processQueue();
-		//TODO: setState(IDLE) if all code has been processed
-	}
+	scheduler_.cancelAll();
+	scheduler_.schedule(TASK_STATUS, 0); //ask for the firmware version and temperatures right away
+}
 
-	if (counter == 30) { // TODO: replace with time based timer?
-		if (!validResponseReceived_) {
-			unsigned int ver = getFirmwareVersion();
-			LOG(Logger::INFO, "Makerbot firmware version %.2f", ver / 100.0f);
-		}
-		updateTemperatures();
-		requestBufferSpace();
+//the job key covers the staged gcode, so it is updated before the staging is handed over to the buffer
+void MakerbotDriver::stagingAccepted(const GCodeBuffer::Staging& staging, const GCodeBuffer::MetaData *metaData) {
+	updateJobKey(staging, metaData);
+}
 
-		LOG(Logger::VERBOSE, "  hTemps: %i/%i, bTemps: %i/%i, queue: %i, c2l ratio: %.2f, prbuf space (actual): %i",
-				temperature_, targetTemperature_, bedTemperature_, targetBedTemperature_,
-				queue_.size(), cmdToLineRatio_, bufferSpace_);
+/*
+ * Never blocks on the printer or on gcode conversion: responses are picked up as they arrive (the serial port is part of the
+ * server's event loop), new packets are only written once the previous one has been answered.
+ * Conversion to x3g runs on converter_'s thread, which signals finished batches through its own descriptor.
+ * Timed work (status polls, buffer space polls, the response watchdog) is run from scheduler_, so there is no fixed update rate.
+ */
+int MakerbotDriver::update() {
+	if (!isConnected()) return (state_ == RECONNECTING) ? updateReconnect() : -1;
 
-		counter = 0;
+	if (readData() > 0) {
+		processResponseData((const unsigned char*)serial_.getBuffer(), serial_.getBufferSize());
+		serial_.clearBuffer();
 	}
-	counter++;
 
-	return 1000 / 30; //the of test also runs at 30fps...
-}
+	if (!isConnected()) return 0; //the port failed while reading
+
+	bool printing = (state_ == PRINTING || state_ == STOPPING);
 
-size_t MakerbotDriver::convertGCode(const string &gcode) {
-	size_t oldQueueSize = queue_.size();
+	collectConversions();
+	if (printing) requestConversions();
 
-	if (gcode.size() == 0) return 0;
+	if (printing) processQueue();
 
-	unsigned char *cvtBuf = 0;
-	long cvtBufLen = 0;
-	gpx_convert(gcode.c_str(), gcode.size(), &cvtBuf, &cvtBufLen);
+	int task;
+	while ((task = scheduler_.popDueTask()) != Scheduler::NO_TASK) runTask((TASK)task);
 
-	parser_.setBuffer((char*)cvtBuf, cvtBufLen);
-	while(parser_.parseNextCommand());
-	queueCommands(parser_.commands);
-	parser_.commands.clear();
+	sendRequests(); //in case sending was on hold
+	updateExecutedLines();
 
-	free(cvtBuf);
-	return queue_.size() - oldQueueSize;
+	return scheduler_.getTimeout();
 }
 
 GCodeBuffer::GCODE_SET_RESULT MakerbotDriver::setGCode(const string &gcode, int32_t totalLines, GCodeBuffer::MetaData *metaData) {
 	GCodeBuffer::GCODE_SET_RESULT gsr = AbstractDriver::setGCode(gcode, totalLines, metaData);
 	fullStop();
+	if (gsr == GCodeBuffer::GSR_OK) updateJobKey(gcode, metaData);
 	return gsr;
 }
 
+GCodeBuffer::GCODE_SET_RESULT MakerbotDriver::appendGCode(const string &gcode, int32_t totalLines, GCodeBuffer::MetaData *metaData) {
+	GCodeBuffer::GCODE_SET_RESULT gsr = AbstractDriver::appendGCode(gcode, totalLines, metaData);
+	if (gsr == GCodeBuffer::GSR_OK) updateJobKey(gcode, metaData);
+	return gsr;
+}
+
+
 void MakerbotDriver::clearGCode() {
 	AbstractDriver::clearGCode();
 	fullStop();
 }
 
 
+/*
+ * The gcode buffer counts lines as done when they are handed to the converter, these functions
+ * count lines as done once the printer has executed the commands they were converted to.
+ */
 int32_t MakerbotDriver::getCurrentLine() const {
 	int32_t cl = gcodeBuffer_.getCurrentLine();
-	//cl -= std::min(cl, (int32_t)((queue_.size() + PRINTER_BUFFER_SIZE - bufferSpace_) * cmdToLineRatio_));
+	cl -= std::min(cl, convertingLines_ + queuedLines_ + sentLines_);
 	return cl;
 }
 
 int32_t MakerbotDriver::getBufferedLines() const {
-	int32_t cl = gcodeBuffer_.getBufferedLines();
-	//cl += (queue_.size() + PRINTER_BUFFER_SIZE - bufferSpace_) * cmdToLineRatio_;
-	return cl;
+	return gcodeBuffer_.getBufferedLines() + convertingLines_ + queuedLines_ + sentLines_;
 }
 
 
@@ -220,7 +249,7 @@ bool MakerbotDriver::resetPrint() {
 	return true;
 }
 
-void MakerbotDriver::sendCode(const std::string& code, bool logAsInfo) {
+void MakerbotDriver::sendCode(const std::string&, bool) {
 //	LOG(logAsInfo ? Logger::INFO : Logger::BULK, "sendCode(): %s",code.c_str());
 //	if (isConnected()) {
 //		extractGCodeInfo(code);
@@ -229,13 +258,24 @@ void MakerbotDriver::sendCode(const std::string& code, bool logAsInfo) {
 }
 
 //TODO: actually implement this to interpret response packets instead of the local function which does that now?
-void MakerbotDriver::readResponseCode(std::string& code) {
+void MakerbotDriver::readResponseCode(std::string&) {
 }
 
 //clean out all buffers and try to abort currently active printing
 void MakerbotDriver::fullStop() {
 	queue_.clear();
-	gpx_clear_state();
+	clearRequests(true);
+	converter_.reset();
+	convertingLines_ = queuedLines_ = sentLines_ = 0;
+	queuedCommandLines_.clear();
+	sentCommands_.clear();
+	sentBytes_ = 0;
+	x3gCache_.closeEntry();
+	x3gCache_.discardEntry();
+	jobKeyState_ = JKS_NONE;
+	jobLinesConverted_ = 0;
+	waitingForGpx_ = false;
+	scheduler_.cancel(TASK_GPX_WAIT);
 
 	if(isConnected()) {
 		resetPrinterBuffer();
@@ -248,46 +288,304 @@ void MakerbotDriver::fullStop() {
  * PRIVATE FUNCTIONS *
  *********************/
 
+/*
+ * Hands buffered gcode to the converter until LOOKAHEAD_BYTES of commands are queued or about to be.
+ * Lines are counted as printed once handed over, so progress runs ahead by at most the look-ahead.
+ * When the job has been converted before, commands are taken from the cache instead.
+ * GPX can only convert one job at a time, while another printer's converter owns it the gcode stays buffered.
+ */
+void MakerbotDriver::requestConversions() {
+	if (x3gCache_.isReading()) {
+		if (converter_.getPending() > 0) return; //whatever was converted before the cache entry was found goes first
+		if (readCachedCommands()) return;
+	}
+
+	if (gcodeBuffer_.getBufferedLines() == 0) return;
+
+	if (!converter_.getGpxContext().acquire()) {
+		if (!waitingForGpx_) LOG(Logger::INFO, "waiting for GPX to finish converting a job for another printer");
+		waitingForGpx_ = true;
+		if (!scheduler_.isScheduled(TASK_GPX_WAIT)) scheduler_.schedule(TASK_GPX_WAIT, GPX_WAIT_INTERVAL);
+		return;
+	}
+	if (waitingForGpx_) {
+		LOG(Logger::INFO, "GPX is available, resuming conversion");
+		waitingForGpx_ = false;
+	}
+
+	if (!converter_.isRunning() && converter_.start()) server_.registerFileDescriptor(converter_.getFileDescriptor());
+
+	while (queue_.getBytes() < LOOKAHEAD_BYTES && converter_.getPending() < MAX_PENDING_CONVERSIONS) {
+		string lines;
+		int32_t amt = gcodeBuffer_.getNextLine(lines, GCODE_CVT_LINES);
+		if (amt <= 0) break;
+
+		if (jobLinesConverted_ == 0 && (jobKeyState_ == JKS_HASHING || jobKeyState_ == JKS_COMPLETE)) x3gCache_.beginEntry();
+
+		converter_.convert(lines, amt);
+		gcodeBuffer_.eraseLine(amt);
+		gcodeBuffer_.setCurrentLine(gcodeBuffer_.getCurrentLine() + amt);
+		convertingLines_ += amt;
+		jobLinesConverted_ += amt;
+	}
+}
+
+//moves converted commands to the queue
+void MakerbotDriver::collectConversions() {
+	X3GConverter::Batch *batch;
+	while ((batch = converter_.getBatch()) != NULL) {
+		size_t cmds = batch->commands.size();
+		LOG(Logger::BULK, "converted %i lines into %i commands", batch->lines, (int)cmds);
+
+		if (x3gCache_.isWriting()) x3gCache_.writeRecord(batch->lines, batch->commands);
+
+		size_t len;
+		const uint8_t *command;
+		while ((command = batch->commands.front(&len)) != NULL) {
+			queue_.append(command, len);
+			batch->commands.pop();
+		}
+
+		convertingLines_ -= batch->lines;
+		tagQueuedCommands(cmds, batch->lines);
+		delete batch;
+	}
+
+	if (x3gCache_.isWriting() && jobKeyState_ == JKS_COMPLETE && converter_.getPending() == 0 && gcodeBuffer_.getBufferedLines() == 0) {
+		x3gCache_.commitEntry(jobKey_);
+	}
+}
+
+/*
+ * Keeps a hash of the job's source and gcode as it comes in. Only jobs sent as a sequence of chunks
+ * (see GCodeBuffer::append()) are cached, since only then it is known when all gcode has arrived.
+ * Chunks committed from a staging are hashed as cleaned up by the buffer, others as they were received.
+ */
+void MakerbotDriver::updateJobKey(const string& gcode, const GCodeBuffer::MetaData *metaData) {
+	if (!startJobKeyUpdate(gcode.empty(), metaData)) return;
+
+	jobKey_ = X3GCache::hash(jobKey_, gcode.data(), gcode.size());
+	finishJobKeyUpdate(metaData);
+}
+
+void MakerbotDriver::updateJobKey(const GCodeBuffer::Staging& staging, const GCodeBuffer::MetaData *metaData) {
+	if (!startJobKeyUpdate(staging.getSize() == 0, metaData)) return;
+
+	for (size_t i = 0; i < staging.getNumParts(); i++) {
+		const string& part = staging.getPart(i);
+		jobKey_ = X3GCache::hash(jobKey_, part.data(), part.size());
+	}
+	finishJobKeyUpdate(metaData);
+}
+
+//returns true if gcode added with given meta data is to be hashed into the job key
+bool MakerbotDriver::startJobKeyUpdate(bool empty, const GCodeBuffer::MetaData *metaData) {
+	if (!x3gCache_.isEnabled()) return false;
+
+	if (metaData && metaData->seqNumber == 0 && metaData->seqTotal > 0) {
+		x3gCache_.closeEntry();
+		x3gCache_.discardEntry();
+		jobLinesConverted_ = 0;
+
+		//commands still being converted belong to earlier gcode and must not end up in this job's entry
+		if (converter_.getPending() > 0) {
+			jobKeyState_ = JKS_UNCACHEABLE;
+			return false;
+		}
+
+		jobKeyState_ = JKS_HASHING;
+		jobKey_ = X3GCache::HASH_INIT;
+		if (metaData->source) jobKey_ = X3GCache::hash(jobKey_, metaData->source->c_str(), metaData->source->size() + 1);
+	} else if (empty && !metaData) {
+		return false;
+	} else if (jobKeyState_ != JKS_HASHING) {
+		jobKeyState_ = JKS_UNCACHEABLE;
+		x3gCache_.discardEntry();
+		return false;
+	}
+
+	return true;
+}
+
+void MakerbotDriver::finishJobKeyUpdate(const GCodeBuffer::MetaData *metaData) {
+	if (metaData && metaData->seqNumber + 1 == metaData->seqTotal) {
+		jobKeyState_ = JKS_COMPLETE;
+		useCachedJob();
+	}
+}
+
+//switches to the cached commands for the job if there are any, skipping the part which has been converted already
+void MakerbotDriver::useCachedJob() {
+	if (!x3gCache_.openEntry(jobKey_)) return;
+
+	S3GCommandQueue skipped;
+	int32_t skippedLines = 0, lines = 0;
+	while (skippedLines < jobLinesConverted_ && x3gCache_.readRecord(&lines, skipped) > 0) {
+		skippedLines += lines;
+		skipped.clear();
+	}
+
+	if (skippedLines != jobLinesConverted_) {
+		LOG(Logger::VERBOSE, "cached commands for job %016llx do not line up with the %i lines converted so far, not using them",
+				(unsigned long long)jobKey_, jobLinesConverted_);
+		x3gCache_.closeEntry();
+		return;
+	}
+
+	LOG(Logger::INFO, "using cached commands for job %016llx from line %i", (unsigned long long)jobKey_, jobLinesConverted_);
+	x3gCache_.discardEntry();
+}
+
+//moves commands from the cache to the queue, returns false if the entry did not match the gcode and conversion has to take over
+bool MakerbotDriver::readCachedCommands() {
+	while (queue_.getBytes() < LOOKAHEAD_BYTES) {
+		int32_t lines = 0;
+		size_t oldQueueSize = queue_.size();
+		int rv = x3gCache_.readRecord(&lines, queue_);
+
+		if (rv == 0 && gcodeBuffer_.getBufferedLines() == 0) {
+			x3gCache_.closeEntry();
+			return true;
+		}
+
+		if (rv <= 0 || lines > gcodeBuffer_.getBufferedLines()) {
+			LOG(Logger::WARNING, "cached commands for job %016llx do not match its gcode, converting the remaining %i lines",
+					(unsigned long long)jobKey_, gcodeBuffer_.getBufferedLines());
+			x3gCache_.closeEntry();
+			converter_.reset();
+			jobKeyState_ = JKS_UNCACHEABLE;
+			return false;
+		}
+
+		gcodeBuffer_.eraseLine(lines);
+		gcodeBuffer_.setCurrentLine(gcodeBuffer_.getCurrentLine() + lines);
+		tagQueuedCommands(queue_.size() - oldQueueSize, lines);
+		jobLinesConverted_ += lines;
+	}
+
+	return true;
+}
+
+/*
+ * Spreads the given number of gcode lines over the last count commands appended to queue_. GPX does
+ * not tell which line a command came from, so lines are assigned evenly in order of appearance.
+ * Lines which did not result in any commands are done right away.
+ */
+void MakerbotDriver::tagQueuedCommands(size_t count, int32_t lines) {
+	if (count == 0) return;
+
+	for (size_t i = 0; i < count; i++) {
+		queuedCommandLines_.push_back((int32_t)((i + 1) * lines / count - i * lines / count));
+	}
+	queuedLines_ += lines;
+}
+
+/*
+ * Forgets commands the printer must have executed: all but the most recent ones which together
+ * fill the part of its buffer that is in use (according to the buffer space estimate), including
+ * commands which have not been written yet.
+ */
+void MakerbotDriver::updateExecutedLines() {
+	if (sentCommands_.empty()) return;
+
+	size_t pending = PRINTER_BUFFER_SIZE - std::min(bufferSpace_, (uint32_t)PRINTER_BUFFER_SIZE);
+
+	size_t pos = requestPayloads_.begin(), len;
+	for (std::deque<Request>::const_iterator it = requests_.begin(); it != requests_.end(); ++it) {
+		requestPayloads_.get(&pos, &len);
+		if (it->updateBufferSpace && !it->sent) pending += len;
+	}
+
+	while (!sentCommands_.empty() && sentBytes_ - sentCommands_.front().len >= pending) {
+		sentBytes_ -= sentCommands_.front().len;
+		sentLines_ -= sentCommands_.front().lines;
+		sentCommands_.pop_front();
+	}
+}
+
+/*
+ * Hands commands to the printer while there is enough space in its buffer. The space is tracked
+ * locally by subtracting everything sent from the last reported value. Since the printer only frees
+ * space, this estimate is never too high and the printer only needs to be asked for the actual value
+ * when the estimate does not allow a refill (or has become unreliable), and now and then to resync.
+ * New commands are only queued once all earlier requests have been answered.
+ */
 void MakerbotDriver::processQueue() {
+	if (!requests_.empty()) return;
+
+	int sincePoll = (int)bufferPollTimer_.getElapsedTimeInMilliSec();
+	bool pollAllowed = sincePoll >= BUFFER_POLL_INTERVAL;
+
 	if (!queue_.empty()) {
-		int oldQSize = queue_.size(), oldBSpace = bufferSpace_; //TEMP
+		size_t oldQSize = queue_.size();
+		uint32_t oldBSpace = bufferSpace_, space = bufferSpace_;
+
 		// refill the printer buffer when there is enough space
-		if (requestBufferSpace() > 480) { //TODO: rewrite 480 into a factor of PRINTER_BUFFER_SIZE
-			while (true) {
-				if (queue_.empty()) break;
-				string command = queue_.front();
+		if (bufferSpaceKnown_ && space >= REFILL_MIN_SPACE) {
+			size_t len;
+			const uint8_t *command;
+			while ((command = queue_.front(&len)) != NULL) {
 				// check if there is space for this command (which vary in length)
-				if (command.size() > bufferSpace_ - 5) break;
-
-				queue_.pop_front();
-				int len = command.size();
-				uint8_t *payload = (uint8_t*)command.c_str();
-				sendPacket(payload,len);
+				if (len + 5 > space) break;
+
+				sendPacket(command, len);
+				space -= len;
+				queue_.pop();
+
+				SentCommand sent;
+				sent.len = len;
+				sent.lines = queuedCommandLines_.front();
+				queuedCommandLines_.pop_front();
+				queuedLines_ -= sent.lines;
+				sentCommands_.push_back(sent);
+				sentBytes_ += sent.len;
+				sentLines_ += sent.lines;
 			}
 		}
+
 		if (oldQSize - queue_.size()) {
-			LOG(Logger::VERBOSE, "processed %i cmds (size=%i), printbuf: %i => %i", oldQSize - queue_.size(), queue_.size(), oldBSpace, bufferSpace_);
+			LOG(Logger::VERBOSE, "processed %i cmds (size=%i), printbuf: %i => %i", oldQSize - queue_.size(), queue_.size(), oldBSpace, space);
 		}
+
+		bool resync = sincePoll >= BUFFER_RESYNC_INTERVAL;
+		bool pollNeeded = !bufferSpaceKnown_ || space < REFILL_MIN_SPACE;
+		if (resync || (pollAllowed && pollNeeded)) requestBufferSpace();
+		else scheduler_.schedule(TASK_BUFFER_POLL, (pollNeeded ? BUFFER_POLL_INTERVAL : BUFFER_RESYNC_INTERVAL) - sincePoll);
+	} else if (converter_.getPending() > 0 || gcodeBuffer_.getBufferedLines() > 0) {
+		//more commands are on their way from the converter
+	} else if (bufferSpaceFresh_ && bufferSpace_ >= (uint32_t)PRINTER_BUFFER_SIZE) {
+		setState(IDLE);
+		converter_.reset(); //the job is done, other printers may use GPX now
+		LOG(Logger::INFO, "Print queue and printer buffer empty. Done!");
+	} else if (pollAllowed) {
+		LOG(Logger::BULK, "Print queue empty, waiting for printer to finish...");
+		requestBufferSpace();
 	} else {
-		if (requestBufferSpace() < PRINTER_BUFFER_SIZE) {
-			if (counter == 0) LOG(Logger::INFO, "Print queue empty, waiting for printer to finish...");
-		} else {
-			setState(IDLE);
-			LOG(Logger::INFO, "Print queue and printer buffer empty. Done!");
-		}
+		scheduler_.schedule(TASK_BUFFER_POLL, BUFFER_POLL_INTERVAL - sincePoll);
 	}
 }
 
 
 
+//STATIC
 uint8_t MakerbotDriver::_crc_ibutton_update(uint8_t crc, uint8_t data) {
-	uint8_t i;
-	crc = crc ^ data;
-	for (i = 0; i < 8; i++) {
-		if (crc & 0x01) crc = (crc >> 1) ^ 0x8C;
-		else crc >>= 1;
+	return CRC_TABLE[crc ^ data];
+}
+
+//STATIC
+//writes a complete packet (0xD5, length, payload, crc) to frame, which must hold len + 3 bytes; returns the frame size
+size_t MakerbotDriver::buildFrame(uint8_t *frame, const uint8_t *payload, size_t len) {
+	uint8_t crc = 0;
+
+	frame[0] = 0xD5;
+	frame[1] = len;
+	for (size_t i = 0; i < len; i++) {
+		frame[2 + i] = payload[i];
+		crc = CRC_TABLE[crc ^ payload[i]];
 	}
-	return crc;
+	frame[2 + len] = crc;
+
+	return len + 3;
 }
 
 
@@ -313,31 +611,30 @@ string MakerbotDriver::getResponseMessage(int code) {
 	return out.str();
 }
 
-void MakerbotDriver::queueCommands(vector<string> commands) {
-	for (size_t i = 0; i < commands.size(); i++) {
-		queue_.push_back(commands.at(i));
-	}
-}
-
+/*
+ * Queries the extruder temperature and, in turn, one of the other temperatures (which change less
+ * often), instead of asking for all four at once.
+ */
 bool MakerbotDriver::updateTemperatures() {
+	static const uint8_t otherQueries[] = {
+			30, //build platform temp
+			32, //tool #0 target temp
+			33  //build platform target temp
+	};
 	int rv = true;
 	uint8_t payload[] = { 10, 0, 0 };
 
 	payload[2] = 2; //tool #0 temp
 	if (!sendPacket(payload,sizeof(payload), false)) rv = false;
 
-	payload[2] = 30; //build platform temp
-	if (!sendPacket(payload,sizeof(payload), false)) rv = false;
-
-	payload[2] = 32; //tool #0 target temp
-	if (!sendPacket(payload,sizeof(payload), false)) rv = false;
-
-	payload[2] = 33; //build platform target temp
+	payload[2] = otherQueries[temperatureQueryIndex_];
 	if (!sendPacket(payload,sizeof(payload), false)) rv = false;
+	temperatureQueryIndex_ = (temperatureQueryIndex_ + 1) % sizeof(otherQueries);
 
 	return rv;
 }
 
+//returns the last known version (0 if unknown), the response to the query will update it later on
 int MakerbotDriver::getFirmwareVersion() {
 	//00 - Get version: Query firmware for version information
 	uint8_t payload[] = { 0 };
@@ -345,11 +642,13 @@ int MakerbotDriver::getFirmwareVersion() {
 	return firmwareVersion_;
 }
 
+//returns the last known buffer space, the response to the query will update it later on
 int MakerbotDriver::requestBufferSpace() {
 	////02 - Get available buffer size: Determine how much free memory is available for buffering commands
 	uint8_t payload[] = { 2 };
-	sendPacket(payload,sizeof(payload));
-	return bufferSpace_; //updated by sendPacket->parseResponse
+	bufferPollTimer_.start();
+	sendPacket(payload,sizeof(payload), false);
+	return bufferSpace_;
 }
 
 void MakerbotDriver::playSong(uint8_t song) { ////151 - Queue Song
@@ -372,81 +671,161 @@ void MakerbotDriver::abort() {
 //	queue_.clear();
 }
 
-//return values: 0 on success, -1 on system error, -2 on timeout, -3 on crc error
-int MakerbotDriver::parseResponse(int cmd, int toolcmd) {
-	static int timeout = 250;
-	//read 0xD5
-	int rv = readAndCheckError(timeout); //value 1000 is taken from s3g python script (StreamWriter.py)
+//updateBufferSpace defaults to true, set to false for non-buffered commands
+//returns false if the packet could not be queued because the printer is not connected
+bool MakerbotDriver::sendPacket(const uint8_t *payload, int len, bool updateBufferSpace) {
+	if (!isConnected()) return false;
 
-	if (rv<0) {
-		LOG(Logger::WARNING, "parseResponse: serial.readByte return value=%d", rv);
-		return rv;
+	if (!requestPayloads_.append(payload, len)) {
+		LOG(Logger::ERROR, "sendPacket: invalid payload length %i (cmd: %u)", len, len > 0 ? payload[0] : 0);
+		return false;
 	}
 
-	if (rv!=0xD5) {
-		LOG(Logger::WARNING, "parseResponse: expected 0xD5 instead of 0x%.02x", rv);
-		return -99;
-	}
+	Request request;
+	request.cmd = payload[0];
+	//NOTE: in case of a tool action command (10), also remember the tool command code (payload[2])
+	request.toolcmd = (payload[0] == 10 && len > 2) ? payload[2] : -1;
+	request.updateBufferSpace = updateBufferSpace;
+	request.sent = false;
+	request.retriesLeft = MAX_RETRIES;
+
+	requests_.push_back(request);
+	sendRequests();
+	return true;
+}
 
-	usleep(5000); //5000 microseconds = 5 milliseconds
+/*
+ * Writes the front request unless it is already waiting for a response. Only one packet is kept in
+ * flight: the firmware ignores bytes arriving while it processes a packet, and a rejected packet must
+ * not end up behind packets written after it.
+ */
+void MakerbotDriver::sendRequests() {
+	if (requests_.empty() || !isConnected()) return;
+	if (scheduler_.isScheduled(TASK_HOLD)) return;
 
-	//read length of packet data
-	int len = readAndCheckError(timeout);
-	if (len <= 0) {
-		LOG(Logger::WARNING, "parseResponse: response get package length: len=%i", len);
-		return len;
-	}
+	Request& request = requests_.front();
+	if (request.sent) return;
 
-	//read packet data from serial
-	unsigned char buf[len];
-	rv = readAndCheckError(buf, len, timeout);
-	if (rv <= 0) {
-		LOG(Logger::WARNING, "parseResponse: read packet serial response value=%i", rv);
-		return rv;
-	}
+	size_t len;
+	const uint8_t *payload = requestPayloads_.front(&len);
 
-	//read crc from serial
-	int crc = readAndCheckError(timeout);
-	if (crc < 0) { //can CRC be zero? i think so
-		LOG(Logger::WARNING, "parseResponse: CRC=%i", crc);
-		return len;
+	if (request.updateBufferSpace) {
+		bufferSpace_ -= std::min(bufferSpace_, (uint32_t)len); //approximation of space left in buffer
+		bufferSpaceFresh_ = false;
 	}
 
-	//calculate expected crc
-	int realCrc = 0;
-//	if (cmd!=2) printf("response packet for cmd %i (len=%i): ",cmd,len);
-	for (int i = 0; i < len; i++) {
-		//cout << hex << ((int)buf[i]) << " ";
-//		if (cmd!=2) printf("%.02x ",buf[i]);
-		realCrc = _crc_ibutton_update(realCrc, buf[i]);
-	}
-//	if (cmd!=2) printf("[crc: %i/%i]",crc, realCrc);
-//	if (cmd!=2) cout << endl;
+	serial_.write(frameBuf_, buildFrame(frameBuf_, payload, len));
+	request.sent = true;
+	scheduler_.schedule(TASK_RESPONSE_TIMEOUT, RESPONSE_TIMEOUT);
+}
+
+/*
+ * Feeds received bytes through the response framing state machine (0xD5, length, payload, crc),
+ * so a response may be spread over any number of reads.
+ */
+void MakerbotDriver::processResponseData(const unsigned char *data, size_t len) {
+	int skipped = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char b = data[i];
 
-	//check received crc with expected 'real' crc
-	if (crc != realCrc) {
-		LOG(Logger::WARNING, "CRC check failed (cmd %i)",cmd);
-		return -3;
+		switch (frameState_) {
+			case FS_HEADER:
+				if (b == 0xD5) frameState_ = FS_LENGTH;
+				else skipped++;
+				break;
+			case FS_LENGTH:
+				if (b == 0) {
+					LOG(Logger::WARNING, "processResponseData: ignoring response with zero length");
+					frameState_ = FS_HEADER;
+				} else {
+					frameLength_ = b;
+					framePos_ = 0;
+					frameCrc_ = 0;
+					frameState_ = FS_PAYLOAD;
+				}
+				break;
+			case FS_PAYLOAD:
+				frame_[framePos_++] = b;
+				frameCrc_ = CRC_TABLE[frameCrc_ ^ b];
+				if (framePos_ == frameLength_) frameState_ = FS_CRC;
+				break;
+			case FS_CRC: {
+				frameState_ = FS_HEADER;
+				Request *request = getRequestInFlight();
+
+				if (!request) {
+					LOG(Logger::WARNING, "ignoring response without outstanding request (code: 0x%x, len: %i)", frame_[0], frameLength_);
+				} else if (b == frameCrc_) {
+					handleResponse(*request, frame_, frameLength_);
+				} else {
+					//do not retry if the _response_ crc was invalid, packet has probably been received successfully by printer
+					LOG(Logger::ERROR, "makerbot response CRC error (cmd %i)", request->cmd);
+					popRequest();
+				}
+
+				scheduler_.cancel(TASK_RESPONSE_TIMEOUT); //sendRequests() schedules it again for the next packet
+				sendRequests();
+				break;
+			}
+		}
 	}
 
+	if (skipped > 0) LOG(Logger::WARNING, "processResponseData: There where %i unexpected bytes in the serial read buffer", skipped);
+}
+
+void MakerbotDriver::handleResponse(Request& request, unsigned char *buf, int len) {
+	int cmd = request.cmd, toolcmd = request.toolcmd;
+
+	if (!validResponseReceived_) LOG(Logger::INFO, "hello makerbot! (received valid response packet)");
+	validResponseReceived_ = true;
+
 	//read response code from packet. 0x81 is success
 	int code = buf[0];
 	if (code!=0x81) {
 		LOG(Logger::INFO, "response message to cmd 0x%x/0x%x: 0x%x (=%s)", cmd, toolcmd, code, getResponseMessage(code).c_str());
 	}
 
+	switch (code) {
+		case 0x81: break;
+		case 0x82: //buffer overflow, send it again once the printer has made some room
+			request.sent = false;
+			bufferSpaceKnown_ = false;
+			scheduler_.schedule(TASK_HOLD, BUFFER_POLL_INTERVAL);
+			return;
+		case 0x80: case 0x83: case 0x8C: //packet was discarded
+			retryRequest();
+			return;
+		default:
+			popRequest();
+			return;
+	}
+
 	//depending on previously send cmd interpret the packet
 	//s3g cmd info: https://github.com/makerbot/s3g/blob/master/doc/s3gProtocol.md
 	switch (cmd) {
-		case 0: firmwareVersion_ = read16(buf+1); break;
-		case 2: { bufferSpace_ = read32(buf+1); break; }
+		case 0:
+			if (len >= 3) {
+				unsigned int version = read16(buf+1);
+				if (version != firmwareVersion_) LOG(Logger::INFO, "Makerbot firmware version %.2f", version / 100.0f);
+				firmwareVersion_ = version;
+			}
+			break;
+		case 2:
+			if (len >= 5) {
+				bufferSpace_ = read32(buf+1);
+				bufferSpaceFresh_ = true;
+				bufferSpaceKnown_ = true;
+			}
+			break;
 		case 10: { //Tool query: Query a tool for information
+			if (len < 3) break;
 			uint16_t t = read16(buf+1);
 			if (toolcmd==2) temperature_ = t;
 			else if (toolcmd==30) bedTemperature_ = t;
 			else if (toolcmd==32) targetTemperature_ = t;
 			else if (toolcmd==33) targetBedTemperature_ = t;
-			else LOG(Logger::WARNING, "parseResponse: unrecognized or missing tool command (%u)", toolcmd);
+			else LOG(Logger::WARNING, "handleResponse: unrecognized or missing tool command (%u)", toolcmd);
 			if(getState() == CONNECTING) setState(IDLE); // we have communication
 			break; }
 		case 3: break; //clear buffer
@@ -463,111 +842,104 @@ int MakerbotDriver::parseResponse(int cmd, int toolcmd) {
 			break;
 	}
 
-	return 0; //everything should be fine now
+	popRequest();
 }
 
+void MakerbotDriver::responseTimedOut() {
+	Request *request = getRequestInFlight();
+	if (!request) return;
 
-//FIXME: retrying should be used for retry-able errors only
-//updateBufferSpace defaults to true, set to false for non-buffered commands
-bool MakerbotDriver::sendPacket(uint8_t *payload, int len, bool updateBufferSpace) {
-	//TODO: see if flushing also works (unfortunately this issue could not be reproduced consistently)
-	//TODO: also flush on retries? (see s3g/conveyor)
-	//serial_.flushReadBuffer();
-
-	//check for unexpected bytes in the serial read buffer and eat them.
-	unsigned char buf[100];
-	int rv2 = readAndCheckError(buf, len, 0);
-	if (rv2 > 0) {
-		LOG(Logger::WARNING, "sendPacket: There where %i unexpected bytes in the serial read buffer", rv2);
-	}
-
-	unsigned char *pktBuf = (unsigned char*)malloc(len + 3);
-	pktBuf[0] = 0xD5;
-	pktBuf[1] = len;
-	uint8_t crc = 0;
-	for (int i = 0; i < len; i++) {
-		crc = _crc_ibutton_update(crc, payload[i]);
-		pktBuf[2 + i] = payload[i];
-	}
-	pktBuf[2 + len] = crc;
+	LOG(Logger::ERROR, "makerbot response timeout (cmd: %u)", request->cmd);
+	resetFraming(); //drop any partially received response
+	retryRequest();
+	sendRequests();
+}
 
-	lastCode = payload[0];
+//marks the front request for sending again, or drops it when it has been tried too often
+void MakerbotDriver::retryRequest() {
+	Request& request = requests_.front();
+	request.sent = false;
+	request.retriesLeft--;
 
-	uint8_t cmd = payload[0];
+	bufferSpaceKnown_ = false; //it is unclear what has been added to the printer's buffer
 
-	//LOG(Logger::VERBOSE, "send: cmd=%u, len=%u, crc=%u", cmd, len, crc);
+	if (request.retriesLeft > 0) {
+		LOG(Logger::WARNING, "resending packet (%i tries left) (cmd: %u)", request.retriesLeft, request.cmd);
+	} else {
+		LOG(Logger::ERROR, "giving up on packet after %i tries (cmd: %u)", MAX_RETRIES, request.cmd);
+		popRequest();
+	}
+}
 
+void MakerbotDriver::popRequest() {
+	requests_.pop_front();
+	requestPayloads_.pop();
+}
 
-	if (updateBufferSpace) bufferSpace_ -= len; //approximation of space left in buffer
-	//cout << " [sent: " << lastCode << ", l:" << len << "] ";
+//returns the request waiting for a response, or NULL if there is none
+MakerbotDriver::Request* MakerbotDriver::getRequestInFlight() {
+	if (requests_.empty() || !requests_.front().sent) return NULL;
+	return &requests_.front();
+}
 
-	int retriesLeft = 5;
-	int rv;
-	while (retriesLeft > 0) {
-		/*
-		if (Logger::getInstance().getLevel() == Logger::BULK) {
-			bool tempQuery = pktBuf[2] == 10 && (pktBuf[4] == 2 || pktBuf[4] == 30 || pktBuf[4] == 32 || pktBuf[4] == 33);
-			if (pktBuf[2] != 2 && !tempQuery) {
-				stringstream strstr;
-				for (int i = 0; i < len + 3; ++i) {
-					strstr << " " << std::noshowbase << std::hex << std::setw(2) << std::setfill('0') << (int)pktBuf[i];
-				}
-				LOG(Logger::BULK, "|%i| writing packet with len %i:%s", 5 - retriesLeft, len + 3, strstr.str().c_str());
-			}
-		}
-		*/
-
-		serial_.write(pktBuf, len + 3);
-		//NOTE: in case of a tool action command (10), also pass the tool command code (payload[2])
-		rv = parseResponse(cmd, cmd == 10 ? payload[2] : -1);
-		switch (rv) {
-			case 0:
-				if (!validResponseReceived_) LOG(Logger::INFO, "hello makerbot! (received valid response packet)");
-				validResponseReceived_ = true;
-				//LOG(Logger::VERBOSE, "ok");
-				break;
-			case -1: LOG(Logger::ERROR, "makerbot response system error (%s)", strerror(errno)); break;
-			case -2: LOG(Logger::ERROR, "makerbot response timeout"); break;
-			case -3: LOG(Logger::ERROR, "makerbot response CRC error"); break;
-		}
-		if (rv == 0 || rv == -3) break; //do not retry if the _response_ crc was invalid, packet has probably been received successfully by printer
+void MakerbotDriver::resetFraming() {
+	frameState_ = FS_HEADER;
+	frameLength_ = 0;
+	framePos_ = 0;
+}
 
-		retriesLeft--;
-		if (retriesLeft > 0) LOG(Logger::WARNING, "resending packet (%i tries left) (rv=%i for cmd: %u)", retriesLeft, rv, cmd);
+//drops requests not sent yet, when bufferedOnly is false, also the ones waiting for a response
+void MakerbotDriver::clearRequests(bool bufferedOnly) {
+	if (!bufferedOnly) {
+		requests_.clear();
+		requestPayloads_.clear();
+		return;
 	}
 
-	//cout << endl;
-	free(pktBuf);
-	return rv == 0 ? true : false;
+	//cycle through all requests once, requeueing the ones to keep so their order is preserved
+	size_t numRequests = requests_.size();
+	for (size_t i = 0; i < numRequests; i++) {
+		Request request = requests_.front();
+		uint8_t payload[S3GCommandQueue::MAX_COMMAND_SIZE];
+		size_t len;
+		const uint8_t *front = requestPayloads_.front(&len);
+		memcpy(payload, front, len);
+
+		requests_.pop_front();
+		requestPayloads_.pop();
+
+		if (request.sent || !request.updateBufferSpace) {
+			requests_.push_back(request);
+			requestPayloads_.append(payload, len);
+		}
+	}
 }
 
-int MakerbotDriver::readAndCheckError(int timeout) {
-	int rv = serial_.readByteDirect(timeout);
-	log_.checkError(rv, "MBTD", "cannot read from device");
-	if (rv < 0) handleReadError(rv);
-	return rv;
-}
+void MakerbotDriver::runTask(TASK task) {
+	bool printing = (state_ == PRINTING || state_ == STOPPING);
 
-int MakerbotDriver::readAndCheckError(unsigned char *buf, size_t buflen, int timeout) {
-	int rv = serial_.readBytesDirect(buf, buflen, timeout);
-	log_.checkError(rv, "MBTD", "cannot read from device");
-	if (rv < 0) handleReadError(rv);
-	return rv;
-}
+	switch (task) {
+		case TASK_STATUS:
+			scheduler_.schedule(TASK_STATUS, STATUS_INTERVAL);
+			if (!validResponseReceived_) getFirmwareVersion();
+			updateTemperatures();
+			if (!printing) requestBufferSpace(); //processQueue() takes care of this while printing
 
-void MakerbotDriver::handleReadError(int rv) {
-	if (rv == -2) {
-		LOG(Logger::ERROR, "remote end closed connection, closing port");
-		closeConnection();
-		if (AbstractDriver::REQUEST_EXIT_ON_PORT_FAIL) server_.requestExit(1);
-	} else if (rv == -1 && errno == ENXIO) {
-		LOG(Logger::ERROR, "port was disconnected, closing port");
-		closeConnection();
-		if (AbstractDriver::REQUEST_EXIT_ON_PORT_FAIL) server_.requestExit(1);
-	} else if (rv == -1 && errno == EBADF) {
-		LOG(Logger::ERROR, "port file descriptor became invalid, closing port");
-		closeConnection();
-		if (REQUEST_EXIT_ON_PORT_FAIL) server_.requestExit(1);
+			LOG(Logger::VERBOSE, "  hTemps: %i/%i, bTemps: %i/%i, queue: %i, requests: %i, line: %i (unexecuted: %i), prbuf space (actual): %i",
+					temperature_, targetTemperature_, bedTemperature_, targetBedTemperature_,
+					queue_.size(), requests_.size(), getCurrentLine(), convertingLines_ + queuedLines_ + sentLines_, bufferSpace_);
+			break;
+		case TASK_BUFFER_POLL:
+			if (printing) processQueue();
+			break;
+		case TASK_RESPONSE_TIMEOUT:
+			responseTimedOut();
+			break;
+		case TASK_HOLD:
+			break; //sendRequests() is called after running the tasks
+		case TASK_GPX_WAIT:
+			if (printing) requestConversions();
+			break;
 	}
 }
 
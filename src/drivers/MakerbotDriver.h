@@ -11,23 +11,24 @@
 
 #include <deque>
 #include <string>
-#include <vector>
 #include "AbstractDriver.h"
-#include "S3GParser.h"
+#include "S3GCommandQueue.h"
+#include "X3GCache.h"
+#include "X3GConverter.h"
 #include "../Timer.h"
 #include "../server/Logger.h"
 
 class MakerbotDriver : public AbstractDriver {
 public:
 	MakerbotDriver(Server& server, const std::string& serialPortPath, const uint32_t& baudrate);
+	~MakerbotDriver();
 
 	static const AbstractDriver::DriverInfo& getDriverInfo();
 	virtual int update();
 
-	size_t convertGCode(const std::string &gcode); //TEMP
-
 	//overrides
 	GCodeBuffer::GCODE_SET_RESULT setGCode(const std::string& gcode, int32_t totalLines = -1, GCodeBuffer::MetaData *metaData = 0);
+	GCodeBuffer::GCODE_SET_RESULT appendGCode(const std::string& gcode, int32_t totalLines = -1, GCodeBuffer::MetaData *metaData = 0);
 	void clearGCode();
 
 	//overrides
@@ -45,28 +46,108 @@ protected:
 	void sendCode(const std::string& code, bool logAsInfo = false);
 	void readResponseCode(std::string& code);
 	void fullStop();
+	void startConnectionCheck();
+	void stagingAccepted(const GCodeBuffer::Staging& staging, const GCodeBuffer::MetaData *metaData);
 
 private:
+	typedef enum FRAME_STATE {
+		FS_HEADER, FS_LENGTH, FS_PAYLOAD, FS_CRC
+	} FRAME_STATE;
+
+	typedef enum JOB_KEY_STATE {
+		JKS_NONE,       //no gcode received since the buffer was cleared
+		JKS_HASHING,    //chunks of a sequence are coming in
+		JKS_COMPLETE,   //the last chunk has been received, jobKey_ covers the whole job
+		JKS_UNCACHEABLE //gcode was added outside of a sequence
+	} JOB_KEY_STATE;
+
+	//timed work, see runTask()
+	typedef enum TASK {
+		TASK_STATUS,           /* temperature (and, when idle, buffer space) poll */
+		TASK_BUFFER_POLL,      /* wake up to ask for buffer space, which is done at most every BUFFER_POLL_INTERVAL ms */
+		TASK_RESPONSE_TIMEOUT, /* watchdog for the packets in flight */
+		TASK_HOLD,             /* sending is on hold while scheduled, after the printer reported a buffer overflow */
+		TASK_GPX_WAIT          /* try again to take GPX, which is converting a job for another printer */
+	} TASK;
+
+	//a packet sent (or waiting to be sent) to the printer, the front one is waiting for a response
+	//its payload is kept in requestPayloads_ for retransmission
+	struct Request {
+		uint8_t cmd;
+		int toolcmd;
+		bool updateBufferSpace;
+		bool sent;
+		int retriesLeft;
+	};
+
+	//a print command handed to the printer, kept until it has been executed (see updateExecutedLines())
+	struct SentCommand {
+		size_t len;
+		int32_t lines;
+	};
+
 	static const int PRINTER_BUFFER_SIZE;
-	static const size_t QUEUE_MIN_SIZE;
-	static const size_t QUEUE_FILL_SIZE;;
+	static const size_t LOOKAHEAD_BYTES;
 	static const int GCODE_CVT_LINES;
-
-	Timer timer_;
-	S3GParser parser_;
+	static const int MAX_PENDING_CONVERSIONS;
+	static const int RESPONSE_TIMEOUT;
+	static const int MAX_RETRIES;
+	static const int STATUS_INTERVAL;
+	static const int BUFFER_POLL_INTERVAL;
+	static const int BUFFER_RESYNC_INTERVAL;
+	static const int GPX_WAIT_INTERVAL;
+	static const uint32_t REFILL_MIN_SPACE;
+	static const size_t MAX_FRAME_SIZE;
+	static const uint8_t CRC_TABLE[256];
+
+	Timer bufferPollTimer_;
+	X3GConverter converter_;
+	X3GCache x3gCache_;
+	JOB_KEY_STATE jobKeyState_;
+	uint64_t jobKey_;
+	int32_t jobLinesConverted_; //lines of the current job handed to the converter or taken from the cache
+	bool waitingForGpx_; //another printer's converter owns GPX, conversion has to wait for it
 
 	uint32_t bufferSpace_;
-	std::deque<std::string> queue_;
-
-	float cmdToLineRatio_;
+	bool bufferSpaceFresh_; //true if bufferSpace_ has been reported after the last buffered command was sent
+	bool bufferSpaceKnown_; //false if bufferSpace_ cannot be relied on until the printer reports it again
+	S3GCommandQueue queue_;
+	std::deque<Request> requests_;
+	S3GCommandQueue requestPayloads_; //payloads of requests_, in the same order
+	uint8_t frameBuf_[258]; //outgoing frames are built here (MAX_FRAME_SIZE)
+
+	FRAME_STATE frameState_;
+	uint8_t frameLength_;
+	uint8_t framePos_;
+	uint8_t frameCrc_;
+	unsigned char frame_[256];
+
+	//progress bookkeeping: each print command carries the number of gcode lines which are done once it has been executed
+	int32_t convertingLines_;                //lines handed to the converter whose commands have not been queued yet
+	std::deque<int32_t> queuedCommandLines_; //lines for each command in queue_
+	int32_t queuedLines_;
+	std::deque<SentCommand> sentCommands_;   //commands which may still be in the printer's buffer
+	size_t sentBytes_;
+	int32_t sentLines_;
 	bool validResponseReceived_;
 
 	unsigned int firmwareVersion_;
-
+	size_t temperatureQueryIndex_;
+
+	void requestConversions();
+	void collectConversions();
+	void updateJobKey(const std::string& gcode, const GCodeBuffer::MetaData *metaData);
+	void updateJobKey(const GCodeBuffer::Staging& staging, const GCodeBuffer::MetaData *metaData);
+	bool startJobKeyUpdate(bool empty, const GCodeBuffer::MetaData *metaData);
+	void finishJobKeyUpdate(const GCodeBuffer::MetaData *metaData);
+	void useCachedJob();
+	bool readCachedCommands();
+	void tagQueuedCommands(size_t count, int32_t lines);
+	void updateExecutedLines();
 	void processQueue();
-	uint8_t _crc_ibutton_update(uint8_t crc, uint8_t data);
+	static uint8_t _crc_ibutton_update(uint8_t crc, uint8_t data);
+	static size_t buildFrame(uint8_t *frame, const uint8_t *payload, size_t len);
 	std::string getResponseMessage(int code);
-	void queueCommands(std::vector<std::string> commands);
 	bool updateTemperatures();
 	int getFirmwareVersion();
 	int requestBufferSpace();
@@ -74,11 +155,17 @@ private:
 	void resetPrinterBuffer();
 	void abort();
 
-	int parseResponse(int cmd, int toolcmd = -1);
-	bool sendPacket(uint8_t *payload, int len, bool updateBufferSpace = true);
-	int readAndCheckError(int timeout);
-	int readAndCheckError(unsigned char *buf, size_t buflen, int timeout);
-	void handleReadError(int rv);
+	bool sendPacket(const uint8_t *payload, int len, bool updateBufferSpace = true);
+	void sendRequests();
+	void processResponseData(const unsigned char *data, size_t len);
+	void handleResponse(Request& request, unsigned char *payload, int len);
+	void responseTimedOut();
+	void retryRequest();
+	void popRequest();
+	Request* getRequestInFlight();
+	void resetFraming();
+	void clearRequests(bool bufferedOnly);
+	void runTask(TASK task);
 	uint16_t read16(unsigned char *buf);
 	uint32_t read32(unsigned char *buf);
 };
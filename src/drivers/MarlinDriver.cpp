@@ -6,6 +6,7 @@
  * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "MarlinDriver.h"
@@ -16,58 +17,57 @@ using std::size_t;
 //NOTE: see Server.cpp for comments on this macro
 #define LOG(lvl, fmt, ...) log_.log(lvl, "MLND", fmt, ##__VA_ARGS__)
 
-const int MarlinDriver::UPDATE_INTERVAL = 200;
+const int MarlinDriver::CONNECT_PROBE_INTERVAL = 500;
+const int MarlinDriver::CONNECT_BAUDRATE_TIMEOUT = 3000; //should cover the bootloader delay after a reset
+const int MarlinDriver::CONNECT_MAX_GARBAGE_LINES = 3;
+const int MarlinDriver::CONNECT_MAX_PARTIAL_LINE = 256;
+const size_t MarlinDriver::MAX_PENDING_ACKS = 32;
+const int MarlinDriver::ACK_MIN_TIMEOUT = 3000;
+const float MarlinDriver::ACK_TIMEOUT_LATENCY_FACTOR = 4.0f;
+const float MarlinDriver::ACK_LATENCY_WEIGHT = 0.1f;
 
 MarlinDriver::MarlinDriver(Server& server, const string& serialPortPath, const uint32_t& baudrate)
 : AbstractDriver(server, serialPortPath, baudrate),
   checkTemperatureInterval_(5000),
   checkConnection_(true),
-  checkTemperatureAttempt_(0),
-  maxCheckTemperatureAttempts_(3) {
+  firmwareResponded_(false),
+  garbageLines_(0),
+  lineNumber_(0),
+  lineSendId_(0),
+  lineInFlight_(false),
+  resendRequested_(false),
+  ackDelayed_(false),
+  lineStalled_(false),
+  ackLatency_(0.0f),
+  stallCount_(0),
+  lostAckCount_(0),
+  resendCount_(0) {
 }
 
+/*
+ * The serial port is part of the server's event loop, so responses are handled as soon as they arrive.
+ * Everything else (temperature polls, connection probes and the ack watchdog) is run from scheduler_,
+ * and the server is asked to call again when the next of those is due.
+ */
 int MarlinDriver::update() {
-	if (!isConnected()) return -1;
-
-	if (checkTemperatureInterval_ != -1 && temperatureTimer_.getElapsedTimeInMilliSec() > checkTemperatureInterval_) {
-		//LOG(Logger::VERBOSE, "update temperature()");
-		temperatureTimer_.start(); // restart timer
+	if (!isConnected()) return (state_ == RECONNECTING) ? updateReconnect() : -1;
 
-		// We check the temperature
-		// during startup we use this to check for a valid connection, when it's established we stop checking
-		if (checkConnection_) {
-			if (checkTemperatureAttempt_ < maxCheckTemperatureAttempts_) {
-				LOG(Logger::INFO, "waiting to check temperature %i/%i", checkTemperatureAttempt_, maxCheckTemperatureAttempts_);
-				//checkTemperature(true);
-				checkTemperatureAttempt_++;
-			} else {
-				//assume we're connected now, meaning it's safe to send M115 now
-                                LOG(Logger::INFO, "now checking temperature...");
-				checkTemperature(true);
-				//switchBaudrate();
-				//checkTemperatureAttempt_ = 0;
-			}
-		} else {
-			//LOG(Logger::VERBOSE, "  check temperature");
-			checkTemperature();
+	if (readData() > 0) {
+		string* line;
+		while((line = serial_.extractLine()) != NULL) {
+			readResponseCode(*line);
+			delete line;
 		}
 	}
 
-	if (state_ == PRINTING || state_ == STOPPING || timer_.getElapsedTimeInMilliSec() > UPDATE_INTERVAL) {
-		//LOG(Logger::BULK, "update()");
-		int rv = readData();
-		if (rv > 0) {
-			string* line;
-			while((line = serial_.extractLine()) != NULL) {
-				readResponseCode(*line);
-				delete line;
-			}
-		}
-		timer_.start(); //restart timer
-	}
+	if (!isConnected()) return 0; //the port failed while reading
+
+	if (checkConnection_) checkConnectionGarbage();
 
-	//request to be called again after the time that's left of the update interval
-	return UPDATE_INTERVAL - timer_.getElapsedTimeInMilliSec();
+	int task;
+	while ((task = scheduler_.popDueTask()) != Scheduler::NO_TASK) runTask((TASK)task);
+
+	return scheduler_.getTimeout();
 }
 
 
@@ -75,12 +75,48 @@ int MarlinDriver::update() {
  * PROTECTED FUNCTIONS *
  ***********************/
 
+void MarlinDriver::startConnectionCheck() {
+	checkConnection_ = true;
+	firmwareResponded_ = false;
+	garbageLines_ = 0;
+	connectTimer_.start();
+	scheduler_.cancelAll();
+	scheduler_.schedule(TASK_TEMPERATURE, CONNECT_PROBE_INTERVAL); //the board has just been reset, so send the first probe after one interval
+	scheduler_.schedule(TASK_CONNECT_TIMEOUT, CONNECT_BAUDRATE_TIMEOUT);
+}
+
 bool MarlinDriver::startPrint(STATE state) {
 	if (!AbstractDriver::startPrint(state)) return false;
+
+	//restart line numbering, the firmware will expect N1 next; M110 takes the number from the line itself,
+	//which needs a checksum like any numbered line (Marlin rejects it with a resend request otherwise)
+	lineNumber_ = 0;
+	lineInFlight_ = false;
+	resendRequested_ = false;
+	stallCount_ = lostAckCount_ = resendCount_ = 0;
+	sendCode(formatNumberedLine(0, "M110"));
+
 	printNextLine();
 	return true;
 }
 
+bool MarlinDriver::resetPrint() {
+	if ((state_ == PRINTING || state_ == STOPPING) && (stallCount_ > 0 || lostAckCount_ > 0 || resendCount_ > 0)) {
+		LOG(Logger::INFO, "print ended with %i stalls, %i lost acks and %i resends (avg ack latency: %.1f ms)",
+				stallCount_, lostAckCount_, resendCount_, ackLatency_);
+	}
+
+	lineInFlight_ = false;
+	resendRequested_ = false;
+	scheduler_.cancel(TASK_ACK_DEADLINE);
+	return AbstractDriver::resetPrint();
+}
+
+void MarlinDriver::sendPrintLine(const string& line) {
+	lineNumber_++;
+	sendNumberedLine(line);
+}
+
 void MarlinDriver::readResponseCode(string& code) {
 	/*
 	 * Printing data from printer with wrong baudrate sometimes garbles the
@@ -91,6 +127,8 @@ void MarlinDriver::readResponseCode(string& code) {
 
 	LOG(checkConnection_ ? Logger::INFO : Logger::BULK, "readResponseCode(): '%s'",code.c_str());
 
+	if (checkConnection_ && handleConnectResponse(code)) return;
+
 	bool tempMessage = (code.find("ok T:") == 0);
 	bool heatingMessage = (code.find("T:") == 0);
 
@@ -99,7 +137,12 @@ void MarlinDriver::readResponseCode(string& code) {
 		//checkTemperatureAttempt_ = -1; //set to -1 to disable baud rate switching mechanism
 		if (checkConnection_) {
 			checkConnection_ = false; // stop checking connection (and switching baud rate)
+			LOG(Logger::INFO, "connected at %i baud after %.0f ms", getBaudrate(), connectTimer_.getElapsedTimeInMilliSec());
+			pendingAcks_.clear(); //forget about unanswered probes
+			scheduler_.cancel(TASK_CONNECT_TIMEOUT);
+			scheduler_.schedule(TASK_TEMPERATURE, checkTemperatureInterval_);
 			setState(IDLE);
+			sendCode("M115", true); //only used to log the firmware version
 		}
 		//maxCheckTemperatureAttempts_ = 1;
 
@@ -110,64 +153,220 @@ void MarlinDriver::readResponseCode(string& code) {
 
 		//LOG(Logger::VERBOSE, "  checkTemperatureInterval_: '%i'", checkTemperatureInterval_);
 
+		if (tempMessage) handleAck(true);
+		else extendAckDeadline(); //reports sent while waiting for M109/M190 to finish
+
 	} else if (code.find("ok") == 0) { // confirmation that code is received okay
-		//sendCode("M105"); // temp
-		if (state_ == PRINTING || state_ == STOPPING) {
-			gcodeBuffer_.eraseLine();
-			printNextLine();
-		}
+		handleAck(false);
+
+	} else if (code.find("busy:") != string::npos) { // keep-alive while processing a long command (e.g. 'echo:busy: processing')
+		extendAckDeadline();
+
+	} else if (code.find("FIRMWARE_NAME:") != string::npos) {
+		LOG(Logger::INFO, "firmware info: %s", code.c_str() + code.find("FIRMWARE_NAME:"));
 
 	} else if (code.find("start") != string::npos) {
 		//sendCode("M105"); // temp
 		//startPrint("M90\nM91\nM92\nG0 X10.600 Y10.050 Z0.200 F2100.000 E0.000"); // temp
+		pendingAcks_.clear(); //the printer has been reset, nothing will be acknowledged anymore
 
 	} else if (code.find("Resend:") != string::npos) { // please resend line
-		//currentLine_ = atoi(strstr(code.c_str(), "Resend:") + 7); // correct current line
-		gcodeBuffer_.setCurrentLine(getCurrentLine() - 1);
-		LOG(Logger::BULK, "  Resend: %i", gcodeBuffer_.getCurrentLine());
-		printNextLine();
+		//NOTE: the firmware follows this with an 'ok', which triggers the actual resend (see handleAck())
+		int32_t requested = atoi(code.c_str() + code.find("Resend:") + 7);
+		LOG(Logger::VERBOSE, "resend requested for line %i (in flight: %i)", requested, lineNumber_);
+		if (!lineInFlight_ || requested == lineNumber_ + 1) {
+			//nothing to resend, the line in flight has been processed before (its ok got lost and it was sent again)
+		} else if (requested == lineNumber_) {
+			resendRequested_ = true;
+		} else {
+			//we can only resend the line in flight, so make the firmware expect that one
+			LOG(Logger::WARNING, "resend requested for unexpected line %i (in flight: %i), renumbering", requested, lineNumber_);
+			sendCode(formatNumberedLine(lineNumber_ - 1, "M110"));
+			resendRequested_ = true;
+		}
 
 	}
 }
 
-void MarlinDriver::parseTemperatures(string& code) {
-	// Examples:
-	//   ok T:19.1 /0.0 B:0.0 /0.0 @:0 B@:0
-	//   T:19.51 B:-1.00 @:0
-	//   T:19.5 E:0 W:?
 
-	//LOG(Logger::VERBOSE, "parseTemperatures(): '%s'", code.c_str());
-	// temperature hotend
-	size_t posT = code.find("T:");
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+void MarlinDriver::runTask(TASK task) {
+	switch (task) {
+		case TASK_TEMPERATURE:
+			if (checkConnection_) {
+				checkTemperature();
+				scheduler_.schedule(TASK_TEMPERATURE, CONNECT_PROBE_INTERVAL);
+			} else if (checkTemperatureInterval_ != -1) {
+				//LOG(Logger::VERBOSE, "update temperature()");
+				checkTemperature();
+				scheduler_.schedule(TASK_TEMPERATURE, checkTemperatureInterval_);
+			}
+			break;
+		case TASK_CONNECT_TIMEOUT:
+			if (checkConnection_ && !firmwareResponded_) switchBaudrateFrom("no response");
+			break;
+		case TASK_ACK_DEADLINE:
+			if (state_ == PRINTING || state_ == STOPPING) ackDeadlineExpired();
+			break;
+	}
+}
+
+/*
+ * Instead of waiting a fixed time for the firmware to boot, the printer is probed with M105 every
+ * CONNECT_PROBE_INTERVAL ms (probes sent while the bootloader runs are simply lost) and the 'start'
+ * banner triggers an immediate probe. The first temperature report ends the check.
+ * If nothing recognizable arrives within CONNECT_BAUDRATE_TIMEOUT ms (see runTask()), or only garbage
+ * (a sign of a wrong baud rate, checked here after each read), the baud rate is switched right away.
+ */
+void MarlinDriver::checkConnectionGarbage() {
+	if (firmwareResponded_) return;
+
+	if (garbageLines_ >= CONNECT_MAX_GARBAGE_LINES || serial_.getBufferSize() > CONNECT_MAX_PARTIAL_LINE) {
+		switchBaudrateFrom("received garbage");
+	}
+}
+
+void MarlinDriver::switchBaudrateFrom(const char *reason) {
+	LOG(Logger::INFO, "%s at %i baud, switching baud rate", reason, getBaudrate());
+	serial_.clearBuffer();
+	serial_.flushReadBuffer();
+	switchBaudrate(); //restarts the connection check
+}
 
-	//status variant _not_ prefixed with 'ok ' indicates the printer is heating
-	heating_ = (posT == 0);
+//returns true if the line has been fully handled as part of the connection check
+bool MarlinDriver::handleConnectResponse(const string& code) {
+	for (size_t i = 0; i < code.length(); i++) {
+		unsigned char c = code[i];
+		if ((c < 0x20 && c != '\t') || c >= 0x7F) {
+			garbageLines_++;
+			LOG(Logger::VERBOSE, "ignoring garbled line (%i/%i)", garbageLines_, CONNECT_MAX_GARBAGE_LINES);
+			return true;
+		}
+	}
 
-	temperature_ = AbstractDriver::findNumber(code, posT + 2);
-	//LOG(Logger::VERBOSE, "  temperature '%i'", temperature_);
+	if (code.find("start") == 0 || code.find("echo:") == 0 || code.find("ok") == 0 || code.find("T:") == 0 ||
+			code.find("Error:") == 0 || code.find("wait") == 0 || code.find("Marlin") != string::npos) {
+		firmwareResponded_ = true;
+	}
 
-	// target temperature hotend
-	size_t posTT = code.find('/', posT);
-	if (posTT != string::npos) {
-		targetTemperature_ = AbstractDriver::findNumber(code, posTT+1);
-		//LOG(Logger::VERBOSE, "  targetTemperature '%i'", targetTemperature_);
+	if (code.find("start") == 0) {
+		LOG(Logger::INFO, "firmware started, probing for temperature");
+		scheduler_.schedule(TASK_TEMPERATURE, CONNECT_PROBE_INTERVAL);
+		checkTemperature(true);
+		return true;
 	}
 
-	// bed temperature
-	size_t posB = code.find("B:");
-	if (posB != string::npos) {
-		bedTemperature_ = AbstractDriver::findNumber(code, posB + 2);
-		//LOG(Logger::VERBOSE, "  bedTemperature '%i'", bedTemperature_);
-
-		// target bed temperature
-		size_t posTBT = code.find('/', posB);
-		if (posTBT != string::npos) {
-			targetBedTemperature_ = AbstractDriver::findNumber(code, posTBT + 1);
-			//LOG(Logger::VERBOSE, "  targetBedTemperature '%i'", targetBedTemperature_);
+	return false;
+}
+
+//sends the line in flight (again), using the current line number
+void MarlinDriver::sendNumberedLine(const string& line) {
+	string numbered = formatNumberedLine(lineNumber_, line);
+	LOG(Logger::BULK, "sendNumberedLine(): %s", numbered.c_str());
+	if (!isConnected()) return;
+
+	AbstractDriver::extractGCodeInfo(line);
+	serial_.send((numbered + "\n").c_str());
+
+	if (pendingAcks_.size() >= MAX_PENDING_ACKS) pendingAcks_.pop_front();
+	pendingAcks_.push_back(PendingAck(ACK_LINE, ++lineSendId_));
+	lineInFlight_ = true;
+	ackDelayed_ = false;
+	lineStalled_ = false;
+	lineTimer_.start();
+	scheduler_.schedule(TASK_ACK_DEADLINE, (int)getAckTimeout());
+}
+
+/*
+ * Matches an 'ok' against the commands sent (Marlin handles them strictly in order).
+ * A temperature report ('ok T:...') arriving while the line in flight still awaits its ok means that ok
+ * got lost. The line is then sent again under the same number: the firmware either executes it (if it
+ * never arrived) or, if it already did, rejects it with a resend request for the next line.
+ */
+void MarlinDriver::handleAck(bool temperatureReport) {
+	bool lostLineAck = false;
+
+	while (!pendingAcks_.empty()) {
+		PendingAck ack = pendingAcks_.front();
+		pendingAcks_.pop_front();
+
+		bool lineInFlight = (ack.type == ACK_LINE && lineInFlight_ && ack.sendId == lineSendId_);
+
+		if (!temperatureReport) {
+			if (lineInFlight) {
+				if (resendRequested_) {
+					resendRequested_ = false;
+					resendCount_++;
+					string line;
+					if (gcodeBuffer_.getNextLine(line) > 0) sendNumberedLine(line);
+				} else {
+					lineAcknowledged();
+				}
+			}
+			return; //other commands (or lines from before a restart) need no further handling
 		}
+
+		if (ack.type == ACK_TEMPERATURE) break;
+		if (lineInFlight) lostLineAck = true; //anything else in front of the M105 must have lost its ok
+	}
+
+	if (lostLineAck && (state_ == PRINTING || state_ == STOPPING)) {
+		lostAckCount_++;
+		LOG(Logger::WARNING, "ok for line %i got lost, sending it again (lost acks: %i)", lineNumber_, lostAckCount_);
+		resendRequested_ = false;
+		string line;
+		if (gcodeBuffer_.getNextLine(line) > 0) sendNumberedLine(line);
 	}
 }
 
+void MarlinDriver::lineAcknowledged() {
+	if (!ackDelayed_) {
+		float latency = lineTimer_.getElapsedTimeInMilliSec();
+		ackLatency_ = ackLatency_ * (1.0f - ACK_LATENCY_WEIGHT) + latency * ACK_LATENCY_WEIGHT;
+	}
+	lineInFlight_ = false;
+	scheduler_.cancel(TASK_ACK_DEADLINE);
+
+	if (state_ == PRINTING || state_ == STOPPING) {
+		gcodeBuffer_.eraseLine();
+		printNextLine();
+	}
+}
+
+//called when the printer shows it is still working on a command (i.e. the ok will take longer)
+void MarlinDriver::extendAckDeadline() {
+	if (!lineInFlight_) return;
+	scheduler_.schedule(TASK_ACK_DEADLINE, (int)getAckTimeout());
+	ackDelayed_ = true;
+}
+
+/*
+ * Without an ok for the line in flight in time, the printer is probed with an M105. Its answer either
+ * reveals a lost ok (see handleAck()) or it arrives after the ok, if the printer was just slow.
+ */
+void MarlinDriver::ackDeadlineExpired() {
+	if (!lineInFlight_) return;
+
+	if (!lineStalled_) {
+		stallCount_++;
+		LOG(Logger::WARNING, "no ok for line %i after %.0f ms, probing printer (stalls: %i)",
+				lineNumber_, lineTimer_.getElapsedTimeInMilliSec(), stallCount_);
+	}
+	lineStalled_ = true;
+	ackDelayed_ = true;
+	scheduler_.schedule(TASK_ACK_DEADLINE, (int)getAckTimeout());
+	if (checkTemperatureInterval_ != -1) scheduler_.schedule(TASK_TEMPERATURE, checkTemperatureInterval_);
+	checkTemperature();
+}
+
+float MarlinDriver::getAckTimeout() const {
+	float timeout = ackLatency_ * ACK_TIMEOUT_LATENCY_FACTOR;
+	return timeout > ACK_MIN_TIMEOUT ? timeout : ACK_MIN_TIMEOUT;
+}
+
 void MarlinDriver::checkTemperature(bool logAsInfo) {
 	sendCode("M105", logAsInfo);
 }
@@ -177,9 +376,27 @@ void MarlinDriver::sendCode(const string& code, bool logAsInfo) {
 	if (isConnected()) {
 		AbstractDriver::extractGCodeInfo(code);
 		serial_.send((code + "\n").c_str());
+
+		if (pendingAcks_.size() >= MAX_PENDING_ACKS) pendingAcks_.pop_front();
+		pendingAcks_.push_back(PendingAck(code.find("M105") == 0 ? ACK_TEMPERATURE : ACK_OTHER));
 	}
 }
 
+//STATIC
+//prefixes the line with its number and appends a checksum so the firmware can detect corrupted and missing lines
+string MarlinDriver::formatNumberedLine(int32_t lineNumber, const string& line) {
+	char prefix[16];
+	snprintf(prefix, sizeof(prefix), "N%i ", lineNumber);
+	string numbered = prefix + line;
+
+	uint8_t checksum = 0;
+	for (size_t i = 0; i < numbered.length(); i++) checksum ^= (uint8_t)numbered[i];
+
+	char suffix[8];
+	snprintf(suffix, sizeof(suffix), "*%u", checksum);
+	return numbered + suffix;
+}
+
 
 
 //STATIC
@@ -9,6 +9,7 @@
 #ifndef MARLIN_DRIVER_H_SEEN
 #define MARLIN_DRIVER_H_SEEN
 
+#include <deque>
 #include <string>
 #include "../Timer.h"
 #include "AbstractDriver.h"
@@ -25,21 +26,78 @@ public:
 
 protected:
 	bool startPrint(STATE state);
+	bool resetPrint();
+	void sendPrintLine(const std::string& line);
 
 	void readResponseCode(std::string& code);
-	void parseTemperatures(std::string& code);
 	void checkTemperature(bool logAsInfo = false);
 	void sendCode(const std::string& code, bool logAsInfo = false);
+	void startConnectionCheck();
+
+	static std::string formatNumberedLine(int32_t lineNumber, const std::string& line);
 
 private:
-	static const int UPDATE_INTERVAL;
+	typedef enum ACK_TYPE {
+		ACK_LINE,        /* numbered print line */
+		ACK_TEMPERATURE, /* M105, answered with 'ok T:...' */
+		ACK_OTHER
+	} ACK_TYPE;
+
+	//timed work, see runTask()
+	typedef enum TASK {
+		TASK_TEMPERATURE,     /* temperature poll, also used to probe for the firmware while connecting */
+		TASK_CONNECT_TIMEOUT, /* switches the baud rate if the firmware did not respond */
+		TASK_ACK_DEADLINE     /* probes the printer when the ok for the line in flight takes too long */
+	} TASK;
+
+	//a command which has been sent but not yet acknowledged with an 'ok'
+	struct PendingAck {
+		ACK_TYPE type;
+		uint32_t sendId; //only used for print lines, identifies a single transmission of a line
+		PendingAck(ACK_TYPE t, uint32_t id = 0)
+		: type(t), sendId(id)
+		{}
+	};
+
+	static const size_t MAX_PENDING_ACKS;
+	static const int ACK_MIN_TIMEOUT;
+	static const float ACK_TIMEOUT_LATENCY_FACTOR;
+	static const float ACK_LATENCY_WEIGHT;
 
-	Timer timer_;
-	Timer temperatureTimer_;
+	static const int CONNECT_PROBE_INTERVAL;
+	static const int CONNECT_BAUDRATE_TIMEOUT;
+	static const int CONNECT_MAX_GARBAGE_LINES;
+	static const int CONNECT_MAX_PARTIAL_LINE;
+
+	Timer connectTimer_;
 	int checkTemperatureInterval_;
 	bool checkConnection_;
-	int checkTemperatureAttempt_;
-	int maxCheckTemperatureAttempts_;
+	bool firmwareResponded_; //set when recognizable output has been received at the current baud rate
+	int garbageLines_;
+
+	std::deque<PendingAck> pendingAcks_;
+	int32_t lineNumber_;     //number of the print line in flight (or last sent)
+	uint32_t lineSendId_;    //transmission of the print line in flight
+	bool lineInFlight_;
+	bool resendRequested_;
+	bool ackDelayed_;        //set when the ack deadline has been extended or has expired for the line in flight
+	bool lineStalled_;       //set when the ack deadline has expired for the line in flight
+	Timer lineTimer_;        //time since the line in flight was sent
+	float ackLatency_;       //moving average of the time between sending a line and receiving its ok (in ms)
+	int stallCount_;
+	int lostAckCount_;
+	int resendCount_;
+
+	void sendNumberedLine(const std::string& line);
+	void handleAck(bool temperatureReport);
+	void lineAcknowledged();
+	void extendAckDeadline();
+	void ackDeadlineExpired();
+	float getAckTimeout() const;
+	void runTask(TASK task);
+	void checkConnectionGarbage();
+	void switchBaudrateFrom(const char *reason);
+	bool handleConnectResponse(const std::string& code);
 	int extractTemperatureFromMCode(const std::string& gcode, const std::string *codes, int num_codes);
 
 	void filterText(std::string& text, const std::string& replace);
@@ -0,0 +1,145 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "S3GCommandQueue.h"
+
+const size_t S3GCommandQueue::MAX_COMMAND_SIZE = 255;
+const size_t S3GCommandQueue::INITIAL_CAPACITY = 4096;
+const uint8_t S3GCommandQueue::WRAP_MARKER = 0; //commands are never empty, so a zero length is free to use
+
+S3GCommandQueue::S3GCommandQueue()
+: buffer_((uint8_t*)malloc(INITIAL_CAPACITY)), capacity_(INITIAL_CAPACITY), head_(0), tail_(0), count_(0), bytes_(0) { }
+
+S3GCommandQueue::~S3GCommandQueue() {
+	free(buffer_);
+}
+
+/*
+ * Adds a command of len bytes and returns a pointer to write its contents to, which stays valid until
+ * the next call to append() or clear(). Returns NULL if len is 0 or larger than MAX_COMMAND_SIZE.
+ */
+uint8_t* S3GCommandQueue::append(size_t len) {
+	if (len == 0 || len > MAX_COMMAND_SIZE) return NULL;
+
+	size_t need = len + 1;
+
+	//tail_ equal to head_ only means empty, so the tail may never catch up with the head
+	if (tail_ >= head_) {
+		if (need > capacity_ - tail_) {
+			if (need < head_) {
+				if (tail_ < capacity_) buffer_[tail_] = WRAP_MARKER;
+				tail_ = 0;
+			} else {
+				grow(need);
+			}
+		}
+	} else if (need >= head_ - tail_) {
+		grow(need);
+	}
+
+	uint8_t *entry = buffer_ + tail_;
+	entry[0] = (uint8_t)len;
+	tail_ += need;
+	count_++;
+	bytes_ += len;
+
+	return entry + 1;
+}
+
+bool S3GCommandQueue::append(const uint8_t *data, size_t len) {
+	uint8_t *p = append(len);
+	if (!p) return false;
+	memcpy(p, data, len);
+	return true;
+}
+
+//returns a pointer to the first command and stores its length in len, or returns NULL if the queue is empty
+const uint8_t* S3GCommandQueue::front(size_t *len) const {
+	if (count_ == 0) return NULL;
+
+	*len = buffer_[head_];
+	return buffer_ + head_ + 1;
+}
+
+//returns the position of the first command, to walk through the queue using get()
+size_t S3GCommandQueue::begin() const {
+	return head_;
+}
+
+/*
+ * Returns the command at pos (as returned by begin() or a previous call) and moves pos to the next one.
+ * The caller must not call this more often than there are commands (see size()).
+ */
+const uint8_t* S3GCommandQueue::get(size_t *pos, size_t *len) const {
+	size_t p = *pos;
+	if (p >= capacity_ || buffer_[p] == WRAP_MARKER) p = 0;
+
+	*len = buffer_[p];
+	*pos = p + buffer_[p] + 1;
+	return buffer_ + p + 1;
+}
+
+void S3GCommandQueue::pop() {
+	if (count_ == 0) return;
+
+	bytes_ -= buffer_[head_];
+	head_ += buffer_[head_] + 1;
+	count_--;
+
+	if (count_ == 0) {
+		head_ = tail_ = 0;
+	} else if (head_ >= capacity_ || (head_ > tail_ && buffer_[head_] == WRAP_MARKER)) {
+		head_ = 0;
+	}
+}
+
+void S3GCommandQueue::clear() {
+	head_ = tail_ = 0;
+	count_ = 0;
+	bytes_ = 0;
+}
+
+size_t S3GCommandQueue::size() const {
+	return count_;
+}
+
+size_t S3GCommandQueue::getBytes() const {
+	return bytes_;
+}
+
+bool S3GCommandQueue::empty() const {
+	return count_ == 0;
+}
+
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+//moves all entries to the start of a larger buffer, leaving at least minFree bytes after them
+void S3GCommandQueue::grow(size_t minFree) {
+	size_t newCapacity = capacity_ * 2;
+	while (newCapacity < bytes_ + count_ + minFree + 1) newCapacity *= 2;
+
+	uint8_t *newBuffer = (uint8_t*)malloc(newCapacity);
+	size_t pos = 0, p = head_;
+	for (size_t i = 0; i < count_; i++) {
+		size_t len;
+		const uint8_t *command = get(&p, &len);
+		memcpy(newBuffer + pos, command - 1, len + 1);
+		pos += len + 1;
+	}
+
+	free(buffer_);
+	buffer_ = newBuffer;
+	capacity_ = newCapacity;
+	head_ = 0;
+	tail_ = pos;
+}
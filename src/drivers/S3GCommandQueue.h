@@ -0,0 +1,59 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#ifndef S3G_COMMAND_QUEUE_H_SEEN
+#define S3G_COMMAND_QUEUE_H_SEEN
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/*
+ * FIFO of s3g commands, packed into a single ring buffer as [length][command bytes] entries.
+ * Commands are written in place (see append()) and read in place (see front()), so queueing a
+ * command does not allocate anything unless the ring has to grow. Each entry is contiguous: when
+ * an entry does not fit before the end of the ring, a wrap marker is written and it is placed at
+ * the start instead.
+ */
+class S3GCommandQueue {
+public:
+	static const size_t MAX_COMMAND_SIZE; //s3g packets carry a one-byte payload length
+
+	S3GCommandQueue();
+	~S3GCommandQueue();
+
+	uint8_t* append(size_t len);
+	bool append(const uint8_t *data, size_t len);
+
+	const uint8_t* front(size_t *len) const;
+	size_t begin() const;
+	const uint8_t* get(size_t *pos, size_t *len) const;
+	void pop();
+	void clear();
+
+	size_t size() const;
+	size_t getBytes() const;
+	bool empty() const;
+
+private:
+	static const size_t INITIAL_CAPACITY;
+	static const uint8_t WRAP_MARKER;
+
+	S3GCommandQueue(const S3GCommandQueue& o);
+	void operator=(const S3GCommandQueue& o);
+
+	uint8_t *buffer_;
+	size_t capacity_;
+	size_t head_; //position of the first entry
+	size_t tail_; //position where the next entry will be written
+	size_t count_;
+	size_t bytes_; //total size of all queued commands (without length prefixes)
+
+	void grow(size_t minFree);
+};
+
+#endif /* ! S3G_COMMAND_QUEUE_H_SEEN */
@@ -0,0 +1,150 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ *
+ * Protocol spec: https://github.com/makerbot/s3g/blob/master/doc/s3gProtocol.md
+ */
+
+#include <string.h>
+#include "S3GParser.h"
+
+const int S3GParser::LENGTH_UNKNOWN = -1;
+const int S3GParser::LENGTH_VARIABLE = -2;
+
+const uint8_t S3GParser::FIRST_COMMAND = 128;
+
+//number of bytes following the opcode for each command, starting at FIRST_COMMAND
+const int S3GParser::COMMAND_LENGTHS[] = {
+		LENGTH_UNKNOWN,  //128
+		16,              //129 Absolute move (<iiiI)
+		12,              //130 Set position (<iii)
+		7,               //131 Home minimum (<BIH)
+		7,               //132 Home maximum (<BIH)
+		4,               //133 Delay (<I)
+		1,               //134 Change extruder (<B)
+		5,               //135 Wait for extruder ready (<BHH)
+		LENGTH_VARIABLE, //136 Tool action (<BBB + payload)
+		1,               //137 Enable/disable steppers (<B)
+		2,               //138 User block (<H)
+		24,              //139 Absolute move (<iiiiiI)
+		20,              //140 Set extended position (<iiiii)
+		5,               //141 Wait for platform (<BHH)
+		25,              //142 Move (<iiiiiIB)
+		1,               //143 Store home position (<b)
+		1,               //144 Recall home position (<b)
+		2,               //145 Set pot (<BB)
+		5,               //146 Set RGB led (<BBBBB)
+		5,               //147 Set beep (<HHB)
+		4,               //148 Pause for button (<BHB)
+		LENGTH_VARIABLE, //149 Display message (<BBBB + string)
+		2,               //150 Set build percent (<BB)
+		1,               //151 Queue song (<B)
+		1,               //152 Reset to factory (<B)
+		LENGTH_VARIABLE, //153 Start build (<I + string)
+		1,               //154 End build (<B)
+		31,              //155 Move (<iiiiiIBfh)
+		1,               //156 Set acceleration (<B)
+		20,              //157 Stream version (<BBBIHHIIB)
+		4                //158 Pause at z position (<f)
+};
+const int S3GParser::NUM_COMMAND_LENGTHS = sizeof(COMMAND_LENGTHS) / sizeof(COMMAND_LENGTHS[0]);
+
+S3GParser::S3GParser()
+: buffer_(0), bufferSize_(0), bufferPos_(0), lineNumber_(0) { }
+
+void S3GParser::setBuffer(const char *buf, size_t buflen) {
+	buffer_ = buf;
+	bufferSize_ = buflen;
+	bufferPos_ = 0;
+	lineNumber_ = 0;
+}
+
+/*
+ * Stores the position and length (opcode included) of the next command in offset and len.
+ * Returns PR_END when the buffer has been parsed completely. On errors, the position is not advanced
+ * (the remaining data cannot be interpreted anymore).
+ */
+S3GParser::PARSE_RESULT S3GParser::parseNextCommand(size_t *offset, size_t *len) {
+	if (bufferPos_ >= bufferSize_) return PR_END;
+
+	uint8_t command = buffer_[bufferPos_];
+	int cmdLen = getCommandLength(command);
+	size_t totalLen;
+
+	if (cmdLen == LENGTH_UNKNOWN) {
+		return PR_UNKNOWN_COMMAND;
+	} else if (cmdLen == LENGTH_VARIABLE) {
+		PARSE_RESULT rv = getVariableLength(command, &totalLen);
+		if (rv != PR_OK) return rv;
+	} else {
+		totalLen = cmdLen + 1;
+		if (bufferPos_ + totalLen > bufferSize_) return PR_TRUNCATED;
+	}
+
+	*offset = bufferPos_;
+	*len = totalLen;
+	bufferPos_ += totalLen;
+	lineNumber_++;
+	return PR_OK;
+}
+
+//returns the number of commands parsed since setBuffer()
+int S3GParser::getLineNumber() const {
+	return lineNumber_;
+}
+
+size_t S3GParser::getBufferPos() const {
+	return bufferPos_;
+}
+
+
+//STATIC
+//returns the number of bytes following the opcode, or a negative value for unknown and variable length commands
+int S3GParser::getCommandLength(uint8_t command) {
+	if (command < FIRST_COMMAND || command - FIRST_COMMAND >= NUM_COMMAND_LENGTHS) return LENGTH_UNKNOWN;
+	return COMMAND_LENGTHS[command - FIRST_COMMAND];
+}
+
+//STATIC
+const char* S3GParser::getResultString(PARSE_RESULT result) {
+	switch (result) {
+		case PR_OK: return "ok";
+		case PR_END: return "end of buffer";
+		case PR_UNKNOWN_COMMAND: return "unknown command";
+		case PR_TRUNCATED: return "truncated command";
+	}
+	return "unknown result";
+}
+
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+//measures the total length (opcode included) of the variable length command at the current position
+S3GParser::PARSE_RESULT S3GParser::getVariableLength(uint8_t command, size_t *len) const {
+	size_t start = bufferPos_ + 1, remaining = bufferSize_ - start;
+
+	if (command == 136) {
+		//tool index, tool command, payload length, payload
+		if (remaining < 3) return PR_TRUNCATED;
+		*len = 1 + 3 + (uint8_t)buffer_[start + 2];
+
+	} else {
+		//display message: options, x, y, timeout; start build: steps (uint32); both followed by a nul-terminated string
+		size_t fixedLen = 4;
+		if (remaining < fixedLen) return PR_TRUNCATED;
+
+		const char *str = buffer_ + start + fixedLen;
+		const char *end = (const char*)memchr(str, '\0', remaining - fixedLen);
+		if (!end) return PR_TRUNCATED;
+
+		*len = 1 + fixedLen + (end - str) + 1;
+	}
+
+	if (bufferPos_ + *len > bufferSize_) return PR_TRUNCATED;
+	return PR_OK;
+}
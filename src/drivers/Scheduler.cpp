@@ -0,0 +1,127 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#include <algorithm>
+#include "Scheduler.h"
+#include "../utils.h"
+
+const int Scheduler::NO_TASK = -1;
+
+Scheduler::Scheduler() { }
+
+//(re)schedules the task to become due after delay ms
+void Scheduler::schedule(int task, int delay) {
+	if (task < 0) return;
+	if ((size_t)task >= tasks_.size()) {
+		TaskState unscheduled = { false, 0, 0, 0 };
+		tasks_.resize(task + 1, unscheduled);
+	}
+
+	uint64_t deadline = getMicros() + (uint64_t)std::max(delay, 0) * 1000;
+	TaskState& state = tasks_[task];
+
+	//postponing is common (e.g. watchdogs), the existing entry is moved when it reaches the front
+	if (state.scheduled && deadline >= state.entryDeadline) {
+		state.deadline = deadline;
+		return;
+	}
+
+	if (state.scheduled) state.generation++;
+	state.scheduled = true;
+	state.deadline = deadline;
+	push(task, deadline);
+}
+
+void Scheduler::cancel(int task) {
+	if (task < 0 || (size_t)task >= tasks_.size() || !tasks_[task].scheduled) return;
+	tasks_[task].scheduled = false;
+	tasks_[task].generation++;
+}
+
+void Scheduler::cancelAll() {
+	for (size_t i = 0; i < tasks_.size(); i++) {
+		tasks_[i].scheduled = false;
+		tasks_[i].generation++;
+	}
+	heap_.clear();
+}
+
+bool Scheduler::isScheduled(int task) const {
+	return task >= 0 && (size_t)task < tasks_.size() && tasks_[task].scheduled;
+}
+
+//returns a task whose deadline has passed (it is no longer scheduled afterwards), or NO_TASK
+int Scheduler::popDueTask() {
+	settle();
+	if (heap_.empty() || heap_.front().deadline > getMicros()) return NO_TASK;
+
+	int task = heap_.front().task;
+	std::pop_heap(heap_.begin(), heap_.end(), LaterDeadline());
+	heap_.pop_back();
+
+	tasks_[task].scheduled = false;
+	tasks_[task].generation++;
+	return task;
+}
+
+//returns the number of ms until the next deadline (rounded up, so the task is due by then), or -1 if nothing is scheduled
+int Scheduler::getTimeout() {
+	settle();
+	if (heap_.empty()) return -1;
+
+	uint64_t now = getMicros(), deadline = heap_.front().deadline;
+	return (deadline > now) ? (int)((deadline - now + 999) / 1000) : 0;
+}
+
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+void Scheduler::push(int task, uint64_t deadline) {
+	TaskState& state = tasks_[task];
+	state.entryDeadline = deadline;
+
+	Entry entry = { deadline, task, state.generation };
+	heap_.push_back(entry);
+	std::push_heap(heap_.begin(), heap_.end(), LaterDeadline());
+
+	if (heap_.size() > 2 * tasks_.size() + 8) compact();
+}
+
+//removes obsolete entries from the front and moves postponed ones, until the front entry holds the earliest deadline
+void Scheduler::settle() {
+	while (!heap_.empty()) {
+		Entry entry = heap_.front();
+		const TaskState& state = tasks_[entry.task];
+		bool obsolete = !state.scheduled || entry.generation != state.generation;
+
+		if (!obsolete && state.deadline <= entry.deadline) break;
+
+		std::pop_heap(heap_.begin(), heap_.end(), LaterDeadline());
+		heap_.pop_back();
+		if (!obsolete) push(entry.task, state.deadline);
+	}
+}
+
+//rebuilds the heap from the scheduled tasks, dropping all obsolete entries
+void Scheduler::compact() {
+	heap_.clear();
+
+	for (size_t i = 0; i < tasks_.size(); i++) {
+		TaskState& state = tasks_[i];
+		state.generation++;
+		if (!state.scheduled) continue;
+
+		state.entryDeadline = state.deadline;
+		Entry entry = { state.deadline, (int)i, state.generation };
+		heap_.push_back(entry);
+	}
+
+	std::make_heap(heap_.begin(), heap_.end(), LaterDeadline());
+}
@@ -0,0 +1,66 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#ifndef SCHEDULER_H_SEEN
+#define SCHEDULER_H_SEEN
+
+#include <vector>
+#include <inttypes.h>
+
+/*
+ * Keeps deadlines for a driver's timed work (polls, probes, watchdogs) on the monotonic clock.
+ * Tasks are small numbers chosen by the driver, each having at most one deadline: scheduling a task again
+ * replaces its deadline. Due tasks are taken out with popDueTask() and getTimeout() tells how long the
+ * server loop may sleep, so a driver is only woken up when something is actually due.
+ * Deadlines are kept in a binary heap; entries made obsolete by cancelling or rescheduling are dropped lazily.
+ */
+class Scheduler {
+public:
+	static const int NO_TASK;
+
+	Scheduler();
+
+	void schedule(int task, int delay);
+	void cancel(int task);
+	void cancelAll();
+	bool isScheduled(int task) const;
+
+	int popDueTask();
+	int getTimeout();
+
+private:
+	Scheduler(const Scheduler& o);
+	void operator=(const Scheduler& o);
+
+	struct Entry {
+		uint64_t deadline;
+		int task;
+		uint32_t generation;
+	};
+
+	//orders the heap so the earliest deadline is in front
+	struct LaterDeadline {
+		bool operator()(const Entry& a, const Entry& b) const { return a.deadline > b.deadline; }
+	};
+
+	struct TaskState {
+		bool scheduled;
+		uint64_t deadline;      //can be later than the deadline of the task's heap entry, see settle()
+		uint64_t entryDeadline;
+		uint32_t generation;    //incremented whenever the task's heap entry becomes obsolete
+	};
+
+	std::vector<Entry> heap_;
+	std::vector<TaskState> tasks_;
+
+	void push(int task, uint64_t deadline);
+	void settle();
+	void compact();
+};
+
+#endif /* ! SCHEDULER_H_SEEN */
@@ -14,6 +14,7 @@
 #include <unistd.h>
 
 #include "Serial.h"
+#include "SerialTrace.h"
 #include "../utils.h"
 
 #ifdef __APPLE__
@@ -59,9 +60,15 @@ using std::string;
 
 
 const int Serial::READ_BUF_SIZE = 1024;
+//only the DTR edge resets (Arduino-based) boards, so a short pulse suffices and keeps setSpeed() from blocking long
+const int Serial::DTR_PULSE_DURATION = 10;
 
 Serial::Serial()
-: portFd_(-1), buffer_(0), bufferSize_(0), log_(Logger::getInstance()) { }
+: portFd_(-1), buffer_(0), bufferSize_(0), capture_(0), log_(Logger::getInstance()) { }
+
+Serial::~Serial() {
+	closeCapture();
+}
 
 int Serial::open(const char* file) {
 	//ESERIAL_SET_SPEED_RESULT spdResult;
@@ -141,11 +148,13 @@ Serial::SET_SPEED_RESULT Serial::setSpeed(int speed) {
 	if (ioctl(portFd_, TCSETS2, &options) < 0) return SSR_IO_SET;
 #endif
 
-	//toggle DTR
-	if (ioctl(portFd_, TIOCMGET, &modemBits) < 0) return SSR_IO_MGET;
+	if (capture_) capture_->appendSpeed(speed);
+
+	//toggle DTR (pseudo terminals, as used by print3d-replay, have no modem lines)
+	if (ioctl(portFd_, TIOCMGET, &modemBits) < 0) return (errno == ENOTTY || errno == EINVAL) ? SSR_OK : SSR_IO_MGET;
 	modemBits |= TIOCM_DTR;
 	if (ioctl(portFd_, TIOCMSET, &modemBits) < 0) return SSR_IO_MSET1;
-	usleep(100 * 1000);
+	usleep(DTR_PULSE_DURATION * 1000);
 	modemBits &=~TIOCM_DTR;
 	if (ioctl(portFd_, TIOCMSET, &modemBits) < 0) return SSR_IO_MSET2;
 
@@ -155,7 +164,9 @@ Serial::SET_SPEED_RESULT Serial::setSpeed(int speed) {
 bool Serial::send(const char* code) const {
   //LOG(Logger::VERBOSE,"Serial::send(): %s", code);
 	if (portFd_ >= 0) {
-		::write(portFd_, code, strlen(code));
+		size_t len = strlen(code);
+		ssize_t rv = ::write(portFd_, code, len);
+		if (capture_ && rv > 0) capture_->append(SerialTrace::RT_WRITE, code, rv);
 		return true;
 	} else {
 		return false;
@@ -164,7 +175,8 @@ bool Serial::send(const char* code) const {
 
 bool Serial::write(const unsigned char *data, size_t datalen) {
 	if (portFd_ >= 0) {
-		::write(portFd_, data, datalen);
+		ssize_t rv = ::write(portFd_, data, datalen);
+		if (capture_ && rv > 0) capture_->append(SerialTrace::RT_WRITE, data, rv);
 		return true;
 	} else {
 		return false;
@@ -173,7 +185,8 @@ bool Serial::write(const unsigned char *data, size_t datalen) {
 
 bool Serial::write(const unsigned char b) {
 	if (portFd_ >= 0) {
-		::write(portFd_, &b, 1);
+		ssize_t rv = ::write(portFd_, &b, 1);
+		if (capture_ && rv > 0) capture_->append(SerialTrace::RT_WRITE, &b, rv);
 		return true;
 	} else {
 		return false;
@@ -186,6 +199,7 @@ int Serial::readData(int timeout, bool onlyOnce) {
 
 
   int rv = readAndAppendAvailableData(portFd_, &buffer_, &bufferSize_, timeout, onlyOnce ? 1 : 0);
+  if (capture_ && rv > 0) capture_->append(SerialTrace::RT_READ, buffer_ + bufferSize_ - rv, rv);
   return rv;
 }
 
@@ -232,6 +246,7 @@ int Serial::readBytesDirect(unsigned char *buf, size_t buflen, int timeout) {
 		} else if (rv == 0) {
 			return -2;
 		} else {
+			if (capture_) capture_->append(SerialTrace::RT_READ, buf, rv);
 			return rv;
 		}
 	}
@@ -309,3 +324,38 @@ string* Serial::extractLine() {
 
   return line;
 }
+
+/*
+ * Starts recording all data read from and written to the port (and speed changes) into the given trace file.
+ * See SerialTrace for the file format and server/replay.cpp for a tool to play it back.
+ */
+int Serial::openCapture(const char* file) {
+	closeCapture();
+
+	capture_ = new SerialTrace();
+	if (capture_->openForWriting(file) < 0) {
+		LOG(Logger::ERROR, "could not open capture file '%s' (%s)", file, strerror(errno));
+		delete capture_;
+		capture_ = 0;
+		return -1;
+	}
+
+	LOG(Logger::INFO, "capturing serial traffic to '%s'", file);
+	return 0;
+}
+
+int Serial::closeCapture() {
+	int rv = 0;
+
+	if (capture_) {
+		rv = capture_->close();
+		delete capture_;
+		capture_ = 0;
+	}
+
+	return rv;
+}
+
+bool Serial::isCapturing() const {
+	return capture_ != 0;
+}
@@ -12,6 +12,8 @@
 #include <string>
 #include "../server/Logger.h"
 
+class SerialTrace;
+
 class Serial {
 public:
 	typedef enum ESERIAL_SET_SPEED_RESULT {
@@ -19,6 +21,7 @@ public:
 	} SET_SPEED_RESULT;
 
 	Serial();
+	~Serial();
 
 	int open(const char* file);
 	int close();
@@ -46,8 +49,13 @@ public:
   //convenience function for plain text data
   std::string* extractLine();
 
+  int openCapture(const char* file);
+  int closeCapture();
+  bool isCapturing() const;
+
 private:
   static const int READ_BUF_SIZE;
+  static const int DTR_PULSE_DURATION; //in milliseconds
 
 	Serial(const Serial& o);
 	void operator=(const Serial& o);
@@ -57,6 +65,8 @@ private:
   char* buffer_;
   int bufferSize_;
 
+  SerialTrace* capture_;
+
   Logger& log_;
 	//static char* dev_name;
 	//static int baud_rate;
@@ -0,0 +1,130 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#include <string.h>
+#include "SerialTrace.h"
+#include "../utils.h"
+
+using std::string;
+
+const char SerialTrace::MAGIC[] = { 'P', '3', 'D', 'T' };
+const uint16_t SerialTrace::VERSION = 1;
+const size_t SerialTrace::MAX_RECORD_DATA = 0xFFFF;
+
+SerialTrace::SerialTrace()
+: file_(0), writing_(false), lastTimestamp_(0) { }
+
+SerialTrace::~SerialTrace() {
+	close();
+}
+
+int SerialTrace::openForWriting(const char *path) {
+	close();
+
+	file_ = fopen(path, "wb");
+	if (!file_) return -1;
+
+	char header[sizeof(MAGIC) + 2];
+	memcpy(header, MAGIC, sizeof(MAGIC));
+	store_ns(header + sizeof(MAGIC), VERSION);
+	//flushed right away, a copy left in the stdio buffer would be written twice if the server forks afterwards
+	if (fwrite(header, sizeof(header), 1, file_) < 1 || fflush(file_) != 0) {
+		close();
+		return -1;
+	}
+
+	writing_ = true;
+	lastTimestamp_ = getMicros();
+	return 0;
+}
+
+//returns 0 on success, -1 on system error or -2 if the file is not a trace (or has an unsupported version)
+int SerialTrace::openForReading(const char *path) {
+	close();
+
+	file_ = fopen(path, "rb");
+	if (!file_) return -1;
+
+	char header[sizeof(MAGIC) + 2];
+	if (fread(header, sizeof(header), 1, file_) < 1 ||
+			memcmp(header, MAGIC, sizeof(MAGIC)) != 0 || read_ns(header + sizeof(MAGIC)) != VERSION) {
+		close();
+		return -2;
+	}
+
+	writing_ = false;
+	lastTimestamp_ = 0;
+	return 0;
+}
+
+int SerialTrace::close() {
+	int rv = 0;
+	if (file_) rv = fclose(file_);
+	file_ = 0;
+	return rv;
+}
+
+bool SerialTrace::isOpen() const {
+	return file_ != 0;
+}
+
+/*
+ * Appends a record, splitting up data which does not fit in a single record.
+ * Each record is flushed right away, so a trace is complete up to the last record when the server gets killed.
+ */
+void SerialTrace::append(RECORD_TYPE type, const void *data, size_t datalen) {
+	if (!file_ || !writing_) return;
+
+	uint64_t now = getMicros();
+	uint64_t delta = now - lastTimestamp_;
+	lastTimestamp_ = now;
+	if (delta > 0xFFFFFFFF) delta = 0xFFFFFFFF; //gaps over ~71 minutes are clamped
+
+	const char *p = (const char*)data;
+	do {
+		size_t len = datalen > MAX_RECORD_DATA ? MAX_RECORD_DATA : datalen;
+		char header[7];
+		header[0] = (char)type;
+		store_nl(header + 1, (uint32_t)delta);
+		store_ns(header + 5, (uint16_t)len);
+		fwrite(header, sizeof(header), 1, file_);
+		if (len > 0) fwrite(p, len, 1, file_);
+
+		p += len;
+		datalen -= len;
+		delta = 0;
+	} while (datalen > 0);
+
+	fflush(file_);
+}
+
+void SerialTrace::appendSpeed(uint32_t speed) {
+	char data[4];
+	store_nl(data, speed);
+	append(RT_SPEED, data, sizeof(data));
+}
+
+//returns 1 if a record has been read, 0 at end of file, -1 on system error or -2 on a truncated record
+int SerialTrace::readNext(Record &record) {
+	if (!file_ || writing_) return -1;
+
+	char header[7];
+	size_t rv = fread(header, 1, sizeof(header), file_);
+	if (rv == 0) return ferror(file_) ? -1 : 0;
+	if (rv < sizeof(header)) return -2;
+
+	uint16_t len = read_ns(header + 5);
+	lastTimestamp_ += read_nl(header + 1);
+
+	record.type = (RECORD_TYPE)header[0];
+	record.timestamp = lastTimestamp_;
+	record.data.resize(len);
+	if (len > 0 && fread(&record.data[0], len, 1, file_) < 1) return ferror(file_) ? -1 : -2;
+
+	return 1;
+}
@@ -0,0 +1,64 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#ifndef SERIAL_TRACE_H_SEEN
+#define SERIAL_TRACE_H_SEEN
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string>
+
+/*
+ * Reads and writes binary serial traffic traces as captured by Serial (see Serial::openCapture()).
+ *
+ * File layout: a 4 byte magic ('P3DT') and a 2 byte version, followed by records consisting of
+ * a 1 byte type, a 4 byte time delta in microseconds since the previous record, a 2 byte data
+ * length and the data itself. All numbers are in network byte order. Records carrying more than
+ * MAX_RECORD_DATA bytes are split up.
+ */
+class SerialTrace {
+public:
+	typedef enum RECORD_TYPE {
+		RT_READ = 'R',  /* bytes received from the device */
+		RT_WRITE = 'W', /* bytes sent to the device */
+		RT_SPEED = 'S'  /* baud rate change, data contains the new speed as 4 byte number */
+	} RECORD_TYPE;
+
+	struct Record {
+		RECORD_TYPE type;
+		uint64_t timestamp; //microseconds since the first record
+		std::string data;
+	};
+
+	static const size_t MAX_RECORD_DATA;
+
+	SerialTrace();
+	~SerialTrace();
+
+	int openForWriting(const char *path);
+	int openForReading(const char *path);
+	int close();
+	bool isOpen() const;
+
+	void append(RECORD_TYPE type, const void *data, size_t datalen);
+	void appendSpeed(uint32_t speed);
+	int readNext(Record &record);
+
+private:
+	static const char MAGIC[];
+	static const uint16_t VERSION;
+
+	SerialTrace(const SerialTrace& o);
+	void operator=(const SerialTrace& o);
+
+	FILE *file_;
+	bool writing_;
+	uint64_t lastTimestamp_;
+};
+
+#endif /* ! SERIAL_TRACE_H_SEEN */
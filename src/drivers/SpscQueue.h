@@ -0,0 +1,67 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#ifndef SPSC_QUEUE_H_SEEN
+#define SPSC_QUEUE_H_SEEN
+
+#include <stddef.h>
+
+/*
+ * Fixed size lock-free queue for passing items from exactly one producer thread to exactly one
+ * consumer thread. push() may only be called by the producer, pop() only by the consumer.
+ * Each index is only written by one side; the barriers make sure an item is completely stored
+ * before the other side can see the index move.
+ */
+template <typename T>
+class SpscQueue {
+public:
+	SpscQueue(size_t capacity)
+	: size_(capacity + 1), items_(new T[capacity + 1]), head_(0), tail_(0) { }
+
+	~SpscQueue() {
+		delete[] items_;
+	}
+
+	//returns false if the queue is full
+	bool push(const T& item) {
+		size_t tail = tail_, next = (tail + 1) % size_;
+		if (next == head_) return false;
+
+		items_[tail] = item;
+		__sync_synchronize();
+		tail_ = next;
+		return true;
+	}
+
+	//returns false if the queue is empty
+	bool pop(T& item) {
+		size_t head = head_;
+		if (head == tail_) return false;
+
+		__sync_synchronize();
+		item = items_[head];
+		__sync_synchronize();
+		head_ = (head + 1) % size_;
+		return true;
+	}
+
+	bool empty() const {
+		return head_ == tail_;
+	}
+
+private:
+	SpscQueue(const SpscQueue& o);
+	void operator=(const SpscQueue& o);
+
+	const size_t size_;
+	T *items_;
+	volatile size_t head_; //only written by the consumer
+	volatile size_t tail_; //only written by the producer
+};
+
+#endif /* ! SPSC_QUEUE_H_SEEN */
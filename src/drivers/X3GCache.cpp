@@ -0,0 +1,271 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#include <algorithm>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include "X3GCache.h"
+#include "../server/Logger.h"
+#include "../utils.h"
+
+using std::string;
+
+//NOTE: see Server.cpp for comments on this macro
+#define LOG(lvl, fmt, ...) Logger::getInstance().log(lvl, "X3GC", fmt, ##__VA_ARGS__)
+
+const uint64_t X3GCache::HASH_INIT = 0xcbf29ce484222325ULL; //FNV-1a 64 bit offset basis
+const char X3GCache::MAGIC[] = { 'X', '3', 'G', 'C' };
+const uint16_t X3GCache::VERSION = 1;
+const char *X3GCache::ENTRY_SUFFIX = ".x3g";
+
+X3GCache::X3GCache(const string& dir, uint64_t maxSize)
+: dir_(dir), maxSize_(maxSize), readFile_(0), writeFile_(0) { }
+
+X3GCache::~X3GCache() {
+	closeEntry();
+	discardEntry();
+}
+
+bool X3GCache::isEnabled() const {
+	return maxSize_ > 0 && !dir_.empty();
+}
+
+/*
+ * Opens the entry for the given key for reading, returns false if there is none (or it cannot be used).
+ * Opening an entry marks it as recently used.
+ */
+bool X3GCache::openEntry(uint64_t key) {
+	closeEntry();
+	if (!isEnabled()) return false;
+
+	string path = getEntryPath(key);
+	readFile_ = fopen(path.c_str(), "rb");
+	if (!readFile_) return false;
+
+	char header[sizeof(MAGIC) + 2];
+	if (fread(header, sizeof(header), 1, readFile_) < 1 ||
+			memcmp(header, MAGIC, sizeof(MAGIC)) != 0 || read_ns(header + sizeof(MAGIC)) != VERSION) {
+		LOG(Logger::WARNING, "removing unusable cache entry '%s'", path.c_str());
+		closeEntry();
+		unlink(path.c_str());
+		return false;
+	}
+
+	utime(path.c_str(), NULL);
+	return true;
+}
+
+/*
+ * Appends the commands of the next record to the given queue and stores the number of lines they were converted from.
+ * Returns 1 if a record has been read, 0 at end of file, -1 on system error or -2 on a truncated or malformed record.
+ * Nothing is appended unless the complete record could be read.
+ */
+int X3GCache::readRecord(int32_t *lines, S3GCommandQueue& commands) {
+	if (!readFile_) return -1;
+
+	char header[8];
+	size_t rv = fread(header, 1, sizeof(header), readFile_);
+	if (rv == 0) return ferror(readFile_) ? -1 : 0;
+	if (rv < sizeof(header)) return -2;
+
+	uint32_t len = read_nl(header + 4);
+	recordBuf_.resize(len);
+	if (len > 0 && fread(&recordBuf_[0], len, 1, readFile_) < 1) return ferror(readFile_) ? -1 : -2;
+
+	for (uint32_t pos = 0; pos < len; pos += 1 + (uint8_t)recordBuf_[pos]) {
+		if (pos + 1 + (uint8_t)recordBuf_[pos] > len) return -2;
+	}
+
+	for (uint32_t pos = 0; pos < len; pos += 1 + (uint8_t)recordBuf_[pos]) {
+		commands.append((const uint8_t*)recordBuf_.data() + pos + 1, (uint8_t)recordBuf_[pos]);
+	}
+
+	*lines = (int32_t)read_nl(header);
+	return 1;
+}
+
+void X3GCache::closeEntry() {
+	if (readFile_) fclose(readFile_);
+	readFile_ = 0;
+}
+
+bool X3GCache::isReading() const {
+	return readFile_ != 0;
+}
+
+//starts a new entry in a temporary file, it only becomes visible by calling commitEntry()
+bool X3GCache::beginEntry() {
+	discardEntry();
+	if (!isEnabled()) return false;
+
+	if (mkdir(dir_.c_str(), 0755) < 0 && errno != EEXIST) {
+		LOG(Logger::WARNING, "could not create cache directory '%s' (%s)", dir_.c_str(), strerror(errno));
+		return false;
+	}
+
+	string path = dir_ + "/.entry-XXXXXX";
+	std::vector<char> pathBuf(path.begin(), path.end());
+	pathBuf.push_back('\0');
+
+	int fd = mkstemp(&pathBuf[0]);
+	if (fd < 0) {
+		LOG(Logger::WARNING, "could not create cache entry in '%s' (%s)", dir_.c_str(), strerror(errno));
+		return false;
+	}
+	tempPath_ = &pathBuf[0];
+
+	char header[sizeof(MAGIC) + 2];
+	memcpy(header, MAGIC, sizeof(MAGIC));
+	store_ns(header + sizeof(MAGIC), VERSION);
+
+	writeFile_ = fdopen(fd, "wb");
+	if (!writeFile_) {
+		::close(fd);
+		unlink(tempPath_.c_str());
+		tempPath_.clear();
+		return false;
+	}
+
+	if (fwrite(header, sizeof(header), 1, writeFile_) < 1) {
+		discardEntry();
+		return false;
+	}
+
+	return true;
+}
+
+//on failure, the entry is discarded
+bool X3GCache::writeRecord(int32_t lines, const S3GCommandQueue& commands) {
+	if (!writeFile_) return false;
+
+	recordBuf_.resize(8);
+	store_nl(&recordBuf_[0], (uint32_t)lines);
+
+	size_t pos = commands.begin(), len;
+	for (size_t i = 0; i < commands.size(); i++) {
+		const uint8_t *command = commands.get(&pos, &len);
+		recordBuf_ += (char)len;
+		recordBuf_.append((const char*)command, len);
+	}
+	store_nl(&recordBuf_[4], (uint32_t)(recordBuf_.size() - 8));
+
+	if (fwrite(recordBuf_.data(), recordBuf_.size(), 1, writeFile_) < 1) {
+		LOG(Logger::WARNING, "could not write to cache entry (%s), discarding it", strerror(errno));
+		discardEntry();
+		return false;
+	}
+
+	return true;
+}
+
+//makes the entry being written available under the given key and removes old entries if the cache has grown too large
+bool X3GCache::commitEntry(uint64_t key) {
+	if (!writeFile_) return false;
+
+	bool ok = fflush(writeFile_) == 0;
+	ok = (fclose(writeFile_) == 0) && ok;
+	writeFile_ = 0;
+
+	string path = getEntryPath(key);
+	if (!ok || rename(tempPath_.c_str(), path.c_str()) < 0) {
+		LOG(Logger::WARNING, "could not store cache entry '%s' (%s)", path.c_str(), strerror(errno));
+		unlink(tempPath_.c_str());
+		tempPath_.clear();
+		return false;
+	}
+
+	LOG(Logger::VERBOSE, "stored cache entry '%s'", path.c_str());
+	tempPath_.clear();
+	evict();
+	return true;
+}
+
+//stops writing and removes the uncommitted entry
+void X3GCache::discardEntry() {
+	if (!writeFile_) return;
+
+	fclose(writeFile_);
+	writeFile_ = 0;
+	unlink(tempPath_.c_str());
+	tempPath_.clear();
+}
+
+bool X3GCache::isWriting() const {
+	return writeFile_ != 0;
+}
+
+//STATIC
+//FNV-1a, pass HASH_INIT to start a new hash or the previous result to continue it
+uint64_t X3GCache::hash(uint64_t h, const void *data, size_t len) {
+	const unsigned char *p = (const unsigned char*)data;
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+string X3GCache::getEntryPath(uint64_t key) const {
+	char name[17];
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+	return dir_ + "/" + name + ENTRY_SUFFIX;
+}
+
+namespace {
+	struct EntryInfo {
+		string path;
+		time_t mtime;
+		uint64_t size;
+
+		bool operator<(const EntryInfo& o) const { return mtime < o.mtime; }
+	};
+}
+
+//removes the least recently used entries until the total size is within bounds
+void X3GCache::evict() {
+	DIR *dir = opendir(dir_.c_str());
+	if (!dir) return;
+
+	std::vector<EntryInfo> entries;
+	uint64_t total = 0;
+	size_t suffixLen = strlen(ENTRY_SUFFIX);
+	struct dirent *de;
+
+	while ((de = readdir(dir)) != NULL) {
+		size_t nameLen = strlen(de->d_name);
+		if (nameLen <= suffixLen || strcmp(de->d_name + nameLen - suffixLen, ENTRY_SUFFIX) != 0) continue;
+
+		EntryInfo info;
+		info.path = dir_ + "/" + de->d_name;
+		struct stat st;
+		if (stat(info.path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) continue;
+
+		info.mtime = st.st_mtime;
+		info.size = st.st_size;
+		total += info.size;
+		entries.push_back(info);
+	}
+	closedir(dir);
+
+	std::sort(entries.begin(), entries.end());
+	for (size_t i = 0; i < entries.size() && total > maxSize_; i++) {
+		LOG(Logger::VERBOSE, "evicting cache entry '%s'", entries[i].path.c_str());
+		if (unlink(entries[i].path.c_str()) == 0) total -= entries[i].size;
+	}
+}
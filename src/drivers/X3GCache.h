@@ -0,0 +1,71 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#ifndef X3G_CACHE_H_SEEN
+#define X3G_CACHE_H_SEEN
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string>
+#include "S3GCommandQueue.h"
+
+/*
+ * Keeps converted x3g on disk, so reprinting a job does not need GPX again. Entries are named after
+ * a 64 bit FNV-1a hash of the job's gcode (see hash()) and hold the commands in the order they were
+ * converted, together with the number of gcode lines each batch was converted from.
+ * New entries are written to a temporary file and renamed when complete. When the total size of
+ * all entries exceeds the configured maximum, the least recently used ones are removed.
+ *
+ * One entry can be read while another one is being written.
+ *
+ * File layout: a 4 byte magic ('X3GC') and a 2 byte version, followed by records consisting of a
+ * 4 byte line count, a 4 byte data length and the data itself, which is a sequence of commands each
+ * preceded by its length in 1 byte. All numbers are in network byte order.
+ */
+class X3GCache {
+public:
+	static const uint64_t HASH_INIT;
+
+	X3GCache(const std::string& dir, uint64_t maxSize);
+	~X3GCache();
+
+	bool isEnabled() const;
+
+	bool openEntry(uint64_t key);
+	int readRecord(int32_t *lines, S3GCommandQueue& commands);
+	void closeEntry();
+	bool isReading() const;
+
+	bool beginEntry();
+	bool writeRecord(int32_t lines, const S3GCommandQueue& commands);
+	bool commitEntry(uint64_t key);
+	void discardEntry();
+	bool isWriting() const;
+
+	static uint64_t hash(uint64_t h, const void *data, size_t len);
+
+private:
+	static const char MAGIC[];
+	static const uint16_t VERSION;
+	static const char *ENTRY_SUFFIX;
+
+	X3GCache(const X3GCache& o);
+	void operator=(const X3GCache& o);
+
+	std::string dir_;
+	uint64_t maxSize_; //0 disables the cache
+	FILE *readFile_;
+	FILE *writeFile_;
+	std::string tempPath_;
+	std::string recordBuf_;
+
+	std::string getEntryPath(uint64_t key) const;
+	void evict();
+};
+
+#endif /* ! X3G_CACHE_H_SEEN */
@@ -0,0 +1,223 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "X3GConverter.h"
+#include "S3GParser.h"
+#include "../server/Logger.h"
+
+using std::string;
+
+//NOTE: see Server.cpp for comments on this macro
+#define LOG(lvl, fmt, ...) Logger::getInstance().log(lvl, "X3GC", fmt, ##__VA_ARGS__)
+
+const int X3GConverter::MAX_PENDING = 16;
+
+X3GConverter::X3GConverter()
+: jobs_(MAX_PENDING), batches_(MAX_PENDING), pending_(0), generation_(0), stateGeneration_(0), running_(false), stopping_(false) {
+	notifyFds_[0] = notifyFds_[1] = -1;
+	pthread_mutex_init(&mutex_, NULL);
+	pthread_cond_init(&cond_, NULL);
+}
+
+X3GConverter::~X3GConverter() {
+	if (running_) {
+		pthread_mutex_lock(&mutex_);
+		stopping_ = true;
+		pthread_cond_signal(&cond_);
+		pthread_mutex_unlock(&mutex_);
+		pthread_join(thread_, NULL);
+	}
+
+	Job job;
+	while (jobs_.pop(job)) delete job.gcode;
+	Batch *batch;
+	while (batches_.pop(batch)) delete batch;
+
+	if (notifyFds_[0] >= 0) ::close(notifyFds_[0]);
+	if (notifyFds_[1] >= 0) ::close(notifyFds_[1]);
+	pthread_cond_destroy(&cond_);
+	pthread_mutex_destroy(&mutex_);
+}
+
+//starts the worker thread, returns true if it is running
+bool X3GConverter::start() {
+	if (running_) return true;
+
+	if (notifyFds_[0] < 0) {
+		if (pipe(notifyFds_) < 0) {
+			LOG(Logger::ERROR, "could not create notification pipe (%s), converting on the main thread", strerror(errno));
+			notifyFds_[0] = notifyFds_[1] = -1;
+			return false;
+		}
+		for (int i = 0; i < 2; i++) fcntl(notifyFds_[i], F_SETFL, fcntl(notifyFds_[i], F_GETFL, 0) | O_NONBLOCK);
+	}
+
+	int rv = pthread_create(&thread_, NULL, &X3GConverter::run, this);
+	if (rv != 0) {
+		LOG(Logger::ERROR, "could not start conversion thread (%s), converting on the main thread", strerror(rv));
+		return false;
+	}
+
+	running_ = true;
+	return true;
+}
+
+bool X3GConverter::isRunning() const {
+	return running_;
+}
+
+//returns -1 if the worker is not running
+int X3GConverter::getFileDescriptor() const {
+	return running_ ? notifyFds_[0] : -1;
+}
+
+/*
+ * Hands a chunk of gcode to the worker. Returns false if MAX_PENDING chunks are already being converted.
+ * Without a worker, the chunk is converted right away.
+ */
+bool X3GConverter::convert(const string& gcode, int32_t lines) {
+	if (pending_ >= MAX_PENDING) return false;
+
+	Job job;
+	job.generation = generation_;
+	job.lines = lines;
+	job.gcode = new string(gcode);
+
+	if (!running_ && !start()) {
+		batches_.push(convertJob(job));
+		delete job.gcode;
+		pending_++;
+		return true;
+	}
+
+	jobs_.push(job);
+	pending_++;
+
+	pthread_mutex_lock(&mutex_);
+	pthread_cond_signal(&cond_);
+	pthread_mutex_unlock(&mutex_);
+
+	return true;
+}
+
+/*
+ * Returns the next converted batch or NULL if none is ready. Batches are returned in the order their gcode
+ * was handed over; the caller must delete them. Batches for gcode handed over before reset() are skipped.
+ */
+X3GConverter::Batch* X3GConverter::getBatch() {
+	if (notifyFds_[0] >= 0) {
+		char buf[64];
+		while (::read(notifyFds_[0], buf, sizeof(buf)) > 0) {}
+	}
+
+	Batch *batch;
+	while (batches_.pop(batch)) {
+		pending_--;
+		if (batch->generation == generation_) return batch;
+		delete batch;
+	}
+
+	return NULL;
+}
+
+//discards all gcode handed over so far and lets other converters use GPX, the next chunk starts with a clean GPX state
+void X3GConverter::reset() {
+	generation_++;
+	__sync_synchronize();
+	gpx_.release();
+}
+
+//returns the number of chunks handed over for which no batch has been picked up yet
+int X3GConverter::getPending() const {
+	return pending_;
+}
+
+GpxContext& X3GConverter::getGpxContext() {
+	return gpx_;
+}
+
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+//STATIC
+void* X3GConverter::run(void *arg) {
+	static_cast<X3GConverter*>(arg)->work();
+	return NULL;
+}
+
+void X3GConverter::work() {
+	while (true) {
+		Job job;
+		if (!jobs_.pop(job)) {
+			pthread_mutex_lock(&mutex_);
+			while (!stopping_ && jobs_.empty()) pthread_cond_wait(&cond_, &mutex_);
+			bool stop = stopping_;
+			pthread_mutex_unlock(&mutex_);
+
+			if (stop) break;
+			continue;
+		}
+
+		Batch *batch = convertJob(job);
+		delete job.gcode;
+
+		//cannot fail, no more than MAX_PENDING jobs are handed over before their batches are picked up
+		batches_.push(batch);
+		if (::write(notifyFds_[1], "", 1) < 0 && errno != EAGAIN) {
+			LOG(Logger::WARNING, "could not signal converted batch (%s)", strerror(errno));
+		}
+	}
+}
+
+//gcode handed over before the last reset() is not converted, its batch is returned empty
+X3GConverter::Batch* X3GConverter::convertJob(const Job& job) {
+	Batch *batch = new Batch();
+	batch->generation = job.generation;
+	batch->lines = job.lines;
+
+	__sync_synchronize();
+	if (job.generation != generation_ || job.gcode->empty()) return batch;
+
+	if (job.generation != stateGeneration_) {
+		gpx_.clearState();
+		stateGeneration_ = job.generation;
+	}
+
+	unsigned char *cvtBuf = 0;
+	long cvtBufLen = 0;
+	if (gpx_.convert(job.gcode->c_str(), job.gcode->size(), &cvtBuf, &cvtBufLen) == GpxContext::ERR_IN_USE) {
+		LOG(Logger::ERROR, "GPX is in use by another converter, dropped %i lines (it must be acquired first)", job.lines);
+		return batch;
+	}
+
+	S3GParser parser;
+	parser.setBuffer((const char*)cvtBuf, cvtBufLen);
+
+	size_t offset, len;
+	S3GParser::PARSE_RESULT pr;
+	while ((pr = parser.parseNextCommand(&offset, &len)) == S3GParser::PR_OK) {
+		if (!batch->commands.append(cvtBuf + offset, len)) {
+			LOG(Logger::ERROR, "command %u with %i bytes does not fit in a packet, dropped", cvtBuf[offset], (int)len);
+		}
+	}
+
+	if (pr != S3GParser::PR_END) {
+		LOG(Logger::ERROR, "could not parse converted gcode (%s, command %u at offset %i), dropped the remaining %i bytes",
+				S3GParser::getResultString(pr), cvtBuf[parser.getBufferPos()], (int)parser.getBufferPos(), (int)(cvtBufLen - parser.getBufferPos()));
+	}
+
+	free(cvtBuf);
+	return batch;
+}
@@ -0,0 +1,82 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#ifndef X3G_CONVERTER_H_SEEN
+#define X3G_CONVERTER_H_SEEN
+
+#include <pthread.h>
+#include <string>
+#include "GpxContext.h"
+#include "S3GCommandQueue.h"
+#include "SpscQueue.h"
+
+/*
+ * Converts gcode to x3g commands (using GPX) on a worker thread, so conversion never holds up the
+ * server's main loop. Chunks of gcode are handed over with convert(), converted batches are picked
+ * up with getBatch(); both directions use a lock-free queue. The file descriptor returned by
+ * getFileDescriptor() becomes readable when a batch is ready.
+ *
+ * The thread is started on first use. Each converter has its own GPX context (see GpxContext), which
+ * must have been acquired before gcode is handed over while other converters may be in use.
+ * reset() discards all pending work and releases GPX, its state is cleared before the next chunk is converted.
+ * If the thread cannot be started, chunks are converted immediately instead.
+ */
+class X3GConverter {
+public:
+	struct Batch {
+		unsigned int generation;
+		int32_t lines; //number of gcode lines the commands were converted from
+		S3GCommandQueue commands;
+	};
+
+	static const int MAX_PENDING;
+
+	X3GConverter();
+	~X3GConverter();
+
+	bool start();
+	bool isRunning() const;
+	int getFileDescriptor() const;
+
+	bool convert(const std::string& gcode, int32_t lines);
+	Batch* getBatch();
+	void reset();
+
+	int getPending() const;
+	GpxContext& getGpxContext();
+
+private:
+	struct Job {
+		unsigned int generation;
+		int32_t lines;
+		std::string *gcode;
+	};
+
+	X3GConverter(const X3GConverter& o);
+	void operator=(const X3GConverter& o);
+
+	GpxContext gpx_;
+	SpscQueue<Job> jobs_;
+	SpscQueue<Batch*> batches_;
+	int pending_; //number of jobs handed over for which no batch has been picked up yet (main thread only)
+	volatile unsigned int generation_;
+	unsigned int stateGeneration_; //generation GPX state was last cleared for (used by whichever thread converts)
+
+	bool running_;
+	bool stopping_;
+	pthread_t thread_;
+	pthread_mutex_t mutex_;
+	pthread_cond_t cond_;
+	int notifyFds_[2];
+
+	static void* run(void *arg);
+	void work();
+	Batch* convertJob(const Job& job);
+};
+
+#endif /* ! X3G_CONVERTER_H_SEEN */
@@ -6,7 +6,9 @@
  * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
  */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -14,6 +16,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
 #include "communicator.h"
 #include "../ipc_shared.h"
@@ -33,13 +37,39 @@ static const char *MOD_ABBR = "COMM";
  ***********/
 
 static const int IPC_WAIT_TIMEOUT = 60 * 1000; ///How long to poll for input when we expect data (60*1000 = 1 minute).
-static const int MAX_PACKET_SIZE = 1024 - 8; ///Largest packet which can make it through the ipc pipe (minus 8 bytes for cmdId+argNum+arg0Len).
+static const int CAPABILITIES_WAIT_TIMEOUT = 2 * 1000; ///Servers predating the capabilities command do not reply to it at all.
+#define MAX_SEND_ARGS 6 ///Largest number of arguments sendRequest() accepts.
+#define MAX_PENDING_REPLIES 8 ///Largest number of requests with an ID which can await their reply at the same time.
+#define UPLOAD_WINDOW 4 ///Number of gcode chunks sent ahead of their replies, if the server supports request IDs.
+static const int MAX_PACKET_SIZE = 1024 - 8; ///Largest packet which can make it through the ipc pipe (minus 8 bytes for cmdId+argNum+arg0Len), used if the server does not tell.
+static const int GCODE_APPEND_OVERHEAD = 4 + 4 + 6 + 3 * 8 + 4; ///Size of a gcode append command besides the gcode itself and the source text.
+
+#ifndef MFD_CLOEXEC
+# define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_ALLOW_SEALING
+# define MFD_ALLOW_SEALING 0x0002U
+#endif
 
 //Note: these names are used all the way on the other end in javascript, consider this when changing them.
 static const char *TRANSACTION_CANCELLED_STRING = "transaction_cancelled";
 static const char *RETRY_LATER_STRING = "retry_later";
 
 static int socketFd = -1;
+static int maxFrameSize = -1; ///Largest command the server accepts, 0 if it did not tell or -1 if it has not been asked yet.
+static int serverCapabilities = 0; ///IPC_CAPABILITY_BITS reported by the server.
+
+typedef struct pending_reply_s {
+	int in_use;
+	uint32_t id;
+	char *reply; ///Set when the reply has been received before it was asked for.
+	int replylen;
+} pending_reply_s;
+
+static pending_reply_s pendingReplies[MAX_PENDING_REPLIES];
+static uint32_t nextRequestId = 1;
+static char *rxBuf = NULL; ///Data received on socketFd which has not been matched to a request ID yet.
+static int rxLen = 0;
 static char *error = NULL;
 
 
@@ -96,6 +126,83 @@ static int closeSocketInternal(int fd) {
 	return close(fd);
 }
 
+//sends a command given as a list of iovecs (the first one starting with the command code), returns -1 on error
+//if passFd is not -1, that file descriptor is sent along with the command (SCM_RIGHTS)
+static int sendIov(int fd, struct iovec *iov, int iovcnt, int cmdlen, int passFd) {
+	const char *sbuf = (const char*)iov[0].iov_base;
+
+	if (log_get_level() >= LLVL_BULK) {
+		int joinedlen;
+		char *joined = ipc_iov_join(iov, iovcnt, &joinedlen);
+		if (joined) log_ipc_cmd(LLVL_BULK, joined, joinedlen, 0);
+		free(joined);
+	}
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	if (passFd >= 0) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &passFd, sizeof(int));
+	}
+
+	//the socket is non-blocking, so large commands are sent in parts as the server reads them
+	int sent = 0;
+	while (sent < cmdlen) {
+		int rv = sendmsg(fd, &msg, 0);
+
+		if (rv < 0 && errno == EINTR) continue;
+		if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+			if (poll(&pfd, 1, IPC_WAIT_TIMEOUT) > 0) continue;
+
+			LOG(LLVL_ERROR, "could not send complete ipc command 0x%x (%i bytes written)", ipc_cmd_get(sbuf, 4), sent);
+			setError("could not send complete ipc command");
+			return -1;
+		}
+		if (log_check_error(rv, MOD_ABBR, "error sending ipc command 0x%x", ipc_cmd_get(sbuf, 4))) {
+			setError("could not send ipc command");
+			return -1;
+		}
+
+		sent += rv;
+		msg.msg_control = NULL; //the descriptor went along with the first part
+		msg.msg_controllen = 0;
+		while (rv > 0 && msg.msg_iovlen > 0) {
+			if ((size_t)rv < msg.msg_iov->iov_len) {
+				msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + rv;
+				msg.msg_iov->iov_len -= rv;
+				break;
+			}
+			rv -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+	}
+
+	return 0;
+}
+
+static char* receiveData(int fd, int *rbuflen, int timeout) {
+	char *rbuf = 0;
+	*rbuflen = 0;
+	//read only once to avoid unneccessary timeout but still allow for the timeout to happen
+	log_check_error(readAndAppendAvailableData(fd, &rbuf, rbuflen, timeout, 1), MOD_ABBR, "error reading data from domain socket");
+
+	return rbuf;
+}
+
 static char* sendAndReceiveDataWithFd(int fd, const char *sbuf, int sbuflen, int *rbuflen) {
 	if (fd < 0) return NULL;
 
@@ -105,61 +212,178 @@ static char* sendAndReceiveDataWithFd(int fd, const char *sbuf, int sbuflen, int
 		return NULL;
 	}
 
-	log_ipc_cmd(LLVL_BULK, sbuf, sbuflen, 0);
-	int rv = send(fd, sbuf, sbuflen, 0); //this should block until all data has been sent
+	struct iovec iov = { (void*)sbuf, sbuflen };
+	if (sendIov(fd, &iov, 1, sbuflen, -1) < 0) return NULL;
 
-	if (log_check_error(rv, MOD_ABBR, "error sending ipc command 0x%x", ipc_cmd_get(sbuf, sbuflen))) {
-		setError("could not send ipc command");
-		return NULL;
-	} else if (rv < sbuflen) {
-		LOG(LLVL_ERROR, "could not send complete ipc command 0x%i (%i bytes written)", ipc_cmd_get(sbuf, sbuflen), rv);
-		setError("could not send complete ipc command");
+	return receiveData(fd, rbuflen, IPC_WAIT_TIMEOUT);
+}
+
+//forgets all requests awaiting a reply, along with any data received for them
+static void resetPendingReplies() {
+	for (int i = 0; i < MAX_PENDING_REPLIES; i++) {
+		free(pendingReplies[i].reply);
+		pendingReplies[i].reply = NULL;
+		pendingReplies[i].in_use = 0;
 	}
+	free(rxBuf);
+	rxBuf = NULL;
+	rxLen = 0;
+}
 
-	char *rbuf = 0;
-	*rbuflen = 0;
-	//read only once to avoid unneccessary timeout but still allow for the timeout to happen
-	log_check_error(readAndAppendAvailableData(fd, &rbuf, rbuflen, IPC_WAIT_TIMEOUT, 1), MOD_ABBR, "error reading data from domain socket");
+static pending_reply_s *findPendingReply(uint32_t id) {
+	for (int i = 0; i < MAX_PENDING_REPLIES; i++) {
+		if (pendingReplies[i].in_use && pendingReplies[i].id == id) return &pendingReplies[i];
+	}
+	return NULL;
+}
 
-	return rbuf;
+/*
+ * Encodes the command into hdrbuf (which must be IPC_IOV_BUF_SIZE(MAX_SEND_ARGS) bytes) and sends it, large data
+ * arguments are sent without being copied. If useId is non-zero, the command gets a request ID (stored in requestId)
+ * and its reply is to be taken with receiveReply(); other requests may be sent in the meantime.
+ * If passFd is not -1, that file descriptor is sent along with the command.
+ * Returns 0 on success or -1 on error.
+ */
+static int sendRequest(IPC_COMMAND_CODE code, const ipc_arg_s *args, int numArgs, int useId, char *hdrbuf, uint32_t *requestId, int passFd) {
+	if (socketFd < 0) return -1;
+
+	pending_reply_s *pending = NULL;
+	if (useId) {
+		for (int i = 0; i < MAX_PENDING_REPLIES && !pending; i++) {
+			if (!pendingReplies[i].in_use) pending = &pendingReplies[i];
+		}
+		if (!pending) {
+			LOG(LLVL_ERROR, "too many requests awaiting a reply");
+			setError("too many requests in flight");
+			return -1;
+		}
+		*requestId = nextRequestId++;
+		if (nextRequestId == 0) nextRequestId = 1;
+	}
+
+	struct iovec iov[IPC_IOV_COUNT(MAX_SEND_ARGS)];
+	int iovcnt;
+	int cmdlen = (numArgs <= MAX_SEND_ARGS) ?
+			ipc_cmd_encode_iov(hdrbuf, IPC_IOV_BUF_SIZE(numArgs), iov, &iovcnt, code, useId ? requestId : NULL, args, numArgs) : -1;
+	if (cmdlen < 0) {
+		LOG(LLVL_ERROR, "could not encode ipc command 0x%x", code);
+		setError("ipc command construction failed");
+		return -1;
+	}
+
+	if (sendIov(socketFd, iov, iovcnt, cmdlen, passFd) < 0) return -1;
+
+	if (pending) {
+		pending->in_use = 1;
+		pending->id = *requestId;
+		pending->reply = NULL;
+	}
+	return 0;
+}
+
+/*
+ * Returns the reply to a request sent with sendRequest() (to be freed by the caller), or NULL on error.
+ * Replies carrying the ID of another pending request are kept until that one is asked for.
+ */
+static char *receiveReply(int useId, uint32_t requestId, int *rbuflen) {
+	if (!useId) return receiveData(socketFd, rbuflen, IPC_WAIT_TIMEOUT);
+
+	pending_reply_s *pending = findPendingReply(requestId);
+	if (!pending) return NULL;
+
+	while (!pending->reply) {
+		ipc_frame_s frame;
+		int len = ipc_cmd_parse(rxBuf, rxLen, &frame);
+
+		if (len == 0) {
+			int rv = readAndAppendAvailableData(socketFd, &rxBuf, &rxLen, IPC_WAIT_TIMEOUT, 1);
+			if (rv <= 0) {
+				log_check_error(rv, MOD_ABBR, "error reading data from domain socket");
+				LOG(LLVL_ERROR, "no reply received for request #%u", requestId);
+				setError("no reply from server");
+				return NULL;
+			}
+			continue;
+		}
+
+		pending_reply_s *target = frame.has_request_id ? findPendingReply(frame.request_id) : NULL;
+		if (target && !target->reply) {
+			target->reply = (char*)malloc(len);
+			if (!target->reply) return NULL;
+			memcpy(target->reply, rxBuf, len);
+			target->replylen = len;
+		} else {
+			LOG(LLVL_WARNING, "dropping ipc reply 0x%x which does not belong to any pending request", frame.code);
+		}
+
+		memmove(rxBuf, rxBuf + len, rxLen - len);
+		rxLen -= len;
+	}
+
+	char *reply = pending->reply;
+	*rbuflen = pending->replylen;
+	pending->reply = NULL;
+	pending->in_use = 0;
+	return reply;
 }
 
 static char* sendAndReceiveData(const char *sbuf, int sbuflen, int *rbuflen) {
 	return sendAndReceiveDataWithFd(socketFd, sbuf, sbuflen, rbuflen);
 }
 
+//returns a copy of a text argument as a nul-terminated string (to be freed by the caller), or NULL
+static char *copyTextArg(const ipc_frame_s *frame, int argidx) {
+	const char *arg;
+	uint32_t arglen;
+	if (ipc_frame_get_arg(frame, argidx, &arg, &arglen) < 0) return NULL;
+
+	char *text = (char*)malloc(arglen + 1);
+	if (!text) return NULL;
+	memcpy(text, arg, arglen);
+	text[arglen] = '\0';
+	return text;
+}
+
 //returns 0 on success, -1 on error, -2 if appending gcode failed, -3 if transaction was cancelled, -4 on retryable error
 //NOTE: the -2 case contains a formal error message which is set; -3 and -4 cases also have a formal error set (which is defined locally)
-static int handleBasicResponse(char *scmd, int scmdlen, char *rcmd, int rcmdlen, int expectedArgCount) {
+//If frame is not NULL, it is filled in with the parsed response so its arguments can be read without copying them.
+static int handleBasicResponse(char *scmd, int scmdlen, char *rcmd, int rcmdlen, int expectedArgCount, ipc_frame_s *frame) {
 	if (!rcmd) return -1; //NOTE: do not log anything, this is already in sendAndReceiveData()
 
 	int rv = 0;
 	log_ipc_cmd(LLVL_BULK, rcmd, rcmdlen, 1);
 
-	switch(ipc_cmd_get(rcmd, rcmdlen)) {
+	ipc_frame_s localFrame;
+	if (!frame) frame = &localFrame;
+	if (ipc_cmd_parse(rcmd, rcmdlen, frame) == 0) {
+		LOG(LLVL_ERROR, "received incomplete ipc response (%i bytes)", rcmdlen);
+		setError("server returned incomplete response");
+		return -1;
+	}
+
+	switch(frame->code) {
 		case IPC_CMDR_OK: {
 			//LOG(LLVL_VERBOSE, "received ipc reply 'OK' (%i bytes) in response to 0x%x", rcmdlen, ipc_cmd_get(scmd, scmdlen));
-			int numArgs = ipc_cmd_num_args(rcmd, rcmdlen);
-			if (numArgs != expectedArgCount) {
-				LOG(LLVL_ERROR, "received ipc response with %i arguments (expected %i)", numArgs, expectedArgCount);
+			if (frame->num_args != expectedArgCount) {
+				LOG(LLVL_ERROR, "received ipc response with %i arguments (expected %i)", frame->num_args, expectedArgCount);
 				rv = -1;
 			}
 			break;
 		}
 		case IPC_CMDR_ERROR: {
-			char *errmsg = 0;
-			ipc_cmd_get_string_arg(rcmd, rcmdlen, 0, &errmsg);
-			//LOG(LLVL_VERBOSE, "received ipc reply 'ERROR' (%i bytes) in response to 0x%x (%s)", rcmdlen, ipc_cmd_get(scmd, scmdlen), errmsg);
-			setError("server returned error (%s)", errmsg);
-			free(errmsg);
+			const char *errmsg = "";
+			uint32_t errmsglen = 0;
+			ipc_frame_get_arg(frame, 0, &errmsg, &errmsglen);
+			//LOG(LLVL_VERBOSE, "received ipc reply 'ERROR' (%i bytes) in response to 0x%x (%.*s)", rcmdlen, ipc_cmd_get(scmd, scmdlen), errmsglen, errmsg);
+			setError("server returned error (%.*s)", (int)strnlen(errmsg, errmsglen), errmsg);
 			rv = -1;
 			break;
 		}
 		case IPC_CMDR_GCODE_ADD_FAILED: {
-			char *errmsg = 0;
-			ipc_cmd_get_string_arg(rcmd, rcmdlen, 0, &errmsg);
-			setError(errmsg);
-			free(errmsg);
+			const char *errmsg = "";
+			uint32_t errmsglen = 0;
+			ipc_frame_get_arg(frame, 0, &errmsg, &errmsglen);
+			setError("%.*s", (int)strnlen(errmsg, errmsglen), errmsg);
 			rv = -2;
 			break;
 		}
@@ -174,7 +398,7 @@ static int handleBasicResponse(char *scmd, int scmdlen, char *rcmd, int rcmdlen,
 			break;
 		}
 		default:
-			LOG(LLVL_WARNING, "received unexpected IPC reply 0x%x for command 0x%x", ipc_cmd_get(rcmd, rcmdlen), ipc_cmd_get(scmd, scmdlen));
+			LOG(LLVL_WARNING, "received unexpected IPC reply 0x%x for command 0x%x", frame->code, ipc_cmd_get(scmd, scmdlen));
 			setError("server returned unexpected response");
 			rv = -1;
 			break;
@@ -183,6 +407,88 @@ static int handleBasicResponse(char *scmd, int scmdlen, char *rcmd, int rcmdlen,
 	return rv;
 }
 
+//asks the server once per connection how large commands may be (returned, 0 if it does not tell) and what it supports
+static int queryCapabilities() {
+	if (maxFrameSize >= 0 || socketFd < 0) return maxFrameSize > 0 ? maxFrameSize : 0;
+
+	int scmdlen, rcmdlen;
+	char *scmd = ipc_construct_cmd(&scmdlen, IPC_CMDQ_GET_CAPABILITIES, 0);
+	struct iovec iov = { scmd, scmdlen };
+	char *rcmd = (scmd && sendIov(socketFd, &iov, 1, scmdlen, -1) == 0) ? receiveData(socketFd, &rcmdlen, CAPABILITIES_WAIT_TIMEOUT) : NULL;
+
+	ipc_frame_s frame;
+	int32_t size = 0, capabilities = 0;
+	if (rcmd && ipc_cmd_parse(rcmd, rcmdlen, &frame) > 0 && frame.code == IPC_CMDR_OK) {
+		ipc_frame_get_long_arg(&frame, 0, &size);
+		ipc_frame_get_long_arg(&frame, 1, &capabilities);
+	}
+
+	maxFrameSize = (size > 0) ? size : 0;
+	serverCapabilities = capabilities;
+	LOG(LLVL_VERBOSE, "server accepts commands of up to %i bytes (0: not reported), capabilities 0x%x", maxFrameSize, serverCapabilities);
+
+	free(rcmd);
+	free(scmd);
+	return maxFrameSize;
+}
+
+
+//returns a new file descriptor holding a copy of data (a memfd if the kernel has them, an unlinked temporary file otherwise), or -1 on error
+static int createMemoryFile(const char *data, size_t len) {
+	int fd = -1;
+#ifdef SYS_memfd_create
+	fd = syscall(SYS_memfd_create, "print3d-gcode", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#endif
+	if (fd < 0) {
+		char path[] = "/tmp/print3d-gcode-XXXXXX";
+		fd = mkstemp(path);
+		if (fd >= 0) unlink(path);
+	}
+	if (log_check_error(fd, MOD_ABBR, "could not create file to pass gcode in")) return -1;
+
+	size_t written = 0;
+	while (written < len) {
+		ssize_t rv = write(fd, data + written, len - written);
+		if (rv < 0 && errno == EINTR) continue;
+		if (log_check_error(rv < 0 ? -1 : 0, MOD_ABBR, "could not write gcode to file")) {
+			close(fd);
+			return -1;
+		}
+		written += rv;
+	}
+
+#ifdef F_ADD_SEALS
+	//the server maps the file, so make sure it cannot be shrunk underneath it (this fails harmlessly for temporary files)
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+
+	return fd;
+}
+
+//sends the first len bytes of the file as a complete gcode transaction, returns a value as handleBasicResponse() does
+static int sendGCodeFd(int fd, uint32_t len, int32_t total_lines, ipc_gcode_metadata_s *metadata) {
+	int useIds = (serverCapabilities & IPC_CAP_REQUEST_IDS) ? 1 : 0;
+	char scmd[IPC_IOV_BUF_SIZE(MAX_SEND_ARGS)];
+	uint32_t requestId;
+
+	ipc_arg_s args[MAX_SEND_ARGS];
+	int numArgs = 0;
+	args[numArgs++] = ipc_arg_long((int32_t)len);
+	args[numArgs++] = ipc_arg_short(TRX_FIRST_CHUNK_BIT | TRX_LAST_CHUNK_BIT);
+	args[numArgs++] = ipc_arg_long(total_lines);
+	args[numArgs++] = ipc_arg_long(metadata ? metadata->seq_number : -1);
+	args[numArgs++] = ipc_arg_long(metadata ? metadata->seq_total : -1);
+	if (metadata && metadata->source) args[numArgs++] = ipc_arg_data(metadata->source, strlen(metadata->source));
+
+	if (sendRequest(IPC_CMDQ_GCODE_APPEND_FD, args, numArgs, useIds, scmd, &requestId, fd) < 0) return -1;
+
+	int rcmdlen;
+	char *rcmd = receiveReply(useIds, requestId, &rcmdlen);
+	int rv = handleBasicResponse(scmd, 4, rcmd, rcmdlen, 0, NULL);
+	if (!rcmd) resetPendingReplies();
+	free(rcmd);
+	return rv;
+}
 
 /**********************
  * EXPORTED FUNCTIONS *
@@ -192,12 +498,18 @@ int comm_openSocket(const char *deviceId) {
 	if (socketFd >= 0) return socketFd;
 
 	socketFd = openSocketInternal(deviceId);
+	maxFrameSize = -1;
+	serverCapabilities = 0;
+	resetPendingReplies();
 	return socketFd;
 }
 
 int comm_closeSocket() {
 	int rv = closeSocketInternal(socketFd);
 	socketFd = -1;
+	maxFrameSize = -1;
+	serverCapabilities = 0;
+	resetPendingReplies();
 	return rv;
 }
 
@@ -222,9 +534,11 @@ int comm_testCommand(const char *question, char **answer) {
 	char *rcmd = sendAndReceiveData(scmd, scmdlen, &rcmdlen);
 
 	int rv = 0;
-	int result = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 1);
+	ipc_frame_s frame;
+	int result = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 1, &frame);
 	if (result >= 0) {
-		rv = ipc_cmd_get_string_arg(rcmd, rcmdlen, 0, answer);
+		*answer = copyTextArg(&frame, 0);
+		if (!*answer) rv = -1;
 	} else {
 		rv = result;
 	}
@@ -254,7 +568,7 @@ int comm_testTransactions(const char *deviceId, char **outputText) {
 	trx_bits = TRX_FIRST_CHUNK_BIT;
 	scmd = ipc_construct_cmd(&scmdlen, IPC_CMDQ_GCODE_APPEND, "xw", data, 3, trx_bits);
 	rcmd = sendAndReceiveDataWithFd(fd1, scmd, scmdlen, &rcmdlen);
-	rv = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0);
+	rv = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0, NULL);
 	if (rv >= 0) strcat(*outputText, "0+");
 	else strcat(*outputText, "0-");
 	free(rcmd); free(scmd);
@@ -262,7 +576,7 @@ int comm_testTransactions(const char *deviceId, char **outputText) {
 	//send file to append using fd1 (expect retry_later, because transaction is already in progress)
 	scmd = ipc_construct_cmd(&scmdlen, IPC_CMDQ_GCODE_APPEND_FILE, "x", dummyPath, strlen(dummyPath));
 	rcmd = sendAndReceiveDataWithFd(fd1, scmd, scmdlen, &rcmdlen);
-	rv = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0);
+	rv = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0, NULL);
 	if (rv == -3) strcat(*outputText, "1+");
 	else strcat(*outputText, "1-");
 	free(rcmd); free(scmd);
@@ -271,7 +585,7 @@ int comm_testTransactions(const char *deviceId, char **outputText) {
 	trx_bits = 0;
 	scmd = ipc_construct_cmd(&scmdlen, IPC_CMDQ_GCODE_APPEND, "xw", data + 3, 3, trx_bits);
 	rcmd = sendAndReceiveDataWithFd(fd1, scmd, scmdlen, &rcmdlen);
-	rv = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0);
+	rv = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0, NULL);
 	if (rv >= 0) strcat(*outputText, "2+");
 	else strcat(*outputText, "2-");
 	free(rcmd); free(scmd);
@@ -280,7 +594,7 @@ int comm_testTransactions(const char *deviceId, char **outputText) {
 	trx_bits = TRX_FIRST_CHUNK_BIT;
 	scmd = ipc_construct_cmd(&scmdlen, IPC_CMDQ_GCODE_APPEND, "xw", data + 6, 3, trx_bits);
 	rcmd = sendAndReceiveDataWithFd(fd2, scmd, scmdlen, &rcmdlen);
-	rv = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0);
+	rv = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0, NULL);
 	if (rv >= 0) strcat(*outputText, "3+");
 	else strcat(*outputText, "3-");
 	free(rcmd); free(scmd);
@@ -289,7 +603,7 @@ int comm_testTransactions(const char *deviceId, char **outputText) {
 	trx_bits = TRX_LAST_CHUNK_BIT;
 	scmd = ipc_construct_cmd(&scmdlen, IPC_CMDQ_GCODE_APPEND, "xw", data + 6, 3, trx_bits);
 	rcmd = sendAndReceiveDataWithFd(fd1, scmd, scmdlen, &rcmdlen);
-	rv = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0);
+	rv = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0, NULL);
 	if (rv >= 0) strcat(*outputText, "4+");
 	else strcat(*outputText, "4-");
 	free(rcmd); free(scmd);
@@ -297,7 +611,7 @@ int comm_testTransactions(const char *deviceId, char **outputText) {
 	//send stop gcode using fd1 (expect ok)
 	scmd = ipc_construct_cmd(&scmdlen, IPC_CMDQ_GCODE_STOPPRINT, "x", stopData, strlen(stopData));
 	rcmd = sendAndReceiveDataWithFd(fd1, scmd, scmdlen, &rcmdlen);
-	rv = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0);
+	rv = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0, NULL);
 	if (rv >= 0) strcat(*outputText, "5+");
 	else strcat(*outputText, "5-");
 	free(rcmd); free(scmd);
@@ -306,7 +620,7 @@ int comm_testTransactions(const char *deviceId, char **outputText) {
 	trx_bits = 0;
 	scmd = ipc_construct_cmd(&scmdlen, IPC_CMDQ_GCODE_APPEND, "xw", data + 3, 3, trx_bits);
 	rcmd = sendAndReceiveDataWithFd(fd2, scmd, scmdlen, &rcmdlen);
-	rv = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0);
+	rv = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0, NULL);
 	if (rv == -2) strcat(*outputText, "6+");
 	else strcat(*outputText, "6-");
 	free(rcmd); free(scmd);
@@ -325,7 +639,7 @@ int comm_clearGCode() {
 	char *rcmd = sendAndReceiveData(scmd, scmdlen, &rcmdlen);
 
 	int rv = 0;
-	int result = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0);
+	int result = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0, NULL);
 	if (result >= 0) {
 		LOG(LLVL_INFO, "gcode cleared");
 	} else {
@@ -346,7 +660,7 @@ int comm_startPrintGCode() {
 	char *rcmd = sendAndReceiveData(scmd, scmdlen, &rcmdlen);
 
 	int rv = 0;
-	int result = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0);
+	int result = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0, NULL);
 	if (result >= 0) {
 		LOG(LLVL_INFO, "gcode print started");
 	} else {
@@ -372,7 +686,7 @@ int comm_stopPrintGCode(const char *endCode) {
 	char *rcmd = sendAndReceiveData(scmd, scmdlen, &rcmdlen);
 
 	int rv = 0;
-	int result = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0);
+	int result = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0, NULL);
 	if (result >= 0) {
 		LOG(LLVL_INFO, "gcode print stopped");
 	} else {
@@ -392,7 +706,7 @@ int comm_sendGCodeFile(const char *file) {
 	char *rcmd = sendAndReceiveData(scmd, scmdlen, &rcmdlen);
 
 	int rv = 0;
-	int result = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0);
+	int result = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0, NULL);
 	if (result >= 0) {
 		LOG(LLVL_INFO, "gcode appended from file '%s'", file);
 	} else {
@@ -404,6 +718,35 @@ int comm_sendGCodeFile(const char *file) {
 	return rv;
 }
 
+/*
+ * Appends all gcode in the given file (which must be a regular file or a memfd) by passing the file descriptor to the
+ * server, which maps it instead of receiving the data through the socket. The descriptor is not closed.
+ * Returns the same values as comm_sendGCodeData(); if the server does not support this, -1 is returned.
+ */
+int comm_sendGCodeFd(int fd, int32_t total_lines, ipc_gcode_metadata_s *metadata) {
+	clearError();
+
+	queryCapabilities();
+	if (!(serverCapabilities & IPC_CAP_GCODE_FD)) {
+		setError("server does not accept gcode file descriptors");
+		return -1;
+	}
+
+	struct stat st;
+	if (log_check_error(fstat(fd, &st), MOD_ABBR, "could not determine size of gcode file")) {
+		setError("could not determine size of gcode file");
+		return -1;
+	}
+	if (st.st_size > INT32_MAX) {
+		setError("gcode file too large");
+		return -1;
+	}
+
+	int rv = sendGCodeFd(fd, (uint32_t)st.st_size, total_lines, metadata);
+	if (rv >= 0) LOG(LLVL_INFO, "gcode appended from file descriptor (%lli bytes)", (long long)st.st_size);
+	return rv;
+}
+
 //metadata may be NULL
 int comm_sendGCodeData(const char *gcode, int32_t total_lines, ipc_gcode_metadata_s *metadata) {
 	uint32_t startTime = getMillis();
@@ -413,35 +756,86 @@ int comm_sendGCodeData(const char *gcode, int32_t total_lines, ipc_gcode_metadat
 	int32_t seq_ttl = metadata ? metadata->seq_total : -1;
 
 	int rv = 0;
+	size_t gcodeLen = strlen(gcode);
 	const char *startP = gcode, *endP;
-	const char *lastPos = gcode + strlen(gcode) - 1;
+	const char *lastPos = gcode + gcodeLen - 1;
 #ifdef DEBUG_GCODE_FRAGMENTATION
 	int packetNum = 0, lineNum = 1;
 #else
 	int packetNum = 0;
 #endif
 
-	LOG(LLVL_BULK, "starting transmit of %i bytes of gcode data, maximum packet size is %i", strlen(gcode), MAX_PACKET_SIZE);
+	//fill commands up to the size the server accepts, which saves many round trips with large uploads
+	int frameSize = queryCapabilities();
+	int srcLen = (metadata && metadata->source) ? strlen(metadata->source) : 0;
+	int maxPacketSize = frameSize - GCODE_APPEND_OVERHEAD - srcLen;
+	if (maxPacketSize < MAX_PACKET_SIZE) maxPacketSize = MAX_PACKET_SIZE;
+
+	//data which does not fit in a single command is handed over in one go through a memory file, if the server can map it
+	if ((serverCapabilities & IPC_CAP_GCODE_FD) && gcodeLen > (size_t)maxPacketSize && gcodeLen <= INT32_MAX) {
+		int fd = createMemoryFile(gcode, gcodeLen);
+		if (fd >= 0) {
+			rv = sendGCodeFd(fd, gcodeLen, total_lines, metadata);
+			close(fd);
+			if (rv == 0) LOG(LLVL_BULK, "gcode data (%zu bytes) sent through file descriptor (%lu msecs)", gcodeLen, getMillis() - startTime);
+			else LOG(LLVL_ERROR, "sending gcode data (%zu bytes) through file descriptor failed with error %i", gcodeLen, rv);
+			return rv;
+		}
+		LOG(LLVL_WARNING, "could not pass gcode through a file, sending it in packets instead");
+	}
+
+	//with request IDs, several chunks are sent before waiting for the reply to the first one
+	int useIds = (serverCapabilities & IPC_CAP_REQUEST_IDS) ? 1 : 0;
+	int window = useIds ? UPLOAD_WINDOW : 1;
+	uint32_t inFlight[UPLOAD_WINDOW];
+	int inFlightBytes[UPLOAD_WINDOW];
+	int numInFlight = 0;
+	char scmd[IPC_IOV_BUF_SIZE(MAX_SEND_ARGS)];
+
+	LOG(LLVL_BULK, "starting transmit of %i bytes of gcode data, maximum packet size is %i, window %i", (int)gcodeLen, maxPacketSize, window);
 	for (;;) {
-		if (startP > lastPos) break;
+		//a failed chunk stops sending, but the replies to chunks already sent must still be received
+		if (rv < 0 || startP > lastPos || numInFlight == window) {
+			if (numInFlight == 0) break;
+
+			int rcmdlen;
+			char *rcmd = receiveReply(useIds, inFlight[0], &rcmdlen);
+
+			//only the first error is reported, the server rejects the rest of the transaction because of it
+			if (rv == 0) {
+				rv = handleBasicResponse(scmd, 4, rcmd, rcmdlen, 0, NULL);
+				if (rv == 0) LOG(LLVL_BULK, "gcode packet transmitted in transaction (%i bytes)", inFlightBytes[0]);
+			}
+
+			if (!rcmd) { //the connection is out of sync, do not wait for any other replies
+				resetPendingReplies();
+				break;
+			}
+			free(rcmd);
 
-		endP = startP + MAX_PACKET_SIZE - 1;
+			numInFlight--;
+			memmove(inFlight, inFlight + 1, numInFlight * sizeof(inFlight[0]));
+			memmove(inFlightBytes, inFlightBytes + 1, numInFlight * sizeof(inFlightBytes[0]));
+			continue;
+		}
+
+		endP = startP + maxPacketSize - 1;
 		if (endP >= lastPos) {
 			endP = lastPos;
 		} else {
 			while (endP >= startP && *endP != '\n') endP--;
 		}
 
-		if (endP < startP) { //line appears to be longer than MAX_PACKET_SIZE...
+		if (endP < startP) { //line appears to be longer than maxPacketSize...
 #ifdef DEBUG_GCODE_FRAGMENTATION
 			LOG(LLVL_ERROR, "comm_sendGcodeData: could not find line break within max packet boundary of %i bytes (offset: %i, approx. line num: %i, packet #%i)",
-					MAX_PACKET_SIZE, startP - gcode, lineNum, packetNum);
+					maxPacketSize, startP - gcode, lineNum, packetNum);
 #else
 			LOG(LLVL_ERROR, "comm_sendGcodeData: could not find line break within max packet boundary of %i bytes (offset: %i, packet #%i)",
-					MAX_PACKET_SIZE, startP - gcode, packetNum);
+					maxPacketSize, startP - gcode, packetNum);
 #endif
 			rv = -1;
-			break;
+			continue;
 		}
 
 #ifdef DEBUG_GCODE_FRAGMENTATION
@@ -449,32 +843,25 @@ int comm_sendGCodeData(const char *gcode, int32_t total_lines, ipc_gcode_metadat
 		for (sp = startP; sp <= endP; ++sp) if (*sp == '\n') lineNum++;
 #endif
 
-		int scmdlen, rcmdlen;
 		int16_t trx_bits = 0;
 		if (packetNum == 0) trx_bits |= TRX_FIRST_CHUNK_BIT;
 		if (endP == lastPos) trx_bits |= TRX_LAST_CHUNK_BIT;
 
-		char *scmd = 0;
-		if (!metadata || !metadata->source)
-			scmd = ipc_construct_cmd(&scmdlen, IPC_CMDQ_GCODE_APPEND, "xwWWW", startP, endP - startP + 1, trx_bits, total_lines, seq_num, seq_ttl);
-		else
-			scmd = ipc_construct_cmd(&scmdlen, IPC_CMDQ_GCODE_APPEND, "xwWWWs",
-				startP, endP - startP + 1, trx_bits, total_lines, seq_num, seq_ttl, metadata->source);
-
-		char *rcmd = sendAndReceiveData(scmd, scmdlen, &rcmdlen);
-		int result = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0);
-		if (result >= 0) {
-			LOG(LLVL_BULK, "gcode packet #%i transmitted in transaction (%i bytes)", packetNum, endP - startP + 1);
-		} else {
-			rv = result;
-		}
-
-		free(rcmd);
-		free(scmd);
-		if (rv == -1) {
-			packetNum++; //to keep a correct count for debugging purposes
-			break;
+		//the gcode itself is sent straight from the caller's buffer
+		ipc_arg_s args[MAX_SEND_ARGS];
+		int numArgs = 0;
+		args[numArgs++] = ipc_arg_data(startP, endP - startP + 1);
+		args[numArgs++] = ipc_arg_short(trx_bits);
+		args[numArgs++] = ipc_arg_long(total_lines);
+		args[numArgs++] = ipc_arg_long(seq_num);
+		args[numArgs++] = ipc_arg_long(seq_ttl);
+		if (metadata && metadata->source) args[numArgs++] = ipc_arg_data(metadata->source, strlen(metadata->source));
+
+		if (sendRequest(IPC_CMDQ_GCODE_APPEND, args, numArgs, useIds, scmd, &inFlight[numInFlight], -1) < 0) {
+			rv = -1;
+			continue;
 		}
+		inFlightBytes[numInFlight++] = endP - startP + 1;
 
 		startP = endP + 1;
 		packetNum++;
@@ -496,9 +883,10 @@ int comm_getTemperature(int16_t *temperature, IPC_TEMPERATURE_PARAMETER which) {
 	char *rcmd = sendAndReceiveData(scmd, scmdlen, &rcmdlen);
 
 	int rv = 0;
-	int result = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 1);
+	ipc_frame_s frame;
+	int result = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 1, &frame);
 	if (result >= 0) {
-		rv = ipc_cmd_get_short_arg(rcmd, rcmdlen, 0, temperature);
+		rv = ipc_frame_get_short_arg(&frame, 0, temperature);
 	} else {
 		rv = result;
 	}
@@ -515,7 +903,7 @@ int comm_heatup(int temperature) {
 	char *scmd = ipc_construct_cmd(&scmdlen, IPC_CMDQ_HEATUP, "w", temperature);
 	char *rcmd = sendAndReceiveData(scmd, scmdlen, &rcmdlen);
 
-	int rv = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0);
+	int rv = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 0, NULL);
 
 	free(rcmd);
 	free(scmd);
@@ -532,15 +920,16 @@ int comm_getProgress(int32_t *currentLine, int32_t *bufferedLines, int32_t *tota
 	char *rcmd = sendAndReceiveData(scmd, scmdlen, &rcmdlen);
 
 	int rv = 0;
-	int result = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 7);
+	ipc_frame_s frame;
+	int result = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 7, &frame);
 	if (result >= 0) {
-		rv = ipc_cmd_get_long_arg(rcmd, rcmdlen, 0, currentLine);
-		if (rv > -1) rv = ipc_cmd_get_long_arg(rcmd, rcmdlen, 1, bufferedLines);
-		if (rv > -1) rv = ipc_cmd_get_long_arg(rcmd, rcmdlen, 2, totalLines);
-		if (rv > -1) rv = ipc_cmd_get_long_arg(rcmd, rcmdlen, 3, bufferSize);
-		if (rv > -1) rv = ipc_cmd_get_long_arg(rcmd, rcmdlen, 4, maxBufferSize);
-		if (rv > -1) rv = ipc_cmd_get_long_arg(rcmd, rcmdlen, 5, seqNumber);
-		if (rv > -1) rv = ipc_cmd_get_long_arg(rcmd, rcmdlen, 6, seqTotal);
+		rv = ipc_frame_get_long_arg(&frame, 0, currentLine);
+		if (rv > -1) rv = ipc_frame_get_long_arg(&frame, 1, bufferedLines);
+		if (rv > -1) rv = ipc_frame_get_long_arg(&frame, 2, totalLines);
+		if (rv > -1) rv = ipc_frame_get_long_arg(&frame, 3, bufferSize);
+		if (rv > -1) rv = ipc_frame_get_long_arg(&frame, 4, maxBufferSize);
+		if (rv > -1) rv = ipc_frame_get_long_arg(&frame, 5, seqNumber);
+		if (rv > -1) rv = ipc_frame_get_long_arg(&frame, 6, seqTotal);
 	} else {
 		rv = result;
 	}
@@ -559,9 +948,11 @@ int comm_getState(char **state) {
 	char *rcmd = sendAndReceiveData(scmd, scmdlen, &rcmdlen);
 
 	int rv = 0;
-	int result = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 1);
+	ipc_frame_s frame;
+	int result = handleBasicResponse(scmd, scmdlen, rcmd, rcmdlen, 1, &frame);
 	if (result >= 0) {
-		rv = ipc_cmd_get_string_arg(rcmd, rcmdlen, 0, state);
+		*state = copyTextArg(&frame, 0);
+		if (!*state) rv = -1;
 	} else {
 		rv = result;
 	}
@@ -54,6 +54,10 @@ const ipc_cmd_name_s IPC_COMMANDS[] = {
 		{ IPC_CMDQ_HEATUP, "heatup", "w", "" }, //NOTE: accepts heatup target temperature
 		{ IPC_CMDQ_GET_PROGRESS, "getProgress", "", "WWWWWWW" }, //NOTE: returns currentLine, bufferedLines, totalLines, bufferSize, maxBufferSize, seqNumber and seqTotal
 		{ IPC_CMDQ_GET_STATE, "getState", "", "x" },
+		{ IPC_CMDQ_GET_CAPABILITIES, "getCapabilities", "", "WW" }, //NOTE: returns the largest command size the server accepts and IPC_CAPABILITY_BITS
+		//NOTE: signature is 'WwWWWs', W is the number of bytes of gcode in the file descriptor sent along with the command (SCM_RIGHTS, read from offset 0),
+		//the other arguments are the same as for gcodeAppend
+		{ IPC_CMDQ_GCODE_APPEND_FD, "gcodeAppendFd", "*", "" },
 
 		/* response commands send by server */
 		{ IPC_CMDR_OK, "ok", "*", NULL },
@@ -79,15 +83,56 @@ const char *IPC_DEFAULT_DEVICE_ID = "tty.usbmodem1a21";
 
 static const int STRINGIFY_MAX_TEXT_DISPLAY_CHARS = 15;
 
+//all command codes are below this value, which allows looking up descriptions by indexing
+#define COMMAND_INDEX_SIZE 0x100
+
 static const ipc_cmd_name_s* findCommandDescription(IPC_COMMAND_CODE code) {
-	const ipc_cmd_name_s* d = IPC_COMMANDS;
+	static const ipc_cmd_name_s* index[COMMAND_INDEX_SIZE];
+	static int indexBuilt = 0;
 
-	while (d->name) {
-		if (d->code == code) return d;
-		d++;
+	if (!indexBuilt) {
+		for (const ipc_cmd_name_s* d = IPC_COMMANDS; d->name; d++) {
+			if (d->code >= 0 && d->code < COMMAND_INDEX_SIZE) index[d->code] = d;
+		}
+		indexBuilt = 1;
 	}
 
-	return 0;
+	return (code >= 0 && code < COMMAND_INDEX_SIZE) ? index[code] : 0;
+}
+
+//returns the size of the command header, which includes the request ID if there is one
+static int headerLength(const char *buf) {
+	return (read_ns(buf) & IPC_CMD_REQUEST_ID_FLAG) ? 8 : 4;
+}
+
+//writes the command code, argument count and optional request ID at buf and returns the position after it
+static char *storeHeader(char *buf, IPC_COMMAND_CODE code, const uint32_t *request_id, int num_args) {
+	store_ns(buf, request_id ? (code | IPC_CMD_REQUEST_ID_FLAG) : code);
+	store_ns(buf + 2, num_args);
+	if (!request_id) return buf + 4;
+
+	store_nl(buf + 4, *request_id);
+	return buf + 8;
+}
+
+//writes an argument (length field and data) at p and returns the position after it
+static char *storeArg(char *p, const void *data, uint32_t len) {
+	store_nl(p, len);
+	if (len > 0) memcpy(p + 4, data, len);
+	return p + 4 + len;
+}
+
+//writes a 'w' or 'W' argument at p and returns the position after it
+static char *storeIntArg(char *p, char type, int32_t value) {
+	if (type == 'w') {
+		store_nl(p, 2);
+		store_ns(p + 4, (int16_t)value);
+		return p + 6;
+	} else {
+		store_nl(p, 4);
+		store_nl(p + 4, value);
+		return p + 8;
+	}
 }
 
 char* ipc_construct_socket_path(const char* deviceId) {
@@ -152,6 +197,7 @@ char* ipc_construct_cmd(int* cmdlen, IPC_COMMAND_CODE code, const char* format,
 	return result;
 }
 
+//the arguments are walked twice: once to compute the command size and once to write it into a single allocation
 char* ipc_va_construct_cmd(int* cmdlen, IPC_COMMAND_CODE code, const char* format, va_list args) {
 	const ipc_cmd_name_s* description = findCommandDescription(code);
 	const char* fmtp = format;
@@ -161,54 +207,148 @@ char* ipc_va_construct_cmd(int* cmdlen, IPC_COMMAND_CODE code, const char* forma
 		fmtp = "";
 	}
 
-	if (!equal(description->arg_fmt, "*") && !equal(description->arg_fmt, fmtp)) {
+	if (description && !equal(description->arg_fmt, "*") && !equal(description->arg_fmt, fmtp)) {
 		log_message(LLVL_WARNING, "IPC ", "construct_cmd: given message format '%s' not equal to predefined format '%s'", fmtp, description->arg_fmt);
 	}
 
-	char* cmd = 0;
 	*cmdlen = 0;
 
-	if (ipc_cmd_set(&cmd, cmdlen, code) < 0) {
-		return NULL;
+	int len = 4, numArgs = 0;
+	va_list sizeArgs;
+	va_copy(sizeArgs, args);
+	for (const char* f = fmtp; *f; f++) {
+		switch(*f) {
+		case 'w': va_arg(sizeArgs, int); len += 6; break;
+		case 'W': va_arg(sizeArgs, int32_t); len += 8; break;
+		case 's': len += 4 + strlen(va_arg(sizeArgs, char*)); break;
+		case 'x': //binary blob, requires a second argument specifying the length
+			va_arg(sizeArgs, char*);
+			len += 4 + va_arg(sizeArgs, int);
+			break;
+		default:
+			log_message(LLVL_WARNING, "IPC ", "illegal format specifier in construct_cmd (%c)", *f);
+			va_end(sizeArgs);
+			return NULL;
+		}
+		numArgs++;
 	}
+	va_end(sizeArgs);
 
-	while(*fmtp) {
-		char argtype = *fmtp;
+	char* cmd = (char*)malloc(len);
+	if (!cmd) return NULL;
 
-		switch(argtype) {
-		case 'w': {
-			int16_t arg = htons(va_arg(args, int));
-			ipc_cmd_add_arg(&cmd, cmdlen, (void*)&arg, 2);
-			break;
-		}
-		case 'W': {
-			int32_t arg = htonl(va_arg(args, int32_t));
-			ipc_cmd_add_arg(&cmd, cmdlen, (void*)&arg, 4);
-			break;
-		}
+	store_ns(cmd, code);
+	store_ns(cmd + 2, numArgs);
+	char* p = cmd + 4;
+
+	for (const char* f = fmtp; *f; f++) {
+		switch(*f) {
+		case 'w': p = storeIntArg(p, 'w', va_arg(args, int)); break;
+		case 'W': p = storeIntArg(p, 'W', va_arg(args, int32_t)); break;
 		case 's': {
 			char* arg = va_arg(args, char*);
-			ipc_cmd_add_arg(&cmd, cmdlen, (void*)arg, strlen(arg));
+			p = storeArg(p, arg, strlen(arg));
 			break;
 		}
-		case 'x': { //add binary blob, requires a second argument specifying the length
+		case 'x': {
 			char* arg = va_arg(args, char*);
 			uint32_t arglen = va_arg(args, int);
-			ipc_cmd_add_arg(&cmd, cmdlen, (void*)arg, arglen);
+			p = storeArg(p, arg, arg ? arglen : 0);
 			break;
 		}
-		default:
-			log_message(LLVL_WARNING, "IPC ", "illegal format specifier in construct_cmd (%c)", argtype);
-			//TODO: free unfinished command and return, instead of ignoring this
-			break;
 		}
-
-		fmtp++;
 	}
 
+	*cmdlen = p - cmd;
 	return cmd;
 }
 
+int ipc_cmd_encoded_len(const ipc_arg_s *args, int num_args) {
+	int len = 4;
+	for (int i = 0; i < num_args; i++) {
+		switch (args[i].type) {
+			case 'w': len += 6; break;
+			case 'W': len += 8; break;
+			default: len += 4 + args[i].len; break;
+		}
+	}
+	return len;
+}
+
+int ipc_cmd_encode(char *buf, int bufsize, IPC_COMMAND_CODE code, const uint32_t *request_id, const ipc_arg_s *args, int num_args) {
+	if (ipc_cmd_encoded_len(args, num_args) + (request_id ? 4 : 0) > bufsize) return -1;
+
+	char *p = storeHeader(buf, code, request_id, num_args);
+
+	for (int i = 0; i < num_args; i++) {
+		const ipc_arg_s *arg = &args[i];
+		switch (arg->type) {
+			case 'w': case 'W': p = storeIntArg(p, arg->type, arg->value); break;
+			case 'x': p = storeArg(p, arg->data, arg->len); break;
+			default: return -1;
+		}
+	}
+
+	return p - buf;
+}
+
+int ipc_cmd_encode_iov(char *buf, int bufsize, struct iovec *iov, int *iovcnt,
+		IPC_COMMAND_CODE code, const uint32_t *request_id, const ipc_arg_s *args, int num_args) {
+	if (bufsize < 8) return -1;
+
+	char *p = storeHeader(buf, code, request_id, num_args), *end = buf + bufsize;
+	int total = p - buf, n = 0;
+
+	iov[0].iov_base = buf;
+	for (int i = 0; i < num_args; i++) {
+		const ipc_arg_s *arg = &args[i];
+		int referenced = (arg->type == 'x' && arg->len >= IPC_IOV_MIN_BLOB_LEN);
+		int needed = referenced ? 4 : ipc_cmd_encoded_len(arg, 1) - 4;
+		if (end - p < needed) return -1;
+
+		switch (arg->type) {
+			case 'w': case 'W': p = storeIntArg(p, arg->type, arg->value); break;
+			case 'x':
+				if (!referenced) {
+					p = storeArg(p, arg->data, arg->len);
+					break;
+				}
+
+				//close the current piece of buf, reference the data and continue in buf after it
+				store_nl(p, arg->len);
+				p += 4;
+				iov[n].iov_len = p - (char*)iov[n].iov_base;
+				iov[n + 1].iov_base = (void*)arg->data;
+				iov[n + 1].iov_len = arg->len;
+				iov[n + 2].iov_base = p;
+				n += 2;
+				break;
+			default: return -1;
+		}
+		total += needed + (referenced ? arg->len : 0);
+	}
+
+	iov[n].iov_len = p - (char*)iov[n].iov_base;
+	if (iov[n].iov_len > 0 || n == 0) n++;
+	*iovcnt = n;
+	return total;
+}
+
+char *ipc_iov_join(const struct iovec *iov, int iovcnt, int *len) {
+	*len = 0;
+	for (int i = 0; i < iovcnt; i++) *len += iov[i].iov_len;
+
+	char *buf = (char*)malloc(*len > 0 ? *len : 1);
+	if (!buf) return NULL;
+
+	char *p = buf;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+	return buf;
+}
+
 int ipc_cmd_set(char** buf, int* buflen, IPC_COMMAND_CODE code) {
 	char* t = (char*)realloc(*buf, 4);
 	if (!t) return -1;
@@ -236,12 +376,11 @@ int ipc_cmd_add_arg(char** buf, int* buflen, const void* arg, uint32_t arglen) {
 }
 
 int ipc_cmd_is_complete(const char* buf, int buflen) {
-	if (buflen < 4) return 0;
+	if (buflen < 4 || buflen < headerLength(buf)) return 0;
 
-	const char* p = buf + 2;
-	int argsleft = read_ns(p);
+	int argsleft = read_ns(buf + 2);
+	const char* p = buf + headerLength(buf);
 
-	p += 2;
 	while(argsleft) {
 		if (buf + buflen < p + 4) return 0;
 		uint32_t al = read_nl(p);
@@ -254,6 +393,48 @@ int ipc_cmd_is_complete(const char* buf, int buflen) {
 	return p - buf;
 }
 
+int ipc_cmd_parse(const char* buf, int buflen, ipc_frame_s *frame) {
+	if (buflen < 4 || buflen < headerLength(buf)) return 0;
+
+	int num_args = read_ns(buf + 2);
+	int pos = headerLength(buf);
+
+	for (int i = 0; i < num_args; i++) {
+		if (buflen - pos < 4) return 0;
+		uint32_t al = read_nl(buf + pos);
+		if ((uint32_t)(buflen - pos - 4) < al) return 0;
+
+		if (i < IPC_FRAME_INDEXED_ARGS) frame->arg_offsets[i] = pos;
+		pos += 4 + al;
+	}
+
+	frame->buf = buf;
+	frame->len = pos;
+	frame->code = (IPC_COMMAND_CODE)(read_ns(buf) & ~IPC_CMD_REQUEST_ID_FLAG);
+	frame->num_args = num_args;
+	frame->has_request_id = (headerLength(buf) == 8);
+	frame->request_id = frame->has_request_id ? read_nl(buf + 4) : 0;
+
+	return pos;
+}
+
+int ipc_cmd_exceeds(const char* buf, int buflen, uint32_t maxlen) {
+	if (buflen < 4 || buflen < headerLength(buf)) return 0;
+
+	int num_args = read_ns(buf + 2);
+	int pos = headerLength(buf);
+	uint64_t len = pos + 4ULL * num_args; //every argument has a length field
+
+	for (int i = 0; i < num_args && len <= maxlen && buflen - pos >= 4; i++) {
+		uint32_t al = read_nl(buf + pos);
+		len += al;
+		if (len > maxlen || (uint32_t)(buflen - pos - 4) < al) break;
+		pos += 4 + al;
+	}
+
+	return len > maxlen;
+}
+
 int ipc_cmd_num_args(const char* buf, int buflen) {
 	if (buflen < 4) return -2;
 	return read_ns(buf + 2);
@@ -261,24 +442,22 @@ int ipc_cmd_num_args(const char* buf, int buflen) {
 
 IPC_COMMAND_CODE ipc_cmd_get(const char* buf, int buflen) {
 	if (buflen < 2) return IPC_CMDS_INVALID;
-	return read_ns(buf);
+	return read_ns(buf) & ~IPC_CMD_REQUEST_ID_FLAG;
 }
 
-int ipc_cmd_get_arg(const char* buf, int buflen, char** argbuf, int* argbuflen, int argidx, int addzero) {
-	const char* p = buf + 4;
-	int curridx = 0;
-	uint32_t currarglen;
+//finds the length field of the given argument in a complete command, returns NULL if argidx is invalid
+static const char *findArg(const char *buf, int argidx) {
+	if (argidx < 0 || argidx >= read_ns(buf + 2)) return NULL;
 
-	if (argidx >= read_ns(buf + 2)) return -2;
-
-	while (1) {
-		currarglen = read_nl(p);
-
-		if (curridx == argidx) break;
+	const char *p = buf + headerLength(buf);
+	for (int i = 0; i < argidx; i++) p += 4 + read_nl(p);
+	return p;
+}
 
-		p += 4 + currarglen;
-		curridx++;
-	}
+int ipc_cmd_get_arg(const char* buf, int buflen, char** argbuf, int* argbuflen, int argidx, int addzero) {
+	const char* p = findArg(buf, argidx);
+	if (!p) return -2;
+	uint32_t currarglen = read_nl(p);
 
 	if (addzero != 0) addzero = 1;
 	char* t = (char*)realloc(*argbuf, currarglen + addzero);
@@ -293,58 +472,68 @@ int ipc_cmd_get_arg(const char* buf, int buflen, char** argbuf, int* argbuflen,
 }
 
 int ipc_cmd_get_arg_len(const char *buf, int buflen, int argidx) {
-	const char* p = buf + 4;
-	int curridx = 0;
-	uint32_t currarglen;
+	const char* p = findArg(buf, argidx);
+	if (!p) return -2;
 
-	if (argidx >= read_ns(buf + 2)) return -2;
+	return read_nl(p);
+}
 
-	while (1) {
-		currarglen = read_nl(p);
+int ipc_cmd_get_short_arg(const char* buf, int buflen, int argidx, int16_t* out) {
+	const char* p = findArg(buf, argidx);
+	if (!p) return -2;
 
-		if (curridx == argidx) break;
+	*out = read_ns(p + 4);
+	return 0;
+}
 
-		p += 4 + currarglen;
-		curridx++;
-	}
+int ipc_cmd_get_long_arg(const char* buf, int buflen, int argidx, int32_t* out) {
+	const char* p = findArg(buf, argidx);
+	if (!p) return -2;
 
-	return currarglen;
+	*out = read_nl(p + 4);
+	return 0;
 }
 
-int ipc_cmd_get_short_arg(const char* buf, int buflen, int argidx, int16_t* out) {
-	char* argbuf = 0;
-	int argbuflen = 0;
+int ipc_cmd_get_string_arg(const char* buf, int buflen, int argidx, char** out) {
+	int outlen = 0;
+	*out = 0;
+
+	return ipc_cmd_get_arg(buf, buflen, out, &outlen, argidx, 1);
+}
+
+int ipc_frame_get_arg(const ipc_frame_s *frame, int argidx, const char **arg, uint32_t *arglen) {
+	if (argidx < 0 || argidx >= frame->num_args) return -2;
 
-	int rv = ipc_cmd_get_arg(buf, buflen, &argbuf, &argbuflen, argidx, 0);
-	if (rv < 0) return rv;
+	const char *p;
+	if (argidx < IPC_FRAME_INDEXED_ARGS) {
+		p = frame->buf + frame->arg_offsets[argidx];
+	} else {
+		p = frame->buf + frame->arg_offsets[IPC_FRAME_INDEXED_ARGS - 1];
+		for (int i = IPC_FRAME_INDEXED_ARGS - 1; i < argidx; i++) p += 4 + read_nl(p);
+	}
 
-	*out = read_ns(argbuf);
-	free(argbuf);
+	*arglen = read_nl(p);
+	*arg = p + 4;
 	return 0;
 }
 
-int ipc_cmd_get_long_arg(const char* buf, int buflen, int argidx, int32_t* out) {
-	char* argbuf = 0;
-	int argbuflen = 0;
+int ipc_frame_get_short_arg(const ipc_frame_s *frame, int argidx, int16_t *out) {
+	const char *arg;
+	uint32_t arglen;
 
-	int rv = ipc_cmd_get_arg(buf, buflen, &argbuf, &argbuflen, argidx, 0);
-	if (rv < 0) return rv;
+	if (ipc_frame_get_arg(frame, argidx, &arg, &arglen) < 0 || arglen < 2) return -2;
 
-	*out = read_nl(argbuf);
-	free(argbuf);
+	*out = read_ns(arg);
 	return 0;
 }
 
-int ipc_cmd_get_string_arg(const char* buf, int buflen, int argidx, char** out) {
-	char* argbuf = 0;
-	int argbuflen = 0;
+int ipc_frame_get_long_arg(const ipc_frame_s *frame, int argidx, int32_t *out) {
+	const char *arg;
+	uint32_t arglen;
 
-	int rv = ipc_cmd_get_arg(buf, buflen, &argbuf, &argbuflen, argidx, 1);
-	if (rv < 0) return rv;
+	if (ipc_frame_get_arg(frame, argidx, &arg, &arglen) < 0 || arglen < 4) return -2;
 
-	*out = (char*)malloc(argbuflen);
-	memcpy(*out, argbuf, argbuflen);
-	free(argbuf);
+	*out = read_nl(arg);
 	return 0;
 }
 
@@ -365,7 +554,11 @@ int ipc_cmd_remove(char** buf, int* buflen) {
 }
 
 int ipc_stringify_cmd(const char *buf, int buflen, int is_reply, char **outbuf) {
-	const ipc_cmd_name_s *cmd = findCommandDescription(ipc_cmd_get(buf, buflen));
+	ipc_frame_s frame;
+	if (ipc_cmd_parse(buf, buflen, &frame) == 0) return 0;
+
+	const ipc_cmd_name_s *cmd = findCommandDescription(frame.code);
+	if (!cmd) cmd = findCommandDescription(IPC_CMDS_INVALID);
 	int outlen = strlen(cmd->name) + 5; //"[" ['<<'|'>>'] + name + "]" + nul
 	//const char *fmt = (is_reply == 0) ? cmd->arg_fmt : cmd->reply_fmt; //NOTE: reply_fmt is quite useless
 	const char *fmt = cmd->arg_fmt;
@@ -375,7 +568,15 @@ int ipc_stringify_cmd(const char *buf, int buflen, int is_reply, char **outbuf)
 	strcpy(*outbuf, is_reply ? "[<<" : "[>>");
 	strcat(*outbuf, cmd->name);
 
-	int num_args = ipc_cmd_num_args(buf, buflen);
+	if (frame.has_request_id) {
+		outlen += 1 + number_length(frame.request_id);
+		*outbuf = (char*)realloc(*outbuf, outlen);
+		if (!*outbuf) return -1;
+		strcat(*outbuf, "#");
+		number_to_string(frame.request_id, *outbuf + strlen(*outbuf));
+	}
+
+	int num_args = frame.num_args;
 	int fmt_idx = 0;
 	for (int i = 0; i < num_args; i++) {
 		char type = fmt[fmt_idx];
@@ -390,8 +591,10 @@ int ipc_stringify_cmd(const char *buf, int buflen, int is_reply, char **outbuf)
 			break;
 		}
 
-		int arglen = ipc_cmd_get_arg_len(buf, buflen, i);
-		int expected = (type == 'w') ? 2 : (type == 'W') ? 4 : 0;
+		const char *arg;
+		uint32_t arglen;
+		ipc_frame_get_arg(&frame, i, &arg, &arglen);
+		uint32_t expected = (type == 'w') ? 2 : (type == 'W') ? 4 : 0;
 
 		if (expected > 0 && arglen != expected) {
 			//TODO: add mismatch text and stop
@@ -399,8 +602,8 @@ int ipc_stringify_cmd(const char *buf, int buflen, int is_reply, char **outbuf)
 
 		switch (type) {
 			case 'w': {
-				int16_t v;
-				ipc_cmd_get_short_arg(buf, buflen, i, &v);
+				int16_t v = 0;
+				ipc_frame_get_short_arg(&frame, i, &v);
 				outlen += number_length(v) + 2;
 				*outbuf = (char*)realloc(*outbuf, outlen);
 				if (!*outbuf) return -1;
@@ -410,8 +613,8 @@ int ipc_stringify_cmd(const char *buf, int buflen, int is_reply, char **outbuf)
 			}
 
 			case 'W': {
-				int32_t v;
-				ipc_cmd_get_long_arg(buf, buflen, i, &v);
+				int32_t v = 0;
+				ipc_frame_get_long_arg(&frame, i, &v);
 				outlen += number_length(v) + 2;
 				*outbuf = (char*)realloc(*outbuf, outlen);
 				if (!*outbuf) return -1;
@@ -421,16 +624,15 @@ int ipc_stringify_cmd(const char *buf, int buflen, int is_reply, char **outbuf)
 			}
 
 			case 'x': {
-				char *s = 0;
-				ipc_cmd_get_string_arg(buf, buflen, i, &s);
-				int slen = strlen(s);
+				const char *nul = (const char*)memchr(arg, '\0', arglen);
+				int slen = nul ? nul - arg : (int)arglen;
 
 				if (slen <= STRINGIFY_MAX_TEXT_DISPLAY_CHARS) {
 					outlen += slen + 3;
 					*outbuf = (char*)realloc(*outbuf, outlen);
 					if (!*outbuf) return -1;
 					strcat(*outbuf, ":\"");
-					strcat(*outbuf, s);
+					strncat(*outbuf, arg, slen);
 					strcat(*outbuf, "\"");
 				} else {
 					outlen += number_length(slen) + 2;
@@ -439,7 +641,6 @@ int ipc_stringify_cmd(const char *buf, int buflen, int is_reply, char **outbuf)
 					strcat(*outbuf, ":#");
 					number_to_string(slen, *outbuf + strlen(*outbuf));
 				}
-				free(s);
 				break;
 			}
 
@@ -19,6 +19,7 @@ extern "C" {
 #endif
 
 #include <stdarg.h>
+#include <sys/uio.h>
 /* #include <varargs.h> //varargs.h has been superseded by stdarg.h */
 #include <inttypes.h>
 
@@ -38,6 +39,8 @@ typedef enum IPC_COMMAND_CODE {
 	IPC_CMDQ_HEATUP,
 	IPC_CMDQ_GET_PROGRESS,
 	IPC_CMDQ_GET_STATE,
+	IPC_CMDQ_GET_CAPABILITIES,
+	IPC_CMDQ_GCODE_APPEND_FD,
 
 	/* response commands send by server */
 	IPC_CMDR_OK = 0xE0,
@@ -48,6 +51,18 @@ typedef enum IPC_COMMAND_CODE {
 	IPC_CMDR_TRX_CANCELLED = 0xE5
 } IPC_COMMAND_CODE;
 
+/** Set in the command code of commands which carry a request ID (as 4 bytes after the argument count).
+ * The server sends the reply to such a command with the same ID, which lets clients have multiple
+ * requests in flight on one connection. Only use this if the server reports #IPC_CAP_REQUEST_IDS.
+ */
+#define IPC_CMD_REQUEST_ID_FLAG 0x8000
+
+/** Capability bits returned by #IPC_CMDQ_GET_CAPABILITIES. */
+typedef enum IPC_CAPABILITY_BITS {
+	IPC_CAP_REQUEST_IDS = 0x1,
+	IPC_CAP_GCODE_FD = 0x2 /// #IPC_CMDQ_GCODE_APPEND_FD is supported.
+} IPC_CAPABILITY_BITS;
+
 typedef enum IPC_TEMPERATURE_PARAMETER {
 	IPC_TEMP_NONE = 0,
 	IPC_TEMP_HOTEND = 1,
@@ -112,6 +127,59 @@ typedef enum IPC_GCODE_TRANSACTION_BITS {
 	TRX_LAST_CHUNK_BIT = 0x2
 } IPC_GCODE_TRANSACTION_BITS;
 
+/** Number of arguments for which ipc_cmd_parse() records the offset in #ipc_frame_s.
+ * Commands may have more arguments, those are found by walking from the last recorded one.
+ */
+#define IPC_FRAME_INDEXED_ARGS 8
+
+/** Describes a complete command inside a receive buffer, as filled in by ipc_cmd_parse().
+ *
+ * The frame only points into the buffer, so it is valid for as long as the buffer contents are.
+ */
+typedef struct ipc_frame_s {
+	const char *buf;        /// Start of the command
+	int len;                /// Total length of the command
+	IPC_COMMAND_CODE code;
+	int num_args;
+	int has_request_id;     /// Non-zero if the command carries a request ID
+	uint32_t request_id;
+	uint32_t arg_offsets[IPC_FRAME_INDEXED_ARGS]; /// Offset (relative to buf) of each argument's length field
+} ipc_frame_s;
+
+/** Describes a single argument for the encoding functions (ipc_cmd_encode() and ipc_cmd_encode_iov()).
+ * Use the ipc_arg_*() functions below to fill it in.
+ */
+typedef struct ipc_arg_s {
+	char type;              /// 'w' (int16_t), 'W' (int32_t) or 'x' (data with length)
+	int32_t value;          /// Value of 'w' and 'W' arguments
+	const void *data;       /// Data of 'x' arguments (not copied until the command is encoded)
+	uint32_t len;           /// Length of data
+} ipc_arg_s;
+
+static inline ipc_arg_s ipc_arg_short(int16_t value) {
+	ipc_arg_s arg = { 'w', value, 0, 0 };
+	return arg;
+}
+
+static inline ipc_arg_s ipc_arg_long(int32_t value) {
+	ipc_arg_s arg = { 'W', value, 0, 0 };
+	return arg;
+}
+
+static inline ipc_arg_s ipc_arg_data(const void *data, uint32_t len) {
+	ipc_arg_s arg = { 'x', 0, data, data ? len : 0 };
+	return arg;
+}
+
+/** Data arguments of at least this size are referenced by ipc_cmd_encode_iov() instead of being copied. */
+#define IPC_IOV_MIN_BLOB_LEN 128
+
+/** Size of a buffer which is always large enough for ipc_cmd_encode_iov() with the given number of arguments. */
+#define IPC_IOV_BUF_SIZE(num_args) (8 + (num_args) * (4 + IPC_IOV_MIN_BLOB_LEN))
+
+/** Number of iovec entries ipc_cmd_encode_iov() may need for the given number of arguments. */
+#define IPC_IOV_COUNT(num_args) (2 * (num_args) + 1)
+
 extern const char *IPC_SOCKET_PATH_PREFIX;
 extern const char *IPC_DEFAULT_DEVICE_ID;
 
@@ -138,7 +206,7 @@ char **ipc_find_devices();
  */
 void ipc_free_device_list(char **list);
 
-//all-in-one function to construct IPC commands in printf style
+//all-in-one function to construct IPC commands in printf style, the result is allocated once with the exact size
 //please note the varargs are implemented by evil magic...
 char* ipc_construct_cmd(int* cmdlen, IPC_COMMAND_CODE code, const char* fmtp, ...);
 
@@ -146,6 +214,46 @@ char* ipc_construct_cmd(int* cmdlen, IPC_COMMAND_CODE code, const char* fmtp, ..
 //please note the varargs are implemented by evil magic...
 char* ipc_va_construct_cmd(int* cmdlen, IPC_COMMAND_CODE code, const char* format, va_list args);
 
+/** Returns the size of the command which would be encoded from the given arguments (plus 4 with a request ID). */
+int ipc_cmd_encoded_len(const ipc_arg_s *args, int num_args);
+
+/** Encodes a command into the given buffer (e.g. on the stack), without allocating memory.
+ *
+ * @param buf Buffer to write to
+ * @param bufsize Size of buf, see ipc_cmd_encoded_len()
+ * @param code Command code
+ * @param request_id Request ID to include, or NULL
+ * @param args Arguments
+ * @param num_args Number of arguments
+ * @retval >0 the command length
+ * @retval -1 if buf is too small or an argument has an invalid type
+ */
+int ipc_cmd_encode(char *buf, int bufsize, IPC_COMMAND_CODE code, const uint32_t *request_id, const ipc_arg_s *args, int num_args);
+
+/** Encodes a command as a list of iovecs, ready to be passed to writev() or sendmsg().
+ *
+ * The command code and all length fields are written into buf, as are arguments smaller than
+ * #IPC_IOV_MIN_BLOB_LEN. Larger data arguments are only referenced, so they must stay valid until
+ * the command has been sent.
+ * @param buf Buffer for everything except large data arguments, see #IPC_IOV_BUF_SIZE
+ * @param bufsize Size of buf
+ * @param iov Array to fill in, with room for at least IPC_IOV_COUNT(num_args) entries
+ * @param iovcnt Set to the number of iovecs used
+ * @param code Command code
+ * @param request_id Request ID to include, or NULL
+ * @param args Arguments
+ * @param num_args Number of arguments
+ * @retval >0 the total command length
+ * @retval -1 if buf is too small or an argument has an invalid type
+ */
+int ipc_cmd_encode_iov(char *buf, int bufsize, struct iovec *iov, int *iovcnt,
+		IPC_COMMAND_CODE code, const uint32_t *request_id, const ipc_arg_s *args, int num_args);
+
+/** Copies the data referenced by a list of iovecs into a single newly allocated buffer (e.g. for logging).
+ * @retval NULL on allocation failure
+ */
+char *ipc_iov_join(const struct iovec *iov, int iovcnt, int *len);
+
 //reallocates buf to 4 bytes (2 for command code and 2 argument count)
 int ipc_cmd_set(char** buf, int* buflen, IPC_COMMAND_CODE code);
 
@@ -162,6 +270,28 @@ int ipc_cmd_add_arg(char** buf, int* buflen, const void* arg, uint32_t arglen);
  */
 int ipc_cmd_is_complete(const char* buf, int buflen);
 
+/** Checks for a complete command at the start of the buffer and describes it, in a single pass.
+ *
+ * @param buf Command buffer
+ * @param buflen Command buffer length
+ * @param frame Filled in if a complete command is present
+ * @retval >0 the command size, if a complete command is present
+ * @retval 0 if no complete command is present (frame is left untouched)
+ */
+int ipc_cmd_parse(const char* buf, int buflen, ipc_frame_s *frame);
+
+/** Checks whether the command at the start of the buffer is, or will be once complete, larger than maxlen.
+ * Only the header and the argument lengths received so far are looked at, so an oversized command
+ * is found as soon as the length of its offending argument is in the buffer.
+ *
+ * @param buf Command buffer
+ * @param buflen Command buffer length
+ * @param maxlen Maximum command size
+ * @retval 1 if the command is larger than maxlen
+ * @retval 0 if it is not, or if not enough of it has been received to tell
+ */
+int ipc_cmd_exceeds(const char* buf, int buflen, uint32_t maxlen);
+
 /** Returns the number of arguments in the command.
  *
  * @param buf Command buffer
@@ -171,7 +301,7 @@ int ipc_cmd_is_complete(const char* buf, int buflen);
  */
 int ipc_cmd_num_args(const char* buf, int buflen);
 
-/** Extracts the command code.
+/** Extracts the command code (without #IPC_CMD_REQUEST_ID_FLAG).
  *
  * @param buf Command buffer
  * @param buflen Command buffer length
@@ -212,6 +342,30 @@ int ipc_cmd_get_short_arg(const char* buf, int buflen, int argidx, int16_t* out)
 //get arg and convert to int32_t
 int ipc_cmd_get_long_arg(const char* buf, int buflen, int argidx, int32_t* out);
 
+/** Returns a view of an argument of a parsed command, without copying it.
+ *
+ * String arguments are not necessarily nul-terminated, use the returned length.
+ * @param frame Command as parsed by ipc_cmd_parse()
+ * @param argidx The index of the argument
+ * @param arg Set to the start of the argument data (inside the command buffer)
+ * @param arglen Set to the length of the argument
+ * @retval 0 on success
+ * @retval -2 if argidx is invalid
+ */
+int ipc_frame_get_arg(const ipc_frame_s *frame, int argidx, const char **arg, uint32_t *arglen);
+
+/** Reads an int16_t argument of a parsed command.
+ * @retval 0 on success
+ * @retval -2 if argidx is invalid or the argument is too short
+ */
+int ipc_frame_get_short_arg(const ipc_frame_s *frame, int argidx, int16_t *out);
+
+/** Reads an int32_t argument of a parsed command.
+ * @retval 0 on success
+ * @retval -2 if argidx is invalid or the argument is too short
+ */
+int ipc_frame_get_long_arg(const ipc_frame_s *frame, int argidx, int32_t *out);
+
 /** Removes the first complete command from the start of the buffer.
  *
  * @param buf Command buffer
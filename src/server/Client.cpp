@@ -6,28 +6,131 @@
  * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
  */
 
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include "Client.h"
+#include "IpcCommand.h"
 #include "Logger.h"
 #include "Server.h"
 #include "CommandHandler.h"
 #include "../utils.h"
 
+const uint32_t Client::MAX_FRAME_SIZE = 256 * 1024; //advertised to clients, which size their gcode chunks by it; larger commands are refused
+const size_t Client::MIN_READ_SPACE = 1024; //private
+const size_t Client::MAX_RECEIVED_FDS = 4; //private
+
+#ifndef MSG_CMSG_CLOEXEC
+# define MSG_CMSG_CLOEXEC 0
+#endif
+
 Client::Client(Server& server, int fd)
-: logger_(Logger::getInstance()), server_(server), fd_(fd), buffer_(0), bufferSize_(0)
+: logger_(Logger::getInstance()), server_(server), fd_(fd), buffer_(2 * MIN_READ_SPACE), readPos_(0), writePos_(0),
+  hasRequestId_(false), requestId_(0), ingestCommandLen_(0)
 { /* empty */ }
 
-//TODO: find a way to use recv with extra arg in readAndAppendAvailableData()
+Client::~Client() {
+	if (transaction_.fd >= 0) ::close(transaction_.fd);
+
+	while (!receivedFds_.empty()) {
+		::close(receivedFds_.front());
+		receivedFds_.pop_front();
+	}
+}
+
+/*
+ * Reads whatever is available (in a single read) directly behind the data already received. File descriptors
+ * sent along (SCM_RIGHTS) are kept for the command they came with, see takeReceivedFd().
+ * Returns the number of bytes read, -1 on error, -2 if the connection has been closed or -3 if the client
+ * sent a command larger than MAX_FRAME_SIZE (it is not run, and the client should be closed).
+ */
 int Client::readData() {
-	return readAndAppendAvailableData(fd_, &buffer_, &bufferSize_, 0, 1);
+	makeReadSpace();
+
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(MAX_RECEIVED_FDS * sizeof(int))];
+	} control;
+
+	while (true) {
+		struct iovec iov = { &buffer_[writePos_], buffer_.size() - writePos_ };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		ssize_t rv = ::recvmsg(fd_, &msg, MSG_CMSG_CLOEXEC);
+
+		if (rv > 0) {
+			storeReceivedFds(msg);
+			writePos_ += rv;
+			return hasOversizedCommand() ? -3 : rv;
+		} else if (rv == 0) {
+			return -2;
+		} else if (errno == EWOULDBLOCK || errno == EAGAIN) {
+			return 0;
+		} else if (errno != EINTR) {
+			return -1;
+		}
+	}
 }
 
+/*
+ * Runs all complete commands in the buffer, each is parsed once and handed to its handler in place.
+ * Commands are run (and thus replied to) in the order they were received, also when clients
+ * have multiple requests in flight using request IDs. While gcode is being ingested, no further
+ * commands are run until the server has finished it (see continueIngest()).
+ */
 void Client::runCommands() {
-	while (ipc_cmd_is_complete(buffer_, bufferSize_)) {
-		CommandHandler::runCommand(*this, buffer_, bufferSize_);
-		ipc_cmd_remove(&buffer_, &bufferSize_);
+	ipc_frame_s frame;
+	int len;
+
+	while (!transaction_.ingesting && (len = ipc_cmd_parse(&buffer_[readPos_], writePos_ - readPos_, &frame)) > 0) {
+		hasRequestId_ = frame.has_request_id;
+		requestId_ = frame.request_id;
+		CommandHandler::runCommand(*this, frame);
+
+		//the command stays in the buffer (the gcode may still be read from it), moving data to make room keeps it in front
+		if (transaction_.ingesting) {
+			ingestCommandLen_ = len;
+			return;
+		}
+
+		hasRequestId_ = false;
+		readPos_ += len;
 	}
+
+	if (readPos_ == writePos_) readPos_ = writePos_ = 0;
+}
+
+bool Client::isIngesting() const {
+	return transaction_.ingesting;
+}
+
+/*
+ * Stages the next slice (up to maxBytes) of the gcode being ingested. Once all of it has been handled
+ * and replied to, the commands which came in after it are run.
+ */
+void Client::continueIngest(size_t maxBytes) {
+	if (!transaction_.ingesting || CommandHandler::continueIngest(*this, maxBytes)) return;
+
+	hasRequestId_ = false;
+	readPos_ += ingestCommandLen_;
+	ingestCommandLen_ = 0;
+	runCommands();
+}
+
+/*
+ * Stages all gcode still being ingested right away, a slice at a time, and runs the commands behind it
+ * (which may start another ingest). Used when the client is about to be closed and will not be serviced again.
+ */
+void Client::finishIngest(size_t sliceSize) {
+	while (transaction_.ingesting) continueIngest(sliceSize);
 }
 
 bool Client::sendData(const char* buf, int buflen) {
@@ -42,6 +145,35 @@ bool Client::sendData(const char* buf, int buflen) {
 	return (rv == buflen);
 }
 
+/*
+ * Encodes the command into a buffer on the stack and sends it with a single writev(); large data
+ * arguments (like gcode) are sent from where they are instead of being copied into the command.
+ */
+bool Client::sendCommand(const IpcCommand& command) {
+	if (fd_ == -1 || !command.isValid()) return false;
+
+	char buf[IPC_IOV_BUF_SIZE(IpcCommand::MAX_ARGS)];
+	struct iovec iov[IPC_IOV_COUNT(IpcCommand::MAX_ARGS)];
+	int iovcnt;
+
+	int cmdlen = ipc_cmd_encode_iov(buf, sizeof(buf), iov, &iovcnt, command.getCode(),
+			hasRequestId_ ? &requestId_ : NULL, command.getArgs(), command.getNumArgs());
+	if (cmdlen < 0) return false;
+
+	if (logger_.getLevel() >= Logger::BULK) {
+		int joinedlen;
+		char *joined = ipc_iov_join(iov, iovcnt, &joinedlen);
+		if (joined) logger_.logIpcCmd(Logger::BULK, joined, joinedlen, true);
+		free(joined);
+	}
+
+	int rv = ::writev(fd_, iov, iovcnt);
+
+	logger_.checkError(rv, "CLI ", "could not send data in client with fd %i", getFileDescriptor());
+
+	return (rv == cmdlen);
+}
+
 
 bool Client::sendOk() {
 	return sendReply(IPC_CMDR_OK);
@@ -52,21 +184,25 @@ bool Client::sendError(const std::string& message) {
 }
 
 bool Client::sendReply(IPC_COMMAND_CODE code, const std::string *message) {
-	int cmdlen;
-	char* cmd = 0;
+	IpcCommand reply(code);
+	if (message) reply.addString(*message);
 
-	if (message) cmd = ipc_construct_cmd(&cmdlen, code, "x", message->c_str(), message->length());
-	else cmd = ipc_construct_cmd(&cmdlen, code, "");
+	sendCommand(reply);
+	return true;
+}
 
-	if (!cmd) return false;
 
-//	char *cmd_text = NULL;
-//	ipc_stringify_cmd(cmd, cmdlen, 1, &cmd_text);
-//	printf("--- about to send reply: %s\n", cmd_text); free(cmd_text);
+/*
+ * Returns the oldest file descriptor received and not taken yet (the caller becomes responsible for closing it),
+ * or -1 if there is none. A descriptor arrives along with the first bytes of the command it belongs to, so it
+ * has always been received by the time that command is run.
+ */
+int Client::takeReceivedFd() {
+	if (receivedFds_.empty()) return -1;
 
-	sendData(cmd, cmdlen);
-	free(cmd);
-	return true;
+	int fd = receivedFds_.front();
+	receivedFds_.pop_front();
+	return fd;
 }
 
 
@@ -83,12 +219,13 @@ int Client::getFileDescriptor() const {
 	return fd_;
 }
 
+//returns the data received but not processed yet
 const char* Client::getBuffer() const {
-	return buffer_;
+	return &buffer_[readPos_];
 }
 
 int Client::getBufferSize() const {
-	return bufferSize_;
+	return writePos_ - readPos_;
 }
 
 Server& Client::getServer() {
@@ -98,3 +235,59 @@ Server& Client::getServer() {
 const Server& Client::getServer() const {
 	return server_;
 }
+
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+//ensures at least MIN_READ_SPACE bytes are free behind the received data, by moving a partial command to the front or by growing the buffer
+void Client::makeReadSpace() {
+	if (buffer_.size() - writePos_ >= MIN_READ_SPACE) return;
+
+	if (readPos_ > 0) {
+		memmove(&buffer_[0], &buffer_[readPos_], writePos_ - readPos_);
+		writePos_ -= readPos_;
+		readPos_ = 0;
+	}
+
+	if (buffer_.size() - writePos_ < MIN_READ_SPACE) buffer_.resize(2 * buffer_.size());
+}
+
+//returns true if a command in the buffer is, or will be once complete, larger than MAX_FRAME_SIZE
+bool Client::hasOversizedCommand() const {
+	ipc_frame_s frame;
+	size_t pos = readPos_;
+	int len;
+
+	while ((len = ipc_cmd_parse(&buffer_[pos], writePos_ - pos, &frame)) > 0) {
+		if ((uint32_t)len > MAX_FRAME_SIZE) return true;
+		pos += len;
+	}
+
+	return ipc_cmd_exceeds(&buffer_[pos], writePos_ - pos, MAX_FRAME_SIZE) != 0;
+}
+
+void Client::storeReceivedFds(struct msghdr& msg) {
+	if (msg.msg_flags & MSG_CTRUNC) {
+		logger_.log(Logger::WARNING, "CLI ", "client with fd %i sent more file descriptors than accepted at once, some were dropped", fd_);
+	}
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+		size_t numFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < numFds; i++) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+
+			//descriptors not taken by any command would otherwise pile up until the client disconnects
+			if (receivedFds_.size() >= MAX_RECEIVED_FDS) {
+				logger_.log(Logger::WARNING, "CLI ", "client with fd %i has too many unused file descriptors, closing fd %i", fd_, fd);
+				::close(fd);
+			} else {
+				receivedFds_.push_back(fd);
+			}
+		}
+	}
+}
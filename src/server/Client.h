@@ -9,28 +9,56 @@
 #ifndef CLIENT_H_SEEN
 #define CLIENT_H_SEEN
 
+#include <deque>
 #include <string>
+#include <vector>
 #include "../ipc_shared.h"
+#include "../drivers/GCodeBuffer.h"
 
+class IpcCommand;
 class Logger;
 class Server;
 
 class Client {
 public:
+	//gcode sent in multiple chunks is staged until the last one has arrived, see CommandHandler::appendGCodeChunk()
 	typedef struct Transaction {
-		Transaction() : active(false), cancelled(false) {}
+		Transaction() : active(false), cancelled(false), ingesting(false), textPos(0), textLen(0), fd(-1),
+				flags(0), totalLines(-1), hasSource(false) {}
 
-		std::string buffer;
+		GCodeBuffer::Staging staging;
 		bool active;
 		bool cancelled;
+
+		//a chunk is staged a slice at a time in between other work, see CommandHandler::continueIngest(); its text is
+		//either read from fd (at offset textPos) into readBuf slice by slice, or part of the command being run, at
+		//textPos in the data returned by getBuffer()
+		bool ingesting;
+		size_t textPos;
+		size_t textLen;
+		int fd;
+		std::vector<char> readBuf;
+		int16_t flags;
+		int32_t totalLines;
+		GCodeBuffer::MetaData metaData; //source is kept in the string below
+		bool hasSource;
+		std::string source;
 	} Transaction;
 
 
+	static const uint32_t MAX_FRAME_SIZE;
+
 	Client(Server& server, int fd);
+	~Client();
 	int readData();
 	void runCommands();
+	bool isIngesting() const;
+	void continueIngest(size_t maxBytes);
+	void finishIngest(size_t sliceSize);
+	int takeReceivedFd();
 
 	bool sendData(const char* buf, int buflen);
+	bool sendCommand(const IpcCommand& command);
 	bool sendOk();
 	bool sendError(const std::string& message);
 	bool sendReply(IPC_COMMAND_CODE code, const std::string *message = 0);
@@ -46,6 +74,9 @@ public:
 	const Server& getServer() const;
 
 private:
+	static const size_t MIN_READ_SPACE;
+	static const size_t MAX_RECEIVED_FDS;
+
 	Client(const Client& o);
 	void operator=(const Client& o);
 
@@ -53,9 +84,27 @@ private:
 	Server& server_;
 
 	int fd_;
-	char* buffer_;
-	int bufferSize_;
+
+	//received data is kept in buffer_ between readPos_ and writePos_; commands are run from there
+	//without being copied, the space is only reclaimed once it is needed for new data
+	std::vector<char> buffer_;
+	size_t readPos_;
+	size_t writePos_;
 	Transaction transaction_;
+
+	//file descriptors passed along with commands, in the order they were received; they are owned by the client until taken
+	std::deque<int> receivedFds_;
+
+	//replies are sent with the request ID of the command being run, if it has one
+	bool hasRequestId_;
+	uint32_t requestId_;
+
+	//length of the command being ingested, it is kept in the buffer and replied to once its gcode has been staged
+	size_t ingestCommandLen_;
+
+	void makeReadSpace();
+	bool hasOversizedCommand() const;
+	void storeReceivedFds(struct msghdr& msg);
 };
 
 #endif /* ! CLIENT_H_SEEN */
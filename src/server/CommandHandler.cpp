@@ -7,11 +7,16 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
 #include <cstring>
+#include <sys/stat.h>
 #include "CommandHandler.h"
 #include "Client.h"
+#include "IpcCommand.h"
 #include "Server.h"
 #include "../utils.h"
 
@@ -33,22 +38,28 @@ const CommandHandler::handlerFunctions CommandHandler::HANDLERS[] = {
 		{ IPC_CMDQ_HEATUP, &CommandHandler::hnd_heatup },
 		{ IPC_CMDQ_GET_PROGRESS, &CommandHandler::hnd_getProgress },
 		{ IPC_CMDQ_GET_STATE, &CommandHandler::hnd_getState },
+		{ IPC_CMDQ_GET_CAPABILITIES, &CommandHandler::hnd_getCapabilities },
+		{ IPC_CMDQ_GCODE_APPEND_FD, &CommandHandler::hnd_gcodeAppendFd },
 		{ IPC_CMDS_NONE, 0 } /* sentinel */
 };
 
 const Logger::ELOG_LEVEL CommandHandler::COMMAND_LOG_LEVEL = Logger::BULK;
 
 //static
-//expects a complete command at start of buffer
-void CommandHandler::runCommand(Client& client, const char* buf, int buflen) {
+//expects a command as parsed by ipc_cmd_parse()
+void CommandHandler::runCommand(Client& client, const ipc_frame_s& frame) {
 	const handlerFunctions* hfunc = HANDLERS;
-	IPC_COMMAND_CODE code = ipc_cmd_get(buf, buflen);
 
-	Logger::getInstance().logIpcCmd(Logger::BULK, buf, buflen);
+	Logger::getInstance().logIpcCmd(Logger::BULK, frame.buf, frame.len);
 
-	while(hfunc->hndFunc) {
-		if (hfunc->code == code) hfunc->hndFunc(client, buf, buflen);
-		hfunc++;
+	while(hfunc->hndFunc && hfunc->code != frame.code) hfunc++;
+
+	if (hfunc->hndFunc) {
+		hfunc->hndFunc(client, frame);
+	} else {
+		//clients wait for a reply, so unknown commands (e.g. from newer clients) must be answered as well
+		LOG(Logger::WARNING, "received unknown command 0x%x", frame.code);
+		client.sendReply(IPC_CMDR_NOT_IMPLEMENTED);
 	}
 
 	//TODO:
@@ -58,35 +69,30 @@ void CommandHandler::runCommand(Client& client, const char* buf, int buflen) {
 
 
 //static
-void CommandHandler::hnd_test(Client& client, const char* buf, int buflen) {
-	int numargs = ipc_cmd_num_args(buf, buflen);
+void CommandHandler::hnd_test(Client& client, const ipc_frame_s& frame) {
+	int numargs = frame.num_args;
 	LOG(COMMAND_LOG_LEVEL, "test cmd with %i arguments", numargs);
 
 	char* argtext = 0;
-	if (numargs > 0) {
-		char* arg = 0;
-		ipc_cmd_get_string_arg(buf, buflen, 0, &arg);
-		asprintf(&argtext, "printserver test answer to the question: '%s'", arg);
-		free(arg);
+	const char* arg;
+	uint32_t arglen;
+	if (getTextArg(frame, 0, &arg, &arglen)) {
+		asprintf(&argtext, "printserver test answer to the question: '%.*s'", (int)arglen, arg);
 	} else {
 		asprintf(&argtext, "printserver test answer without question");
 	}
 
-	int cmdlen;
-	char* cmd = ipc_construct_cmd(&cmdlen, IPC_CMDR_OK, "x", argtext, strlen(argtext));
+	client.sendCommand(IpcCommand(IPC_CMDR_OK).addData(argtext, strlen(argtext)));
 	free(argtext);
-
-	client.sendData(cmd, cmdlen);
-	free(cmd);
 }
 
 //static
-void CommandHandler::hnd_getTemperature(Client& client, const char* buf, int buflen) {
-	if (ipc_cmd_num_args(buf, buflen) > 0) {
+void CommandHandler::hnd_getTemperature(Client& client, const ipc_frame_s& frame) {
+	if (frame.num_args > 0) {
 		AbstractDriver* driver = client.getServer().getDriver();
 
-		int16_t arg;
-		ipc_cmd_get_short_arg(buf, buflen, 0, &arg);
+		int16_t arg = IPC_TEMP_NONE;
+		ipc_frame_get_short_arg(&frame, 0, &arg);
 		IPC_TEMPERATURE_PARAMETER which = (IPC_TEMPERATURE_PARAMETER)arg;
 		LOG(COMMAND_LOG_LEVEL, "get temperature cmd with arg %i", which);
 		int temp = 0;
@@ -103,10 +109,7 @@ void CommandHandler::hnd_getTemperature(Client& client, const char* buf, int buf
 		}
 
 		if (which != IPC_TEMP_NONE) {
-			int cmdlen;
-			char* cmd = ipc_construct_cmd(&cmdlen, IPC_CMDR_OK, "w", temp);
-			client.sendData(cmd, cmdlen);
-			free(cmd);
+			client.sendCommand(IpcCommand(IPC_CMDR_OK).addShort((int16_t)temp));
 		} else {
 			LOG(Logger::ERROR, "get temperature cmd with invalid parameter value");
 			client.sendError("unknown temperature parameter value");
@@ -118,7 +121,7 @@ void CommandHandler::hnd_getTemperature(Client& client, const char* buf, int buf
 }
 
 //static
-void CommandHandler::hnd_gcodeClear(Client& client, const char* buf, int buflen) {
+void CommandHandler::hnd_gcodeClear(Client& client, const ipc_frame_s&) {
 	LOG(COMMAND_LOG_LEVEL, "clear gcode cmd");
 	Server &server = client.getServer();
 	server.cancelAllTransactions(&client);
@@ -127,75 +130,26 @@ void CommandHandler::hnd_gcodeClear(Client& client, const char* buf, int buflen)
 }
 
 //static
-void CommandHandler::hnd_gcodeAppend(Client& client, const char* buf, int buflen) {
-	Server &server = client.getServer();
-	Client::Transaction &transaction = client.getTransaction();
-
-	int numArgs = ipc_cmd_num_args(buf, buflen);
-	if (numArgs == 0) {
+void CommandHandler::hnd_gcodeAppend(Client& client, const ipc_frame_s& frame) {
+	if (frame.num_args == 0) {
 		LOG(Logger::ERROR, "received append gcode cmd without argument");
 		client.sendError("missing argument");
 		return;
 	}
 
-	if (transaction.cancelled) {
-		string msg = "transaction cancelled";
-		client.sendReply(IPC_CMDR_TRX_CANCELLED, &msg);
-	}
-
-	int16_t transactionFlags = TRX_FIRST_CHUNK_BIT | TRX_LAST_CHUNK_BIT; //default to treating each chunk as a separate transaction
-	if (numArgs >= 2) {
-		ipc_cmd_get_short_arg(buf, buflen, 1, &transactionFlags);
-	}
-
-	if (transactionFlags & TRX_FIRST_CHUNK_BIT) {
-		LOG(COMMAND_LOG_LEVEL, "hnd_gcodeAppend(): clearing gcode transaction buffer");
-		transaction.buffer.clear();
-		transaction.active = true;
-	}
-
-	int32_t totalLines = -1;
-	GCodeBuffer::MetaData metaData;
-
-	if (numArgs >= 3) ipc_cmd_get_long_arg(buf, buflen, 2, &totalLines);
-	if (numArgs >= 4) ipc_cmd_get_long_arg(buf, buflen, 3, &metaData.seqNumber);
-	if (numArgs >= 5) ipc_cmd_get_long_arg(buf, buflen, 4, &metaData.seqTotal);
-	if (numArgs >= 6) {
-		char *srcArg = 0;
-		ipc_cmd_get_string_arg(buf, buflen, 5, &srcArg);
-		metaData.source = new string(srcArg);
-		free(srcArg);
-	}
-
-	char* data = 0;
-	ipc_cmd_get_string_arg(buf, buflen, 0, &data);
-	LOG(COMMAND_LOG_LEVEL, "hnd_gcodeAppend(): append gcode cmd with arg length %i (%i args) [ttl_lines: %i, seq_num %i, seq_ttl: %i, src: %s]", strlen(data),
-			numArgs, totalLines, metaData.seqNumber, metaData.seqTotal, metaData.source ? metaData.source->c_str() : "(null)");
-	transaction.buffer.append(data);
-	free(data);
-
-	if (transactionFlags & TRX_LAST_CHUNK_BIT) {
-		LOG(COMMAND_LOG_LEVEL, "hnd_gcodeAppend(): appending and clearing gcode transaction buffer");
-		AbstractDriver* driver = server.getDriver();
-		GCodeBuffer::GCODE_SET_RESULT gsr = driver->appendGCode(transaction.buffer, totalLines, &metaData);
-		transaction.buffer.clear();
-		transaction.active = false;
-		if (gsr != GCodeBuffer::GSR_OK) {
-			if (metaData.source) delete metaData.source;
-			client.sendReply(IPC_CMDR_GCODE_ADD_FAILED, &GCodeBuffer::getGcodeSetResultString(gsr));
-			return;
-		}
-	}
-	if (metaData.source) delete metaData.source;
-	client.sendOk();
+	const char* text;
+	uint32_t textLen;
+	getTextArg(frame, 0, &text, &textLen);
+	appendGCodeChunk(client, frame, text, textLen);
 }
 
 //static
 //TODO: check that given file path is absolute
-void CommandHandler::hnd_gcodeAppendFile(Client& client, const char* buf, int buflen) {
-	if (ipc_cmd_num_args(buf, buflen) == 0) {
+void CommandHandler::hnd_gcodeAppendFile(Client& client, const ipc_frame_s& frame) {
+	if (frame.num_args == 0) {
 		LOG(Logger::ERROR, "append gcode file cmd without argument");
 		client.sendError("missing argument");
+		return;
 	}
 
 	if (client.getTransaction().active) {
@@ -204,27 +158,31 @@ void CommandHandler::hnd_gcodeAppendFile(Client& client, const char* buf, int bu
 		return;
 	}
 
-	char* filename = 0;
-	ipc_cmd_get_string_arg(buf, buflen, 0, &filename);
-	LOG(COMMAND_LOG_LEVEL, "append gcode from file cmd with filename '%s'", filename);
-
-	int filesize;
-	char *data = readFileContents(filename, &filesize);
-	if (!Logger::getInstance().checkError(data ? 0 : -1, "CMDH", "could not read contents of file '%s'", filename)) {
-		LOG(COMMAND_LOG_LEVEL, "  read %i bytes of gcode", strlen(data));
-		//LOG(Logger::BULK, "read gcode: '%s'", data);
-		string s(data);
-		free(data);
-		client.getServer().getDriver()->appendGCode(s);
-		client.sendOk();
-	} else {
+	const char* text;
+	uint32_t textLen;
+	getTextArg(frame, 0, &text, &textLen);
+	string filename(text, textLen);
+	LOG(COMMAND_LOG_LEVEL, "append gcode from file cmd with filename '%s'", filename.c_str());
+
+	int fd = open(filename.c_str(), O_RDONLY);
+	struct stat st;
+	if (Logger::getInstance().checkError((fd < 0 || fstat(fd, &st) < 0) ? -1 : 0, "CMDH", "could not open file '%s'", filename.c_str())) {
 		client.sendError(errno > 0 ? strerror(errno) : "error reading file");
+		if (fd >= 0) close(fd);
+		return;
 	}
-	free(filename);
+
+	if (st.st_size == 0) {
+		close(fd);
+		fd = -1;
+	}
+
+	LOG(COMMAND_LOG_LEVEL, "  reading %lli bytes of gcode", (long long)st.st_size);
+	appendGCodeChunk(client, frame, "", st.st_size, fd);
 }
 
 //static
-void CommandHandler::hnd_gcodeStartPrint(Client& client, const char* buf, int buflen) {
+void CommandHandler::hnd_gcodeStartPrint(Client& client, const ipc_frame_s&) {
 	LOG(COMMAND_LOG_LEVEL, "start print gcode cmd");
 	AbstractDriver* driver = client.getServer().getDriver();
 	driver->startPrint();
@@ -232,19 +190,17 @@ void CommandHandler::hnd_gcodeStartPrint(Client& client, const char* buf, int bu
 }
 
 //static
-void CommandHandler::hnd_gcodeStopPrint(Client& client, const char* buf, int buflen) {
+void CommandHandler::hnd_gcodeStopPrint(Client& client, const ipc_frame_s& frame) {
 	LOG(COMMAND_LOG_LEVEL, "stop print gcode cmd");
 	AbstractDriver* driver = client.getServer().getDriver();
 
 	//make sure no other gcode transfers continue after sending stop gcode
 	client.getServer().cancelAllTransactions(&client);
 
-	if (ipc_cmd_num_args(buf, buflen) > 0) {
-		char *argText = 0;
-		ipc_cmd_get_string_arg(buf, buflen, 0, &argText);
-		string endCode(argText);
-		free(argText);
-		driver->stopPrint(endCode);
+	const char* text;
+	uint32_t textLen;
+	if (getTextArg(frame, 0, &text, &textLen)) {
+		driver->stopPrint(string(text, textLen));
 	} else {
 		driver->stopPrint();
 	}
@@ -252,10 +208,10 @@ void CommandHandler::hnd_gcodeStopPrint(Client& client, const char* buf, int buf
 }
 
 //static
-void CommandHandler::hnd_heatup(Client& client, const char* buf, int buflen) {
-	if (ipc_cmd_num_args(buf, buflen) > 0) {
+void CommandHandler::hnd_heatup(Client& client, const ipc_frame_s& frame) {
+	if (frame.num_args > 0) {
 		int16_t temperature = 0;
-		ipc_cmd_get_short_arg(buf, buflen, 0, &temperature);
+		ipc_frame_get_short_arg(&frame, 0, &temperature);
 		LOG(COMMAND_LOG_LEVEL, "heatup cmd with temperature %i", temperature);
 		AbstractDriver* driver = client.getServer().getDriver();
 		driver->heatup(temperature);
@@ -267,7 +223,7 @@ void CommandHandler::hnd_heatup(Client& client, const char* buf, int buflen) {
 }
 
 //static
-void CommandHandler::hnd_getProgress(Client& client, const char* buf, int buflen) {
+void CommandHandler::hnd_getProgress(Client& client, const ipc_frame_s&) {
 	LOG(COMMAND_LOG_LEVEL, "get progress cmd");
 	AbstractDriver* driver = client.getServer().getDriver();
 
@@ -278,23 +234,204 @@ void CommandHandler::hnd_getProgress(Client& client, const char* buf, int buflen
 	int32_t maxBufferSize = driver->getMaxBufferSize();
 	const GCodeBuffer::MetaData *md = driver->getMetaData();
 
-	int cmdlen;
-	char* cmd = ipc_construct_cmd(&cmdlen, IPC_CMDR_OK, "WWWWWWW",
-			currentLine, bufferedLines, totalLines, bufferSize, maxBufferSize,
-			md->seqNumber, md->seqTotal);
-	client.sendData(cmd, cmdlen);
-	free(cmd);
+	IpcCommand reply(IPC_CMDR_OK);
+	reply.addLong(currentLine).addLong(bufferedLines).addLong(totalLines).addLong(bufferSize).addLong(maxBufferSize);
+	reply.addLong(md->seqNumber).addLong(md->seqTotal);
+	client.sendCommand(reply);
 }
 
 //static
-void CommandHandler::hnd_getState(Client& client, const char* buf, int buflen) {
+void CommandHandler::hnd_getState(Client& client, const ipc_frame_s&) {
 	LOG(COMMAND_LOG_LEVEL, "get state cmd");
 	AbstractDriver* driver = client.getServer().getDriver();
 
 	const string& state = AbstractDriver::getStateString(driver->getState());
 
-	int cmdlen;
-	char* cmd = ipc_construct_cmd(&cmdlen, IPC_CMDR_OK, "x", state.c_str(), state.length());
-	client.sendData(cmd, cmdlen);
-	free(cmd);
+	client.sendCommand(IpcCommand(IPC_CMDR_OK).addString(state));
+}
+
+
+//static
+void CommandHandler::hnd_getCapabilities(Client& client, const ipc_frame_s&) {
+	LOG(COMMAND_LOG_LEVEL, "get capabilities cmd");
+	IpcCommand reply(IPC_CMDR_OK);
+	reply.addLong((int32_t)Client::MAX_FRAME_SIZE).addLong((int32_t)(IPC_CAP_REQUEST_IDS | IPC_CAP_GCODE_FD));
+	client.sendCommand(reply);
+}
+
+//static
+//the gcode is read from a file descriptor sent along with the command (e.g. a memfd filled by the client) instead
+//of being copied through the socket, all other arguments are the same as with IPC_CMDQ_GCODE_APPEND
+void CommandHandler::hnd_gcodeAppendFd(Client& client, const ipc_frame_s& frame) {
+	int fd = client.takeReceivedFd();
+	int32_t length = -1;
+	ipc_frame_get_long_arg(&frame, 0, &length);
+
+	if (fd < 0 || length < 0) {
+		LOG(Logger::ERROR, "append gcode fd cmd without %s", fd < 0 ? "file descriptor" : "length argument");
+		if (fd >= 0) close(fd);
+		client.sendError("missing argument");
+		return;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size < length) {
+		LOG(Logger::ERROR, "append gcode fd cmd with length %i, but the file holds only %lli bytes", length, (long long)st.st_size);
+		close(fd);
+		client.sendError("file descriptor holds less data than specified");
+		return;
+	}
+
+	if (length == 0) {
+		close(fd);
+		fd = -1;
+	}
+
+	LOG(COMMAND_LOG_LEVEL, "append gcode fd cmd with %i bytes", length);
+	appendGCodeChunk(client, frame, "", length, fd);
+}
+
+//static
+//stages the next slice (at most maxBytes) of the gcode set up by appendGCodeChunk(), returns true if there is more to do;
+//when all of it has been staged, the transaction is committed if this was its last chunk and the chunk is replied to
+bool CommandHandler::continueIngest(Client& client, size_t maxBytes) {
+	AbstractDriver* driver = client.getServer().getDriver();
+	Client::Transaction &transaction = client.getTransaction();
+	GCodeBuffer::GCODE_SET_RESULT gsr = GCodeBuffer::GSR_OK;
+	bool readFailed = false;
+
+	//commands from other clients, which run in between slices, may have cancelled the transaction
+	if (!transaction.cancelled) {
+		size_t len = std::min(transaction.textLen, maxBytes);
+		const char* text = client.getBuffer() + transaction.textPos;
+		if (transaction.fd >= 0) {
+			text = readGCode(client, len);
+			readFailed = (text == 0);
+		}
+
+		if (!readFailed) gsr = driver->stageGCode(transaction.staging, text, len);
+		transaction.textPos += len;
+		transaction.textLen -= len;
+
+		if (!readFailed && gsr == GCodeBuffer::GSR_OK && transaction.textLen > 0) return true;
+	}
+
+	if (transaction.fd >= 0) close(transaction.fd);
+	transaction.fd = -1;
+	transaction.readBuf.clear();
+	transaction.ingesting = false;
+
+	if (transaction.cancelled) {
+		string msg = "transaction cancelled";
+		client.sendReply(IPC_CMDR_TRX_CANCELLED, &msg);
+		return false;
+	}
+
+	if (!readFailed && gsr == GCodeBuffer::GSR_OK && (transaction.flags & TRX_LAST_CHUNK_BIT)) {
+		GCodeBuffer::MetaData metaData = transaction.metaData;
+		if (transaction.hasSource) metaData.source = &transaction.source;
+
+		LOG(COMMAND_LOG_LEVEL, "hnd_gcodeAppend(): committing gcode transaction (%i bytes staged)", transaction.staging.getSize());
+		gsr = driver->commitGCode(transaction.staging, transaction.totalLines, &metaData);
+		transaction.active = false;
+	}
+
+	if (readFailed || gsr != GCodeBuffer::GSR_OK) {
+		//any further chunks of this transaction are answered with 'cancelled'
+		transaction.staging.clear();
+		transaction.active = false;
+		transaction.cancelled = !(transaction.flags & TRX_LAST_CHUNK_BIT);
+		if (readFailed) client.sendError("could not read gcode");
+		else client.sendReply(IPC_CMDR_GCODE_ADD_FAILED, &GCodeBuffer::getGcodeSetResultString(gsr));
+		return false;
+	}
+
+	client.sendOk();
+	return false;
+}
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+//static
+//sets up staging of text in the client's gcode transaction, which the server does in slices using continueIngest();
+//arguments 1 to 5 of the frame hold the transaction bits and metadata. The text is read from fd instead if that is not -1,
+//fd is closed when it is done with.
+void CommandHandler::appendGCodeChunk(Client& client, const ipc_frame_s& frame, const char* text, uint32_t textLen, int fd) {
+	Client::Transaction &transaction = client.getTransaction();
+
+	int16_t transactionFlags = TRX_FIRST_CHUNK_BIT | TRX_LAST_CHUNK_BIT; //default to treating each chunk as a separate transaction
+	if (frame.num_args >= 2) {
+		ipc_frame_get_short_arg(&frame, 1, &transactionFlags);
+	}
+
+	if (transactionFlags & TRX_FIRST_CHUNK_BIT) {
+		LOG(COMMAND_LOG_LEVEL, "hnd_gcodeAppend(): starting gcode transaction");
+		transaction.staging.clear();
+		transaction.active = true;
+		transaction.cancelled = false;
+	} else if (transaction.cancelled) {
+		if (fd >= 0) close(fd);
+		string msg = "transaction cancelled";
+		client.sendReply(IPC_CMDR_TRX_CANCELLED, &msg);
+		return;
+	}
+
+	const char* source;
+	uint32_t sourceLen;
+
+	transaction.flags = transactionFlags;
+	transaction.totalLines = -1;
+	transaction.metaData = GCodeBuffer::MetaData();
+	ipc_frame_get_long_arg(&frame, 2, &transaction.totalLines);
+	ipc_frame_get_long_arg(&frame, 3, &transaction.metaData.seqNumber);
+	ipc_frame_get_long_arg(&frame, 4, &transaction.metaData.seqTotal);
+	transaction.hasSource = getTextArg(frame, 5, &source, &sourceLen);
+	if (transaction.hasSource) transaction.source.assign(source, sourceLen);
+
+	LOG(COMMAND_LOG_LEVEL, "hnd_gcodeAppend(): append gcode cmd with arg length %i (%i args) [ttl_lines: %i, seq_num %i, seq_ttl: %i, src: %s]", textLen,
+			frame.num_args, transaction.totalLines, transaction.metaData.seqNumber, transaction.metaData.seqTotal,
+			transaction.hasSource ? transaction.source.c_str() : "(null)");
+
+	transaction.ingesting = true;
+	transaction.fd = fd;
+	transaction.textPos = (fd >= 0 || textLen == 0) ? 0 : text - client.getBuffer();
+	transaction.textLen = textLen;
+}
+
+//static
+//reads the next len bytes of gcode from the transaction's file descriptor into its read buffer, returns NULL if that fails.
+//The gcode is read a slice at a time rather than mapped, since the client may still truncate the file: accessing a
+//mapping beyond the end of a file kills the process (SIGBUS), while reading from it just comes up short.
+const char* CommandHandler::readGCode(Client& client, size_t len) {
+	Client::Transaction &transaction = client.getTransaction();
+	if (len == 0) return "";
+
+	transaction.readBuf.resize(len);
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t rv = pread(transaction.fd, &transaction.readBuf[done], len - done, transaction.textPos + done);
+		if (rv < 0 && errno == EINTR) continue;
+
+		if (rv < 0) {
+			Logger::getInstance().checkError(-1, "CMDH", "could not read gcode from fd %i", transaction.fd);
+			return 0;
+		} else if (rv == 0) {
+			LOG(Logger::ERROR, "gcode file ended after %zu bytes, %zu more were expected", transaction.textPos + done, transaction.textLen - done);
+			return 0;
+		}
+		done += rv;
+	}
+
+	return &transaction.readBuf[0];
+}
+
+//static
+//points text into the command buffer, a terminating nul sent along by some clients is not included in len
+bool CommandHandler::getTextArg(const ipc_frame_s& frame, int argidx, const char** text, uint32_t* len) {
+	if (ipc_frame_get_arg(&frame, argidx, text, len) < 0) return false;
+	if (*len > 0 && (*text)[*len - 1] == '\0') (*len)--;
+	return true;
 }
@@ -17,9 +17,10 @@ class Client;
 
 class CommandHandler {
 public:
-	typedef void (*handler_func)(Client& client, const char* buf, int buflen);
+	typedef void (*handler_func)(Client& client, const ipc_frame_s& frame);
 
-	static void runCommand(Client& client, const char* buf, int buflen);
+	static void runCommand(Client& client, const ipc_frame_s& frame);
+	static bool continueIngest(Client& client, size_t maxBytes);
 
 private:
 	struct handlerFunctions {
@@ -34,16 +35,22 @@ private:
 	CommandHandler(const CommandHandler& o);
 	void operator=(const CommandHandler& o);
 
-	static void hnd_test(Client& client, const char* buf, int buflen);
-	static void hnd_getTemperature(Client& client, const char* buf, int buflen);
-	static void hnd_gcodeClear(Client& client, const char* buf, int buflen);
-	static void hnd_gcodeAppend(Client& client, const char* buf, int buflen);
-	static void hnd_gcodeAppendFile(Client& client, const char* buf, int buflen);
-	static void hnd_gcodeStartPrint(Client& client, const char* buf, int buflen);
-	static void hnd_gcodeStopPrint(Client& client, const char* buf, int buflen);
-	static void hnd_heatup(Client& client, const char* buf, int buflen);
-	static void hnd_getProgress(Client& client, const char* buf, int buflen);
-	static void hnd_getState(Client& client, const char* buf, int buflen);
+	static bool getTextArg(const ipc_frame_s& frame, int argidx, const char** text, uint32_t* len);
+	static void appendGCodeChunk(Client& client, const ipc_frame_s& frame, const char* text, uint32_t textLen, int fd = -1);
+	static const char* readGCode(Client& client, size_t len);
+
+	static void hnd_test(Client& client, const ipc_frame_s& frame);
+	static void hnd_getTemperature(Client& client, const ipc_frame_s& frame);
+	static void hnd_gcodeClear(Client& client, const ipc_frame_s& frame);
+	static void hnd_gcodeAppend(Client& client, const ipc_frame_s& frame);
+	static void hnd_gcodeAppendFile(Client& client, const ipc_frame_s& frame);
+	static void hnd_gcodeStartPrint(Client& client, const ipc_frame_s& frame);
+	static void hnd_gcodeStopPrint(Client& client, const ipc_frame_s& frame);
+	static void hnd_heatup(Client& client, const ipc_frame_s& frame);
+	static void hnd_getProgress(Client& client, const ipc_frame_s& frame);
+	static void hnd_getState(Client& client, const ipc_frame_s& frame);
+	static void hnd_getCapabilities(Client& client, const ipc_frame_s& frame);
+	static void hnd_gcodeAppendFd(Client& client, const ipc_frame_s& frame);
 };
 
 #endif /* ! COMMAND_HANDLER_H_SEEN */
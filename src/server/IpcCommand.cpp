@@ -0,0 +1,64 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#include "IpcCommand.h"
+#include "Logger.h"
+
+//NOTE: see Server.cpp for comments on this macro
+#define LOG(lvl, fmt, ...) Logger::getInstance().log(lvl, "IPCC", fmt, ##__VA_ARGS__)
+
+IpcCommand::IpcCommand(IPC_COMMAND_CODE code)
+: code_(code), numArgs_(0), valid_(true) { }
+
+IpcCommand& IpcCommand::addShort(int16_t value) {
+	return add(ipc_arg_short(value));
+}
+
+IpcCommand& IpcCommand::addLong(int32_t value) {
+	return add(ipc_arg_long(value));
+}
+
+IpcCommand& IpcCommand::addData(const char* data, uint32_t len) {
+	return add(ipc_arg_data(data, len));
+}
+
+IpcCommand& IpcCommand::addString(const std::string& text) {
+	return add(ipc_arg_data(text.data(), text.length()));
+}
+
+IPC_COMMAND_CODE IpcCommand::getCode() const {
+	return code_;
+}
+
+const ipc_arg_s* IpcCommand::getArgs() const {
+	return args_;
+}
+
+int IpcCommand::getNumArgs() const {
+	return numArgs_;
+}
+
+//a command is invalid if more than MAX_ARGS arguments were added to it
+bool IpcCommand::isValid() const {
+	return valid_;
+}
+
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+IpcCommand& IpcCommand::add(const ipc_arg_s& arg) {
+	if (numArgs_ < MAX_ARGS) {
+		args_[numArgs_++] = arg;
+	} else {
+		LOG(Logger::ERROR, "too many arguments for command 0x%x", code_);
+		valid_ = false;
+	}
+	return *this;
+}
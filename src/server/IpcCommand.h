@@ -0,0 +1,50 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ */
+
+#ifndef IPC_COMMAND_H_SEEN
+#define IPC_COMMAND_H_SEEN
+
+#include <string>
+#include "../ipc_shared.h"
+
+/*
+ * Collects the arguments of an IPC command without copying any data, to be encoded by Client::sendCommand().
+ * Unlike ipc_construct_cmd(), argument types are checked by the compiler: the add functions only accept
+ * their exact type, so e.g. an int has to be cast explicitly to be sent as a short.
+ * Data and strings are referenced, so they must stay valid until the command has been sent.
+ */
+class IpcCommand {
+public:
+	enum { MAX_ARGS = 8 };
+
+	explicit IpcCommand(IPC_COMMAND_CODE code);
+
+	IpcCommand& addShort(int16_t value);
+	IpcCommand& addLong(int32_t value);
+	IpcCommand& addData(const char* data, uint32_t len);
+	IpcCommand& addString(const std::string& text);
+
+	IPC_COMMAND_CODE getCode() const;
+	const ipc_arg_s* getArgs() const;
+	int getNumArgs() const;
+	bool isValid() const;
+
+private:
+	//not defined, these catch arguments which would otherwise be converted implicitly
+	template<typename T> IpcCommand& addShort(T value);
+	template<typename T> IpcCommand& addLong(T value);
+
+	IPC_COMMAND_CODE code_;
+	ipc_arg_s args_[MAX_ARGS];
+	int numArgs_;
+	bool valid_;
+
+	IpcCommand& add(const ipc_arg_s& arg);
+};
+
+#endif /* ! IPC_COMMAND_H_SEEN */
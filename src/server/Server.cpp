@@ -15,12 +15,17 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#ifdef __linux
+# include <sys/epoll.h>
+#endif
+#include <algorithm>
 #include <cstring>
 #include "Server.h"
 #include "Client.h"
 #include "Logger.h"
 #include "../settings.h"
 #include "../utils.h"
+#include "../Timer.h"
 #include "../drivers/DriverFactory.h"
 
 using std::string;
@@ -32,9 +37,12 @@ using std::string;
 const bool Server::FORK_BY_DEFAULT = false;
 const int Server::SOCKET_MAX_BACKLOG = 5; //private
 const int Server::SELECT_LOG_FAST_LOOP = -1;
+const int Server::EPOLL_MAX_EVENTS = 16;
+const double Server::INGEST_BUDGET = 2.0;
+const size_t Server::INGEST_SLICE_SIZE = 16 * 1024;
 
 Server::Server(const string& serialPortPath, const string& socketPath, const string& printerName) :
-		socketPath_(socketPath), log_(Logger::getInstance()), socketFd_(-1), printerDriver_(0)
+		socketPath_(socketPath), log_(Logger::getInstance()), socketFd_(-1), epollFd_(-1), printerDriver_(0)
 {
 	if (!settings_init()) LOG(Logger::ERROR, "could not initialize uci settings context");
 
@@ -63,6 +71,7 @@ Server::Server(const string& serialPortPath, const string& socketPath, const str
 }
 
 Server::~Server() {
+	if (epollFd_ >= 0) ::close(epollFd_);
 	closeSocket();
 	settings_deinit();
 }
@@ -95,6 +104,134 @@ int Server::start(bool fork) {
 
 	if (printerDriver_) printerDriver_->openConnection();
 
+#ifdef __linux
+	if (!runEpollLoop()) LOG(Logger::WARNING, "could not create epoll instance (%s), using select() instead", strerror(errno));
+#endif
+	runSelectLoop();
+
+	return 0;
+}
+
+
+/*
+ * Adds a file descriptor to the ones the server waits on. When it becomes readable, the driver is updated.
+ */
+bool Server::registerFileDescriptor(int fd) {
+	std::pair<set_int::iterator, bool> rv = registeredFds_.insert(fd);
+
+#ifdef __linux
+	if (rv.second && epollFd_ >= 0) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		log_.checkError(epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev), "SRV ", "could not add fd %i to epoll set", fd);
+	}
+#endif
+
+	return rv.second;
+}
+
+bool Server::unregisterFileDescriptor(int fd) {
+	if (registeredFds_.erase(fd) != 1) return false;
+
+#ifdef __linux
+	//the fd may have been closed already, which removes it from the epoll set by itself
+	if (epollFd_ >= 0) epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, NULL);
+#endif
+
+	return true;
+}
+
+
+void Server::cancelAllTransactions(const Client *exclude) {
+	if (exclude) LOG(Logger::VERBOSE, "cancelling all transactions except for fd %i (#clients: %i)", exclude->getFileDescriptor(), clients_.size());
+	else LOG(Logger::VERBOSE, "cancelling all transactions (#clients: %i)", clients_.size());
+
+	for (vec_ClientP::iterator it = clients_.begin(); it != clients_.end(); it++) {
+		if (exclude == *it) continue;
+		Client::Transaction &trx = (*it)->getTransaction();
+		trx.staging.clear();
+		trx.active = false;
+		trx.cancelled = true;
+	}
+}
+
+AbstractDriver* Server::getDriver() {
+	return printerDriver_;
+}
+
+const AbstractDriver* Server::getDriver() const {
+	return printerDriver_;
+}
+
+
+bool Server::requestExit(int rv) {
+	LOG(Logger::INFO, "server exiting (rv=%i)", rv);
+	closeSocket();
+	exit(rv);
+}
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+#ifdef __linux
+/*
+ * Waits for events using epoll, so only clients with data (or a closed connection) are serviced and the cost of
+ * an iteration does not depend on the number of connected clients. Returns false if epoll is not available,
+ * otherwise it does not return.
+ */
+bool Server::runEpollLoop() {
+	epollFd_ = epoll_create(EPOLL_MAX_EVENTS);
+	if (epollFd_ < 0) return false;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = socketFd_;
+	log_.checkError(epoll_ctl(epollFd_, EPOLL_CTL_ADD, socketFd_, &ev), "SRV ", "could not add socket to epoll set");
+
+	for (set_int::const_iterator it = registeredFds_.begin(); it != registeredFds_.end(); ++it) {
+		ev.data.fd = *it;
+		log_.checkError(epoll_ctl(epollFd_, EPOLL_CTL_ADD, *it, &ev), "SRV ", "could not add fd %i to epoll set", *it);
+	}
+
+	//the listening socket is non-blocking so pending connections can be accepted until there are none left
+	int flags = ::fcntl(socketFd_, F_GETFL, 0);
+	log_.checkError(flags < 0 ? flags : ::fcntl(socketFd_, F_SETFL, flags | O_NONBLOCK), "SRV ", "could not enable non-blocking mode on socket");
+
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	int timeout = 0;
+	while (true) {
+		int numEvents = ::epoll_wait(epollFd_, events, EPOLL_MAX_EVENTS, timeout);
+		if (numEvents < 0 && errno != EINTR) log_.checkError(numEvents, "SRV ", "error in epoll_wait()");
+
+		for (int i = 0; i < numEvents; i++) {
+			int fd = events[i].data.fd;
+
+			if (fd == socketFd_) {
+				int connFd;
+				while ((connFd = ::accept4(socketFd_, NULL, NULL, SOCK_NONBLOCK)) >= 0) addClient(connFd);
+				if (errno != EAGAIN && errno != EWOULDBLOCK) log_.checkError(-1, "SRV ", "could not accept connection");
+
+			} else if (fd < (int)clientsByFd_.size() && clientsByFd_[fd]) {
+				Client *client = clientsByFd_[fd];
+				if (!handleClientData(client)) closeClient(client);
+			}
+			//registered fds need no handling here, the driver is updated below anyway
+		}
+
+		timeout = updateDriver();
+		if (runIngest()) timeout = 0;
+	}
+
+	return true;
+}
+#endif
+
+/*
+ * Portable main loop, reading from all clients each time select() returns.
+ */
+void Server::runSelectLoop() {
 	fd_set masterFds;
 	fd_set readFds;
 	int maxFd = socketFd_;
@@ -106,15 +243,17 @@ int Server::start(bool fork) {
 	struct timeval startTime, endTime, diffTime;
 	while (true) {
 		readFds = masterFds;
+		int selectMaxFd = maxFd;
 		for (set_int::const_iterator it = registeredFds_.begin();
 				it != registeredFds_.end(); ++it) {
 			FD_SET(*it, &readFds);
+			if (*it > selectMaxFd) selectMaxFd = *it;
 		}
 		::gettimeofday(&startTime, NULL);
 
 		//LOG(Logger::BULK, "entering select(), maxfd=%i", maxFd);
 		if (log_.checkError(
-				::select(maxFd + 1, &readFds, NULL, NULL,
+				::select(selectMaxFd + 1, &readFds, NULL, NULL,
 						timeoutEnabled ? &timeout : NULL), /* use FD_SETSIZE instead of keeping maxfd? */
 				"SRV ", "error in select()")) {
 			//TODO: handle error (close down server <- needs function... and return with proper error value)
@@ -139,94 +278,129 @@ int Server::start(bool fork) {
 			log_.checkError(::fcntl(connFd, F_SETFL, (flags | O_NONBLOCK)), "SRV ",
 					"could not enable non-blocking mode on socket with fd ", connFd);
 
-			clients_.push_back(new Client(*this, connFd));
-			//LOG(Logger::BULK, "new client with fd %i", connFd);
+			addClient(connFd);
 
 			maxFd = (connFd > maxFd ? connFd : maxFd);
 			FD_SET(connFd, &masterFds);
 		}
 
-		for (vec_ClientP::iterator it = clients_.begin(); it != clients_.end();
-		/* increment inside loop */) {
-			Client* client = *it;
-			int rv = client->readData();
-			log_.checkError(rv, "SRV ", "cannot read from client");
-
-			if (rv >= 0 || (rv == -2 && client->getBufferSize() > 0)) {
-				if (rv >= 0) {
-					//LOG(Logger::BULK, "read %i bytes from client with fd %i", rv, client->getFileDescriptor());
-				} else {
-					LOG(Logger::WARNING, "client with fd %i closed connection, still %i bytes available", client->getFileDescriptor(), client->getBufferSize());
-				}
+		for (size_t i = 0; i < clients_.size(); /* increment inside loop */) {
+			Client* client = clients_[i];
 
-				client->runCommands();
-			}
-
-			if (rv == -2) {
-				//LOG(Logger::BULK, "connection closed from client with fd %i", client->getFileDescriptor());
-				::close(client->getFileDescriptor());
+			if (!handleClientData(client)) {
 				FD_CLR(client->getFileDescriptor(), &masterFds);
-				delete (client);
-				it = clients_.erase(it);
+				closeClient(client);
 			} else {
-				++it;
+				i++;
 			}
 		}
 
-		if (printerDriver_) {
-			int newTimeout = printerDriver_->update();
-			timeoutEnabled = (newTimeout >= 0) ? true : false;
+		int newTimeout = updateDriver();
+		if (runIngest()) newTimeout = 0;
+		timeoutEnabled = (newTimeout >= 0) ? true : false;
 
-			timeout.tv_sec = newTimeout / 1000;
-			timeout.tv_usec = (newTimeout % 1000) * 1000;
-		} else {
-			timeoutEnabled = false;
-		}
+		timeout.tv_sec = newTimeout / 1000;
+		timeout.tv_usec = (newTimeout % 1000) * 1000;
 	}
-
-	return 0;
 }
 
+//returns the time in ms until the driver wants to be updated again, or -1 if it does not need to be
+int Server::updateDriver() {
+	if (!printerDriver_) return -1;
 
-bool Server::registerFileDescriptor(int fd) {
-	std::pair<set_int::iterator, bool> rv = registeredFds_.insert(fd);
-	return rv.second;
+	int timeout = printerDriver_->update();
+	return (timeout >= 0) ? timeout : -1;
 }
 
-bool Server::unregisterFileDescriptor(int fd) {
-	return (registeredFds_.erase(fd) == 1);
+/*
+ * Stages gcode received by clients a slice at a time, for about INGEST_BUDGET ms. This runs after the driver
+ * has been updated, so a large upload is spread over loop iterations instead of holding up the printer.
+ * Returns true if there is gcode left to stage.
+ */
+bool Server::runIngest() {
+	Timer timer;
+	bool pending;
+
+	timer.start();
+	do {
+		pending = false;
+		for (size_t i = 0; i < clients_.size(); i++) {
+			Client *client = clients_[i];
+			if (!client->isIngesting()) continue;
+
+			client->continueIngest(INGEST_SLICE_SIZE);
+			if (client->isIngesting()) pending = true;
+		}
+	} while (pending && timer.getElapsedTimeInMilliSec() < INGEST_BUDGET);
+
+	return pending;
 }
 
+void Server::addClient(int fd) {
+	Client *client = new Client(*this, fd);
+	clients_.push_back(client);
+	//LOG(Logger::BULK, "new client with fd %i", fd);
 
-void Server::cancelAllTransactions(const Client *exclude) {
-	if (exclude) LOG(Logger::VERBOSE, "cancelling all transactions except for fd %i (#clients: %i)", exclude->getFileDescriptor(), clients_.size());
-	else LOG(Logger::VERBOSE, "cancelling all transactions (#clients: %i)", clients_.size());
+	if (fd >= (int)clientsByFd_.size()) clientsByFd_.resize(fd + 1, 0);
+	clientsByFd_[fd] = client;
 
-	for (vec_ClientP::iterator it = clients_.begin(); it != clients_.end(); it++) {
-		if (exclude == *it) continue;
-		Client::Transaction &trx = (*it)->getTransaction();
-		trx.cancelled = true;
+#ifdef __linux
+	if (epollFd_ >= 0) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		log_.checkError(epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev), "SRV ", "could not add client with fd %i to epoll set", fd);
 	}
+#endif
 }
 
-AbstractDriver* Server::getDriver() {
-	return printerDriver_;
-}
+/*
+ * Reads available data and runs any complete commands. Returns false if the client closed the connection
+ * or has to be closed.
+ */
+bool Server::handleClientData(Client *client) {
+	int rv = client->readData();
+	log_.checkError(rv, "SRV ", "cannot read from client");
 
-const AbstractDriver* Server::getDriver() const {
-	return printerDriver_;
-}
+	if (rv == -3) {
+		LOG(Logger::WARNING, "client with fd %i sent a command larger than %u bytes, closing connection",
+				client->getFileDescriptor(), Client::MAX_FRAME_SIZE);
+		return false;
+	}
+
+	if (rv >= 0 || (rv == -2 && client->getBufferSize() > 0)) {
+		if (rv >= 0) {
+			//LOG(Logger::BULK, "read %i bytes from client with fd %i", rv, client->getFileDescriptor());
+		} else {
+			LOG(Logger::WARNING, "client with fd %i closed connection, still %i bytes available", client->getFileDescriptor(), client->getBufferSize());
+		}
 
+		client->runCommands();
+	}
 
-bool Server::requestExit(int rv) {
-	LOG(Logger::INFO, "server exiting (rv=%i)", rv);
-	closeSocket();
-	exit(rv);
+	//the client is closed after this, so gcode it sent last has to be staged (and the commands behind it run) now
+	if (rv == -2 && client->isIngesting()) {
+		LOG(Logger::VERBOSE, "client with fd %i closed connection while gcode is being ingested, finishing it first", client->getFileDescriptor());
+		client->finishIngest(INGEST_SLICE_SIZE);
+	}
+
+	return rv != -2;
 }
 
-/*********************
- * PRIVATE FUNCTIONS *
- *********************/
+void Server::closeClient(Client *client) {
+	int fd = client->getFileDescriptor();
+	//LOG(Logger::BULK, "connection closed from client with fd %i", fd);
+
+#ifdef __linux
+	if (epollFd_ >= 0) epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, NULL);
+#endif
+	::close(fd);
+
+	if (fd < (int)clientsByFd_.size()) clientsByFd_[fd] = 0;
+	vec_ClientP::iterator it = std::find(clients_.begin(), clients_.end(), client);
+	if (it != clients_.end()) clients_.erase(it);
+	delete client;
+}
 
 bool Server::openSocket() {
 	int rv;
@@ -256,6 +430,8 @@ bool Server::openSocket() {
 }
 
 bool Server::closeSocket() {
+	if (socketFd_ < 0) return true; //never opened (e.g. when the driver is used without the server loop)
+
 	if (log_.checkError(close(socketFd_), "SRV ", "could not close domain socket"))
 		return -1;
 	socketFd_ = -1;
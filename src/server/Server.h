@@ -43,6 +43,9 @@ public:
 private:
 	static const int SOCKET_MAX_BACKLOG;
 	static const int SELECT_LOG_FAST_LOOP; ///A message will be logged if select returns quicker than this threshold (-1 to disable)
+	static const int EPOLL_MAX_EVENTS;
+	static const double INGEST_BUDGET; ///Time in ms spent on staging gcode per loop iteration (at least one slice is staged)
+	static const size_t INGEST_SLICE_SIZE;
 
 	Server(const Server& o);
 	void operator=(const Server& o);
@@ -51,16 +54,26 @@ private:
 
 	const Logger& log_;
 	int socketFd_;
+	int epollFd_; //-1 unless the epoll loop is running
 	set_int registeredFds_;
 	AbstractDriver* printerDriver_;
 
 	vec_ClientP clients_;
+	vec_ClientP clientsByFd_; //clients indexed by file descriptor, for the epoll loop
 
 	bool openSocket();
 	bool closeSocket();
 	int forkProcess();
 	int openPort();
 
+	bool runEpollLoop();
+	void runSelectLoop();
+	int updateDriver();
+	bool runIngest();
+	void addClient(int fd);
+	bool handleClientData(Client *client);
+	void closeClient(Client *client);
+
 	int driverDelay;
 };
 
@@ -41,6 +41,8 @@ static struct option long_options[] = {
 		{"device", required_argument, NULL, 'd'},
 		{"printer", required_argument, NULL, 'p'},
 		{"use-settings", required_argument, NULL, 'u'},
+		{"trace-serial", required_argument, NULL, 't'},
+		{"reconnect", no_argument, NULL, 'r'},
 		{NULL, 0, NULL, 0}
 };
 
@@ -48,14 +50,16 @@ static struct option long_options[] = {
 int main(int argc, char** argv) {
 	string serialDevice = "";
 	string printerName = "";
+	string traceFile = "";
 	int doFork = 0; //-1: don't fork, 0: leave default, 1: do fork
 	bool showHelp = false, forceStart = false;
 	Logger::ELOG_LEVEL logLevel = Logger::WARNING;
 	bool logLevelFromCmdLine = false;
 	bool useUci = false;
+	bool reconnect = false;
 	int ch;
 
-	while ((ch = getopt_long(argc, argv, "hqvfFSd:p:u", long_options, NULL)) != -1) {
+	while ((ch = getopt_long(argc, argv, "hqvfFSd:p:ut:r", long_options, NULL)) != -1) {
 		switch (ch) {
 			case 'h': showHelp = true; break;
 			case 'q':
@@ -76,6 +80,8 @@ int main(int argc, char** argv) {
 			case 'd': serialDevice = optarg; break;
 			case 'p': printerName = optarg; break;
 			case 'u': useUci = true; break;
+			case 't': traceFile = optarg; break;
+			case 'r': reconnect = true; break;
 
 			case ':': case '?':
 				::exit(1);
@@ -106,6 +112,8 @@ int main(int argc, char** argv) {
 		printf("\t-d,--device\t\tThe printer serial device to use (any prefix path will be cut off)\n");
 		printf("\t-p,--printer\t\tThe 3D printer driver to use (use help to get more information)\n");
 		printf("\t-u,--use-settings\tRead log target and level from (UCI) settings\n");
+		printf("\t-t,--trace-serial\tCapture all serial traffic to the given file (see print3d-replay)\n");
+		printf("\t-r,--reconnect\t\tWait for the device to return when it disappears instead of exiting\n");
 		::exit(0);
 	}
 
@@ -220,6 +228,12 @@ int main(int argc, char** argv) {
 		::exit(1);
 	}
 
+	if (!traceFile.empty() && s.getDriver()->setSerialCapture(traceFile) < 0) {
+		::exit(1);
+	}
+
+	s.getDriver()->setReconnectEnabled(reconnect);
+
 	int rv;
 
 	if (doFork == 0) rv = s.start();
@@ -0,0 +1,277 @@
+/*
+ * This file is part of the Doodle3D project (http://doodle3d.com).
+ *
+ * Copyright (c) 2013-2014, Doodle3D
+ * This software is licensed under the terms of the GNU GPL v2 or later.
+ * See file LICENSE.txt or visit http://www.gnu.org/licenses/gpl.html for full license details.
+ *
+ *
+ * Replays a serial trace captured with 'print3d -t <file>' against a driver, without a printer.
+ *
+ * A pseudo terminal takes the place of the printer: the driver is connected to its slave end,
+ * while this tool plays the printer on the master end. Data the printer sent (read records) is
+ * written to the driver, but only after everything the driver sent before that point in the
+ * original session (write records) has been sent again. This keeps cause and effect intact
+ * (e.g. an 'ok' is only given after a line has been sent), while the recorded idle time is
+ * skipped (or scaled with -s), so sessions are replayed faster than real time.
+ * Data sent by the driver is compared with the recorded data and differences are counted.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include "Logger.h"
+#include "Server.h"
+#include "../utils.h"
+#include "../drivers/SerialTrace.h"
+#include <termios.h> /* after the driver headers, its baud rate macros clash with AbstractDriver::BAUDRATE */
+
+using std::string;
+
+#define LOG(lvl, fmt, ...) log.log(lvl, "RPLY", fmt, ##__VA_ARGS__)
+
+static const int DEFAULT_WRITE_TIMEOUT = 10 * 1000; //how long to wait for the driver to send recorded data (in ms)
+static const int DRAIN_TIME = 500; //how long to keep the driver running after the last record (in ms)
+
+static struct option long_options[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"verbose", no_argument, NULL, 'v'},
+		{"printer", required_argument, NULL, 'p'},
+		{"gcode", required_argument, NULL, 'g'},
+		{"speed", required_argument, NULL, 's'},
+		{"timeout", required_argument, NULL, 't'},
+		{NULL, 0, NULL, 0}
+};
+
+static int openPseudoTerminal(int *masterFd, int *slaveFd, string &slaveName) {
+	*masterFd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (*masterFd < 0 || grantpt(*masterFd) < 0 || unlockpt(*masterFd) < 0) return -1;
+
+	slaveName = ptsname(*masterFd);
+
+	//keep the slave end open ourselves so the master does not see a hangup when the driver reconnects
+	*slaveFd = ::open(slaveName.c_str(), O_RDWR | O_NOCTTY);
+	if (*slaveFd < 0) return -1;
+
+	struct termios options;
+	if (tcgetattr(*slaveFd, &options) < 0) return -1;
+	cfmakeraw(&options);
+	if (tcsetattr(*slaveFd, TCSANOW, &options) < 0) return -1;
+
+	int flags = fcntl(*masterFd, F_GETFL, 0);
+	if (flags < 0 || fcntl(*masterFd, F_SETFL, flags | O_NONBLOCK) < 0) return -1;
+
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	string printerName = "", gcodeFile = "";
+	float speed = 0.0f;
+	int writeTimeout = DEFAULT_WRITE_TIMEOUT;
+	Logger::ELOG_LEVEL logLevel = Logger::WARNING;
+	bool showHelp = false;
+	int ch;
+
+	while ((ch = getopt_long(argc, argv, "hvp:g:s:t:", long_options, NULL)) != -1) {
+		switch (ch) {
+			case 'h': showHelp = true; break;
+			case 'v':
+				if (logLevel < Logger::VERBOSE) logLevel = Logger::VERBOSE;
+				else if (logLevel < Logger::BULK) logLevel = Logger::BULK;
+				break;
+			case 'p': printerName = optarg; break;
+			case 'g': gcodeFile = optarg; break;
+			case 's': speed = atof(optarg); break;
+			case 't': writeTimeout = atoi(optarg); break;
+
+			case ':': case '?':
+				::exit(1);
+		}
+	}
+
+	if (showHelp || optind != argc - 1 || printerName.empty()) {
+		printf("Usage: %s [options] -p <printer> <trace file>\n", argv[0]);
+		printf("\t-h,--help\t\tDisplay this help message\n");
+		printf("\t-v,--verbose\t\tLog verbose (repeat for bulk)\n");
+		printf("\t-p,--printer\t\tThe 3D printer driver to use (as with print3d)\n");
+		printf("\t-g,--gcode\t\tGCode file to load and print once the printer is online\n");
+		printf("\t-s,--speed\t\tReplay at this factor of the recorded speed (default: 0, i.e. as fast as possible)\n");
+		printf("\t-t,--timeout\t\tTime in ms to wait for the driver to send recorded data (default: %i)\n", DEFAULT_WRITE_TIMEOUT);
+		::exit(showHelp ? 0 : 1);
+	}
+
+	Logger& log = Logger::getInstance();
+	log.open(stderr, logLevel);
+
+	SerialTrace trace;
+	int rv = trace.openForReading(argv[optind]);
+	if (rv < 0) {
+		fprintf(stderr, "Error: could not open trace file '%s' (%s)\n", argv[optind], rv == -1 ? strerror(errno) : "not a trace file");
+		::exit(1);
+	}
+
+	int masterFd = -1, slaveFd = -1;
+	string slaveName;
+	if (openPseudoTerminal(&masterFd, &slaveFd, slaveName) < 0) {
+		fprintf(stderr, "Error: could not create pseudo terminal (%s)\n", strerror(errno));
+		::exit(1);
+	}
+	LOG(Logger::INFO, "replaying '%s' on '%s'", argv[optind], slaveName.c_str());
+
+	char *socketPath = 0;
+	asprintf(&socketPath, "/tmp/print3d-replay-%i", getpid());
+	Server server(slaveName, socketPath, printerName);
+	free(socketPath);
+
+	AbstractDriver *driver = server.getDriver();
+	if (!driver) {
+		fprintf(stderr, "Error: could not create printer driver for '%s'\n", printerName.c_str());
+		::exit(1);
+	}
+
+	if (!gcodeFile.empty()) {
+		int size = 0;
+		char *data = readFileContents(gcodeFile.c_str(), &size);
+		if (!data) {
+			fprintf(stderr, "Error: could not read gcode file '%s' (%s)\n", gcodeFile.c_str(), strerror(errno));
+			::exit(1);
+		}
+		driver->appendGCode(string(data, size));
+		free(data);
+	}
+
+	if (driver->openConnection() < 0) {
+		fprintf(stderr, "Error: could not open pseudo terminal slave '%s'\n", slaveName.c_str());
+		::exit(1);
+	}
+
+	SerialTrace::Record record;
+	bool haveRecord = false, traceDone = false, printStarted = gcodeFile.empty();
+	uint64_t startTime = getMicros(), lastProgress = startTime, lastFeed = startTime;
+	uint64_t prevRecordTime = 0, lastRecordTime = 0, drainStart = 0;
+	string received; //data sent by the driver which has not been matched against write records yet
+	long numReads = 0, numWrites = 0, numMismatches = 0, numTimeouts = 0, bytesFed = 0, bytesMatched = 0;
+	uint64_t totalLatency = 0, maxLatency = 0;
+	int driverTimeout = 0;
+
+	while (true) {
+		if (!haveRecord && !traceDone) {
+			rv = trace.readNext(record);
+			if (rv < 0) LOG(Logger::ERROR, "trace file is truncated or unreadable, stopping replay");
+			if (rv <= 0) traceDone = true;
+			else haveRecord = true;
+		}
+
+		uint64_t now = getMicros();
+		int pollTimeout = driverTimeout;
+
+		if (haveRecord) {
+			switch (record.type) {
+			case SerialTrace::RT_READ: {
+				uint64_t due = lastFeed + (uint64_t)((record.timestamp - prevRecordTime) * speed);
+				if (now >= due) {
+					if (::write(masterFd, record.data.data(), record.data.size()) < (ssize_t)record.data.size())
+						LOG(Logger::WARNING, "short write to pseudo terminal");
+					numReads++;
+					bytesFed += record.data.size();
+					lastFeed = lastProgress = now;
+					haveRecord = false;
+					pollTimeout = 0;
+				} else {
+					int remaining = (due - now) / 1000 + 1;
+					if (pollTimeout < 0 || remaining < pollTimeout) pollTimeout = remaining;
+				}
+				break;
+			}
+			case SerialTrace::RT_WRITE:
+				if (received.size() >= record.data.size()) {
+					if (received.compare(0, record.data.size(), record.data) != 0) {
+						numMismatches++;
+						LOG(Logger::VERBOSE, "driver sent different data than recorded (expected '%s', got '%s')",
+								record.data.c_str(), received.substr(0, record.data.size()).c_str());
+					} else {
+						bytesMatched += record.data.size();
+					}
+					received.erase(0, record.data.size());
+
+					uint64_t latency = now - lastFeed;
+					totalLatency += latency;
+					if (latency > maxLatency) maxLatency = latency;
+					numWrites++;
+					lastProgress = now;
+					haveRecord = false;
+					pollTimeout = 0;
+				} else if (now - lastProgress > (uint64_t)writeTimeout * 1000) {
+					LOG(Logger::WARNING, "driver did not send %zu recorded bytes within %i ms, skipping record", record.data.size(), writeTimeout);
+					numTimeouts++;
+					received.clear();
+					lastProgress = now;
+					haveRecord = false;
+				}
+				break;
+			case SerialTrace::RT_SPEED:
+				LOG(Logger::VERBOSE, "recorded speed change to %u", read_nl(record.data.data()));
+				haveRecord = false;
+				pollTimeout = 0;
+				break;
+			default:
+				LOG(Logger::WARNING, "skipping record with unknown type 0x%02x", record.type);
+				haveRecord = false;
+				break;
+			}
+
+			if (!haveRecord) {
+				prevRecordTime = lastRecordTime = record.timestamp;
+			}
+		} else if (traceDone) {
+			//give the driver some time to process the last data before stopping
+			if (drainStart == 0) drainStart = now;
+			else if (now - drainStart > (uint64_t)DRAIN_TIME * 1000) break;
+			if (pollTimeout < 0 || pollTimeout > DRAIN_TIME) pollTimeout = DRAIN_TIME;
+		}
+
+		struct pollfd pfds[2];
+		pfds[0].fd = masterFd; pfds[0].events = POLLIN; pfds[0].revents = 0;
+		pfds[1].fd = slaveFd; pfds[1].events = POLLIN; pfds[1].revents = 0;
+		//only wait for the driver's own input when it is not being serviced anyway
+		if (pollTimeout != 0) poll(pfds, 2, pollTimeout < 0 ? 1000 : pollTimeout);
+
+		char buf[1024];
+		ssize_t len;
+		while ((len = ::read(masterFd, buf, sizeof(buf))) > 0) received.append(buf, len);
+
+		driverTimeout = driver->update();
+
+		if (!printStarted) {
+			AbstractDriver::STATE s = driver->getState();
+			if (s == AbstractDriver::IDLE || s == AbstractDriver::BUFFERING) {
+				LOG(Logger::INFO, "printer online, starting print");
+				printStarted = driver->startPrint();
+			}
+		}
+	}
+
+	double replayDuration = ((drainStart ? drainStart : getMicros()) - startTime) / 1000000.0;
+	double recordedDuration = lastRecordTime / 1000000.0;
+
+	printf("replay finished in %.3fs (recorded: %.3fs, speedup: %.1fx)\n",
+			replayDuration, recordedDuration, replayDuration > 0 ? recordedDuration / replayDuration : 0.0);
+	printf("fed %li read records (%li bytes), matched %li write records (%li bytes, %.1f bytes/s)\n",
+			numReads, bytesFed, numWrites, bytesMatched, replayDuration > 0 ? bytesMatched / replayDuration : 0.0);
+	printf("driver response latency: avg %.3f ms, max %.3f ms\n",
+			numWrites > 0 ? totalLatency / 1000.0 / numWrites : 0.0, maxLatency / 1000.0);
+	printf("mismatches: %li, timeouts: %li, driver state: %s\n",
+			numMismatches, numTimeouts, AbstractDriver::getStateString(driver->getState()).c_str());
+
+	driver->closeConnection();
+	close(slaveFd);
+	close(masterFd);
+
+	return (numMismatches == 0 && numTimeouts == 0) ? 0 : 2;
+}
@@ -0,0 +1,302 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <string>
+#include <vector>
+#include <fructose/fructose.h>
+#include "../../server/Client.h"
+#include "../../server/CommandHandler.h"
+#include "../../server/Server.h"
+#include "../../drivers/AbstractDriver.h"
+
+using std::string;
+
+struct t_CommandHandler : public fructose::test_base<t_CommandHandler> {
+	t_CommandHandler()
+	: server_("", "", "marlin_generic")
+	{}
+
+	/*
+	 * Sends a gcode transaction of two chunks followed by two other commands and ingests the chunks in slices
+	 * (far smaller than the server's), with lines crossing slice and chunk boundaries. The staged gcode must be
+	 * the same as when added at once, and the commands behind it must only run (in order) once it is done.
+	 */
+	void testSlicedIngest(const string& test_name) {
+		const size_t SLICE = 100;
+		AbstractDriver *driver = server_.getDriver();
+		fructose_assert(driver != NULL);
+
+		string gcode;
+		for (int i = 0; i < 300; i++) {
+			char line[40];
+			snprintf(line, sizeof(line), (i % 7) ? "G1 X%i Y%i\n" : "G1 X%i Y%i ; comment\n", i, 3 * i);
+			gcode += line;
+		}
+		size_t split = gcode.length() / 2 + 3;
+		const string chunk1 = gcode.substr(0, split), chunk2 = gcode.substr(split);
+		fructose_assert(chunk1[SLICE - 1] != '\n');
+		fructose_assert(chunk1[chunk1.length() - 1] != '\n');
+
+		int fds[2];
+		fructose_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+		Client *client = new Client(server_, fds[0]);
+
+		string sent;
+		appendCommand(sent, IPC_CMDQ_GCODE_APPEND, 1, chunk1, TRX_FIRST_CHUNK_BIT);
+		appendCommand(sent, IPC_CMDQ_GCODE_APPEND, 2, chunk2, TRX_LAST_CHUNK_BIT);
+		appendCommand(sent, IPC_CMDQ_TEST, 3, "q", -1);
+		appendCommand(sent, IPC_CMDQ_GET_STATE, 4, "", -1);
+		fructose_assert_eq(write(fds[1], sent.data(), sent.length()), (ssize_t)sent.length());
+
+		while (client->getBufferSize() < (int)sent.length() && client->readData() > 0) {}
+		client->runCommands();
+		fructose_assert(client->isIngesting());
+		fructose_assert_eq(readReplies(fds[1]).size(), (size_t)0);
+
+		//the first chunk is staged in slices; once it has been replied to, its text must be staged as if at once
+		GCodeBuffer reference;
+		GCodeBuffer::Staging referenceStaging;
+		reference.stage(referenceStaging, chunk1.data(), chunk1.length());
+
+		int slices = 0;
+		std::vector<uint32_t> replies;
+		while (replies.empty() && client->isIngesting()) {
+			client->continueIngest(SLICE);
+			slices++;
+			replies = readReplies(fds[1]);
+		}
+		fructose_assert_eq(slices, (int)((chunk1.length() + SLICE - 1) / SLICE));
+		fructose_assert_eq(replies.size(), (size_t)1);
+		fructose_assert_eq(replies[0], 1U);
+
+		const GCodeBuffer::Staging &staging = client->getTransaction().staging;
+		fructose_assert_eq(staging.getLines(), referenceStaging.getLines());
+		fructose_assert_eq(staging.getSize(), referenceStaging.getSize());
+		fructose_assert_eq(joinParts(staging), joinParts(referenceStaging));
+		fructose_assert_eq(driver->getBufferedLines(), 0);
+
+		//the second chunk completes the transaction, after which the remaining commands are run
+		fructose_assert(client->isIngesting());
+		while (client->isIngesting()) client->continueIngest(SLICE);
+
+		replies = readReplies(fds[1]);
+		fructose_assert_eq(replies.size(), (size_t)3);
+		for (size_t i = 0; i < replies.size(); i++) fructose_assert_eq(replies[i], (uint32_t)(i + 2));
+
+		reference.append(gcode);
+		fructose_assert_eq(driver->getBufferedLines(), reference.getBufferedLines());
+		fructose_assert_eq(driver->getBufferSize(), reference.getBufferSize());
+		fructose_assert_eq(client->getBufferSize(), 0);
+
+		delete client;
+		close(fds[0]);
+		close(fds[1]);
+	}
+
+	//a client closing its connection right after the last chunk must still have all of it committed and its commands run
+	void testCloseAfterLastChunk(const string& test_name) {
+		const size_t SLICE = 100;
+		AbstractDriver *driver = server_.getDriver();
+		driver->clearGCode();
+
+		string gcode;
+		for (int i = 0; i < 50; i++) {
+			char line[16];
+			snprintf(line, sizeof(line), "G1 X%i\n", i);
+			gcode += line;
+		}
+
+		int fds[2];
+		fructose_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+		Client *client = new Client(server_, fds[0]);
+
+		string sent;
+		appendCommand(sent, IPC_CMDQ_GCODE_APPEND, 1, gcode.substr(0, 150), TRX_FIRST_CHUNK_BIT);
+		appendCommand(sent, IPC_CMDQ_GCODE_APPEND, 2, gcode.substr(150), TRX_LAST_CHUNK_BIT);
+		appendCommand(sent, IPC_CMDQ_GET_STATE, 3, "", -1);
+		fructose_assert_eq(write(fds[1], sent.data(), sent.length()), (ssize_t)sent.length());
+		shutdown(fds[1], SHUT_WR);
+
+		//like Server::handleClientData() does once the connection has been closed
+		int rv;
+		while ((rv = client->readData()) > 0) {}
+		fructose_assert_eq(rv, -2);
+		client->runCommands();
+		fructose_assert(client->isIngesting());
+		client->finishIngest(SLICE);
+		fructose_assert(!client->isIngesting());
+
+		std::vector<uint32_t> replies = readReplies(fds[1]);
+		fructose_assert_eq(replies.size(), (size_t)3);
+		for (size_t i = 0; i < replies.size(); i++) fructose_assert_eq(replies[i], (uint32_t)(i + 1));
+		fructose_assert_eq(driver->getBufferedLines(), 50);
+		fructose_assert_eq(driver->getBufferSize(), (int32_t)gcode.length());
+		fructose_assert_eq(client->getBufferSize(), 0);
+
+		delete client;
+		close(fds[0]);
+		close(fds[1]);
+	}
+
+	//a file passed by descriptor which is truncated while it is being ingested must be refused, not crash the server
+	void testTruncatedFd(const string& test_name) {
+		const size_t SLICE = 100;
+		AbstractDriver *driver = server_.getDriver();
+		driver->clearGCode();
+
+		string gcode;
+		for (int i = 0; i < 100; i++) gcode += "G1 X10 Y10\n";
+
+		char path[] = "/tmp/t_commandhandler-XXXXXX";
+		int fileFd = mkstemp(path);
+		fructose_assert(fileFd >= 0);
+		unlink(path);
+		fructose_assert_eq(write(fileFd, gcode.data(), gcode.length()), (ssize_t)gcode.length());
+
+		int fds[2];
+		fructose_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+		Client *client = new Client(server_, fds[0]);
+
+		ipc_arg_s args[] = { ipc_arg_long((int32_t)gcode.length()), ipc_arg_short(TRX_FIRST_CHUNK_BIT | TRX_LAST_CHUNK_BIT) };
+		uint32_t requestId = 1;
+		char cmd[64];
+		int len = ipc_cmd_encode(cmd, sizeof(cmd), IPC_CMDQ_GCODE_APPEND_FD, &requestId, args, 2);
+		fructose_assert(len > 0);
+		fructose_assert_eq(sendWithFd(fds[1], cmd, len, fileFd), (ssize_t)len);
+
+		fructose_assert_eq(client->readData(), len);
+		client->runCommands();
+		fructose_assert(client->isIngesting());
+		client->continueIngest(SLICE);
+		fructose_assert(client->isIngesting());
+
+		fructose_assert_eq(ftruncate(fileFd, SLICE + 10), 0);
+		while (client->isIngesting()) client->continueIngest(SLICE);
+
+		std::vector<uint32_t> replies = readReplies(fds[1], IPC_CMDR_ERROR);
+		fructose_assert_eq(replies.size(), (size_t)1);
+		fructose_assert_eq(driver->getBufferedLines(), 0);
+		fructose_assert_eq(client->getTransaction().staging.getSize(), 0);
+
+		delete client;
+		close(fds[0]);
+		close(fds[1]);
+		close(fileFd);
+	}
+
+	//the same goes for a file given by path, which is read while being uploaded as well
+	void testTruncatedFile(const string& test_name) {
+		const size_t SLICE = 100;
+		AbstractDriver *driver = server_.getDriver();
+		driver->clearGCode();
+
+		string gcode;
+		for (int i = 0; i < 100; i++) gcode += "G1 X10 Y10\n";
+
+		char path[] = "/tmp/t_commandhandler-XXXXXX";
+		int fileFd = mkstemp(path);
+		fructose_assert(fileFd >= 0);
+		fructose_assert_eq(write(fileFd, gcode.data(), gcode.length()), (ssize_t)gcode.length());
+		close(fileFd);
+
+		int fds[2];
+		fructose_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+		Client *client = new Client(server_, fds[0]);
+
+		string sent;
+		appendCommand(sent, IPC_CMDQ_GCODE_APPEND_FILE, 1, path, -1);
+		fructose_assert_eq(write(fds[1], sent.data(), sent.length()), (ssize_t)sent.length());
+
+		fructose_assert_eq(client->readData(), (int)sent.length());
+		client->runCommands();
+		client->continueIngest(SLICE);
+		fructose_assert(client->isIngesting());
+
+		fructose_assert_eq(truncate(path, SLICE + 10), 0);
+		while (client->isIngesting()) client->continueIngest(SLICE);
+
+		fructose_assert_eq(readReplies(fds[1], IPC_CMDR_ERROR).size(), (size_t)1);
+		fructose_assert_eq(driver->getBufferedLines(), 0);
+
+		delete client;
+		close(fds[0]);
+		close(fds[1]);
+		unlink(path);
+	}
+
+private:
+	Server server_;
+
+	static ssize_t sendWithFd(int sock, const char* buf, size_t len, int fd) {
+		union {
+			struct cmsghdr align;
+			char buf[CMSG_SPACE(sizeof(int))];
+		} control;
+		struct iovec iov = { (void*)buf, len };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+		return sendmsg(sock, &msg, 0);
+	}
+
+	//adds a command with a request ID and a data argument, followed by the transaction flags unless they are negative
+	static void appendCommand(string& buf, IPC_COMMAND_CODE code, uint32_t requestId, const string& data, int flags) {
+		ipc_arg_s args[] = { ipc_arg_data(data.data(), data.length()), ipc_arg_short((int16_t)flags) };
+		int numArgs = (flags >= 0) ? 2 : 1;
+		std::vector<char> cmd(ipc_cmd_encoded_len(args, numArgs) + 4);
+
+		int len = ipc_cmd_encode(&cmd[0], cmd.size(), code, &requestId, args, numArgs);
+		if (len > 0) buf.append(&cmd[0], len);
+	}
+
+	//returns the request IDs of all replies available, which must all have the given code
+	std::vector<uint32_t> readReplies(int fd, IPC_COMMAND_CODE code = IPC_CMDR_OK) {
+		std::vector<uint32_t> ids;
+		string data;
+		char buf[1024];
+		ssize_t rv;
+
+		while ((rv = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) data.append(buf, rv);
+		fructose_assert(rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+
+		ipc_frame_s frame;
+		int len;
+		while ((len = ipc_cmd_parse(data.data(), data.length(), &frame)) > 0) {
+			fructose_assert_eq(frame.code, code);
+			ids.push_back(frame.request_id);
+			data.erase(0, len);
+		}
+		fructose_assert(data.empty());
+
+		return ids;
+	}
+
+	static string joinParts(const GCodeBuffer::Staging& staging) {
+		string all;
+		for (size_t i = 0; i < staging.getNumParts(); i++) all += staging.getPart(i);
+		return all;
+	}
+};
+
+int main(int argc, char** argv) {
+	t_CommandHandler tests;
+	tests.add_test("slicedIngest", &t_CommandHandler::testSlicedIngest);
+	tests.add_test("closeAfterLastChunk", &t_CommandHandler::testCloseAfterLastChunk);
+	tests.add_test("truncatedFd", &t_CommandHandler::testTruncatedFd);
+	tests.add_test("truncatedFile", &t_CommandHandler::testTruncatedFile);
+	return tests.run(argc, argv);
+}
@@ -1,3 +1,5 @@
+#include <stdio.h>
+#include <string.h>
 #include <string>
 #include <fructose/fructose.h>
 #include "../../drivers/GCodeBuffer.h"
@@ -347,6 +349,150 @@ struct t_GCodeBuffer : public fructose::test_base<t_GCodeBuffer> {
 		fructose_assert_eq(buffer.getTotalLines(), 0);
 		fructose_assert_eq(buffer.getTotalLinesSent(), 0);
 	}
+
+	//staged gcode only becomes part of the buffer once committed, and is cleaned like appended gcode
+	void testStageCommit(const string& test_name) {
+		GCodeBuffer buffer;
+		GCodeBuffer::Staging staging;
+		const string chunk1 = "G1 X1 ; move\nG1 X2\r\n", chunk2 = ";only a comment\nM104 S200\n";
+		const char *expected[] = { "G28", "G1 X1 ", "G1 X2", "M104 S200" };
+
+		buffer.append("G28\n");
+
+		fructose_assert_eq(buffer.stage(staging, chunk1.data(), chunk1.length()), GCodeBuffer::GSR_OK);
+		fructose_assert_eq(buffer.stage(staging, chunk2.data(), chunk2.length()), GCodeBuffer::GSR_OK);
+		fructose_assert_eq(staging.getLines(), 3);
+		fructose_assert_eq(buffer.getBufferedLines(), 1);
+		fructose_assert_eq(buffer.getTotalLinesSent(), 1);
+
+		fructose_assert_eq(buffer.commit(staging), GCodeBuffer::GSR_OK);
+		fructose_assert_eq(staging.getLines(), 0);
+		fructose_assert_eq(staging.getSize(), 0);
+
+		assertContents(buffer, expected, 4);
+		fructose_assert_eq(buffer.getTotalLinesSent(), 4);
+	}
+
+	//a line split over chunks is cleaned and counted once it is complete, or when committing
+	void testStageSplitLine(const string& test_name) {
+		GCodeBuffer buffer;
+		GCodeBuffer::Staging staging;
+		const char *chunks[] = { "G1 X1\nG1 X", "2 Y3\nG1", " X4", "5\nM10", "7" };
+		const char *expected[] = { "G1 X1", "G1 X2 Y3", "G1 X45", "M107" };
+
+		for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+			fructose_assert_eq(buffer.stage(staging, chunks[i], strlen(chunks[i])), GCodeBuffer::GSR_OK);
+		}
+		fructose_assert_eq(staging.getLines(), 3);
+
+		fructose_assert_eq(buffer.prepareCommit(staging), GCodeBuffer::GSR_OK);
+		fructose_assert_eq(staging.getLines(), 4);
+		buffer.commitPrepared(staging);
+		fructose_assert_eq(staging.getLines(), 0);
+
+		assertContents(buffer, expected, 4);
+	}
+
+	//a cancelled or rejected transaction leaves the buffer as it was
+	void testStageDiscard(const string& test_name) {
+		GCodeBuffer buffer;
+		GCodeBuffer::Staging staging;
+		GCodeBuffer::MetaData md;
+		string lineBuf;
+
+		md.seqNumber = 0; md.seqTotal = 2;
+		fructose_assert_eq(buffer.append("G28\n", -1, &md), GCodeBuffer::GSR_OK);
+
+		buffer.stage(staging, "G1 X1\nG1 X", 10);
+		staging.clear();
+		fructose_assert_eq(staging.getLines(), 0);
+		fructose_assert_eq(staging.getSize(), 0);
+		fructose_assert_eq(buffer.getBufferedLines(), 1);
+
+		//nothing of the partial line from before the cancel may leak into the next transaction
+		buffer.stage(staging, "G1 Y1\n", 6);
+		fructose_assert_eq(buffer.commit(staging, -1, &md), GCodeBuffer::GSR_SEQ_NUM_MISMATCH);
+		fructose_assert_eq(staging.getLines(), 0);
+		fructose_assert_eq(buffer.getBufferedLines(), 1);
+		fructose_assert_eq(buffer.getTotalLinesSent(), 1);
+
+		md.seqNumber = 1;
+		buffer.stage(staging, "G1 Z1\n", 6);
+		fructose_assert_eq(buffer.commit(staging, -1, &md), GCodeBuffer::GSR_OK);
+		fructose_assert_eq(buffer.getBufferedLines(), 2);
+		fructose_assert_eq(buffer.peekLine(lineBuf, 1), 1);
+		fructose_assert_eq(lineBuf, "G1 Z1");
+	}
+
+	//small transactions end up in the same bucket, getNextLine() only returning lines from the first one shows this
+	void testCommitMerges(const string& test_name) {
+		GCodeBuffer buffer;
+		GCodeBuffer::Staging staging;
+		string lineBuf;
+
+		for (int i = 0; i < 20; i++) {
+			char line[16];
+			snprintf(line, sizeof(line), "G1 X%i\n", i);
+			fructose_assert_eq(buffer.stage(staging, line, strlen(line)), GCodeBuffer::GSR_OK);
+			fructose_assert_eq(buffer.commit(staging), GCodeBuffer::GSR_OK);
+		}
+		fructose_assert_eq(buffer.getBufferedLines(), 20);
+		fructose_assert_eq(buffer.getNextLine(lineBuf, 20), 20);
+
+		//a staged bucket which does not fit is added as a new one
+		string big(60 * 1024, 'x');
+		big += "\n";
+		fructose_assert_eq(buffer.stage(staging, big.data(), big.length()), GCodeBuffer::GSR_OK);
+		fructose_assert_eq(buffer.commit(staging), GCodeBuffer::GSR_OK);
+		fructose_assert_eq(buffer.getBufferedLines(), 21);
+		fructose_assert_eq(buffer.getNextLine(lineBuf, 21), 20);
+	}
+
+	void testPeekLine(const string& test_name) {
+		GCodeBuffer buffer;
+		string lineBuf;
+
+		fructose_assert_eq(buffer.peekLine(lineBuf, 0), 0);
+
+		//enough lines to be split over multiple buckets
+		string gcode;
+		for (int i = 0; i < 5000; i++) {
+			char line[16];
+			snprintf(line, sizeof(line), "G1 X%i\n", i);
+			gcode += line;
+		}
+		buffer.append(gcode);
+
+		fructose_assert_eq(buffer.peekLine(lineBuf, 0), 1);
+		fructose_assert_eq(lineBuf, "G1 X0");
+		fructose_assert_eq(buffer.peekLine(lineBuf, 2500), 1);
+		fructose_assert_eq(lineBuf, "G1 X2500");
+		fructose_assert_eq(buffer.peekLine(lineBuf, 4999), 1);
+		fructose_assert_eq(lineBuf, "G1 X4999");
+		fructose_assert_eq(buffer.peekLine(lineBuf, 5000), 0);
+		fructose_assert_eq(buffer.getBufferedLines(), 5000);
+
+		buffer.eraseLine(2);
+		fructose_assert_eq(buffer.peekLine(lineBuf, 0), 1);
+		fructose_assert_eq(lineBuf, "G1 X2");
+		fructose_assert_eq(buffer.peekLine(lineBuf, 4997), 1);
+		fructose_assert_eq(lineBuf, "G1 X4999");
+	}
+private:
+	//the buffer must hold exactly the given lines, each terminated by a newline
+	void assertContents(GCodeBuffer& buffer, const char *lines[], int32_t numLines) {
+		int32_t size = 0;
+		string line;
+
+		fructose_assert_eq(buffer.getBufferedLines(), numLines);
+		for (int32_t i = 0; i < numLines; i++) {
+			fructose_assert_eq(buffer.peekLine(line, i), 1);
+			fructose_assert_eq(line, string(lines[i]));
+			size += strlen(lines[i]) + 1;
+		}
+		fructose_assert_eq(buffer.peekLine(line, numLines), 0);
+		fructose_assert_eq(buffer.getBufferSize(), size);
+	}
 };
 
 int main(int argc, char** argv) {
@@ -365,5 +511,10 @@ int main(int argc, char** argv) {
 	//tests.add_test("bucketBoundaries", &t_GCodeBuffer::testBucketBoundaries);
 	tests.add_test("maxBufferSize", &t_GCodeBuffer::testMaxBufferSize);
 	tests.add_test("setTotalLines", &t_GCodeBuffer::testSetTotalLines);
+	tests.add_test("stageCommit", &t_GCodeBuffer::testStageCommit);
+	tests.add_test("stageSplitLine", &t_GCodeBuffer::testStageSplitLine);
+	tests.add_test("stageDiscard", &t_GCodeBuffer::testStageDiscard);
+	tests.add_test("commitMerges", &t_GCodeBuffer::testCommitMerges);
+	tests.add_test("peekLine", &t_GCodeBuffer::testPeekLine);
 	return tests.run(argc, argv);
 }
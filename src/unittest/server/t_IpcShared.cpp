@@ -0,0 +1,152 @@
+#include <string>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <fructose/fructose.h>
+#include "../../ipc_shared.h"
+
+using std::string;
+
+struct t_IpcShared : public fructose::test_base<t_IpcShared> {
+	//a command with a request ID and arguments of every type, some of which are only referenced by the iovecs
+	void testEncodeIov(const string& test_name) {
+		string big(300, 'b');
+		ipc_arg_s args[] = {
+			ipc_arg_short(-12), ipc_arg_long(123456789), ipc_arg_data("abc", 3), ipc_arg_data(big.data(), big.size()), ipc_arg_data(NULL, 0)
+		};
+		const int numArgs = sizeof(args) / sizeof(args[0]);
+		uint32_t requestId = 0xdeadbeef;
+		char buf[IPC_IOV_BUF_SIZE(numArgs)];
+		struct iovec iov[IPC_IOV_COUNT(numArgs)];
+		int iovcnt = 0;
+
+		int len = ipc_cmd_encode_iov(buf, sizeof(buf), iov, &iovcnt, IPC_CMDQ_TEST, &requestId, args, numArgs);
+		fructose_assert_eq(len, ipc_cmd_encoded_len(args, numArgs) + 4);
+
+		bool referenced = false;
+		for (int i = 0; i < iovcnt; i++) referenced = referenced || iov[i].iov_base == big.data();
+		fructose_assert(referenced);
+
+		int joinedLen = 0;
+		char *joined = ipc_iov_join(iov, iovcnt, &joinedLen);
+		fructose_assert(joined != NULL);
+		fructose_assert_eq(joinedLen, len);
+
+		//encoding into a single buffer gives the same bytes
+		char flat[512];
+		fructose_assert_eq(ipc_cmd_encode(flat, sizeof(flat), IPC_CMDQ_TEST, &requestId, args, numArgs), len);
+		fructose_assert(memcmp(flat, joined, len) == 0);
+
+		ipc_frame_s frame;
+		fructose_assert_eq(ipc_cmd_parse(joined, joinedLen, &frame), len);
+		fructose_assert_eq(frame.len, len);
+		fructose_assert_eq(frame.code, IPC_CMDQ_TEST);
+		fructose_assert(frame.has_request_id);
+		fructose_assert_eq(frame.request_id, requestId);
+		fructose_assert_eq(frame.num_args, numArgs);
+
+		int16_t s = 0;
+		int32_t l = 0;
+		const char *arg;
+		uint32_t argLen;
+		fructose_assert_eq(ipc_frame_get_short_arg(&frame, 0, &s), 0);
+		fructose_assert_eq(s, -12);
+		fructose_assert_eq(ipc_frame_get_long_arg(&frame, 1, &l), 0);
+		fructose_assert_eq(l, 123456789);
+		fructose_assert_eq(ipc_frame_get_arg(&frame, 2, &arg, &argLen), 0);
+		fructose_assert_eq(string(arg, argLen), string("abc"));
+		fructose_assert_eq(ipc_frame_get_arg(&frame, 3, &arg, &argLen), 0);
+		fructose_assert_eq(string(arg, argLen), big);
+		fructose_assert_eq(ipc_frame_get_arg(&frame, 4, &arg, &argLen), 0);
+		fructose_assert_eq(argLen, 0U);
+		fructose_assert_eq(ipc_frame_get_arg(&frame, 5, &arg, &argLen), -2);
+
+		free(joined);
+
+		//buffers which are too small and invalid argument types are refused
+		fructose_assert_eq(ipc_cmd_encode_iov(buf, 8, iov, &iovcnt, IPC_CMDQ_TEST, &requestId, args, numArgs), -1);
+		fructose_assert_eq(ipc_cmd_encode(flat, len - 1, IPC_CMDQ_TEST, &requestId, args, numArgs), -1);
+		ipc_arg_s bad = ipc_arg_long(1);
+		bad.type = 'q';
+		fructose_assert_eq(ipc_cmd_encode_iov(buf, sizeof(buf), iov, &iovcnt, IPC_CMDQ_TEST, NULL, &bad, 1), -1);
+	}
+
+	//every prefix of a command is incomplete, and a complete command is found in front of the next one
+	void testTruncated(const string& test_name) {
+		ipc_arg_s args[] = { ipc_arg_long(7), ipc_arg_data("gcode", 5) };
+		uint32_t requestId = 42;
+		char buf[128];
+
+		int len = ipc_cmd_encode(buf, sizeof(buf), IPC_CMDQ_GCODE_APPEND, &requestId, args, 2);
+		fructose_assert(len > 0);
+
+		for (int i = 0; i < len; i++) {
+			ipc_frame_s frame;
+			frame.len = -7;
+			fructose_assert_eq(ipc_cmd_parse(buf, i, &frame), 0);
+			fructose_assert_eq(frame.len, -7);
+			fructose_assert_eq(ipc_cmd_is_complete(buf, i), 0);
+		}
+
+		int len2 = ipc_cmd_encode(buf + len, sizeof(buf) - len, IPC_CMDQ_TEST, NULL, args, 1);
+		fructose_assert(len2 > 0);
+
+		ipc_frame_s frame;
+		fructose_assert_eq(ipc_cmd_parse(buf, len + len2 - 1, &frame), len);
+		fructose_assert_eq(frame.code, IPC_CMDQ_GCODE_APPEND);
+		fructose_assert_eq(frame.request_id, requestId);
+
+		fructose_assert_eq(ipc_cmd_parse(buf + len, len2, &frame), len2);
+		fructose_assert_eq(frame.code, IPC_CMDQ_TEST);
+		fructose_assert(!frame.has_request_id);
+		fructose_assert_eq(frame.request_id, 0U);
+		fructose_assert_eq(frame.num_args, 1);
+	}
+
+	//arguments beyond the ones whose offsets are recorded in the frame are found as well
+	void testManyArgs(const string& test_name) {
+		const int numArgs = IPC_FRAME_INDEXED_ARGS + 3;
+		ipc_arg_s args[numArgs];
+		for (int i = 0; i < numArgs; i++) args[i] = ipc_arg_long(i * 1000);
+
+		char buf[256];
+		int len = ipc_cmd_encode(buf, sizeof(buf), IPC_CMDQ_TEST, NULL, args, numArgs);
+		fructose_assert_eq(len, 4 + numArgs * 8);
+
+		ipc_frame_s frame;
+		fructose_assert_eq(ipc_cmd_parse(buf, len, &frame), len);
+		fructose_assert_eq(frame.num_args, numArgs);
+
+		for (int i = 0; i < numArgs; i++) {
+			int32_t value = -1;
+			fructose_assert_eq(ipc_frame_get_long_arg(&frame, i, &value), 0);
+			fructose_assert_eq(value, i * 1000);
+		}
+	}
+
+	//oversized commands are recognized from their argument lengths, before their data has arrived
+	void testExceeds(const string& test_name) {
+		string data(1000, 'x');
+		ipc_arg_s args[] = { ipc_arg_long(1), ipc_arg_data(data.data(), data.size()) };
+		char buf[1100];
+
+		int len = ipc_cmd_encode(buf, sizeof(buf), IPC_CMDQ_GCODE_APPEND, NULL, args, 2);
+		fructose_assert_eq(ipc_cmd_exceeds(buf, len, len), 0);
+		fructose_assert_eq(ipc_cmd_exceeds(buf, len, len - 1), 1);
+		fructose_assert_eq(ipc_cmd_exceeds(buf, 3, 10), 0);
+		fructose_assert_eq(ipc_cmd_exceeds(buf, 4 + 8 + 4, 100), 1); //only the length of the data argument is in
+		fructose_assert_eq(ipc_cmd_exceeds(buf, 4 + 8, 100), 0);
+
+		const char huge[] = { 0, 3, 0, 1, 0x40, 0, 0, 0 }; //a single argument of 1 GiB
+		fructose_assert_eq(ipc_cmd_exceeds(huge, sizeof(huge), 256 * 1024), 1);
+	}
+};
+
+int main(int argc, char** argv) {
+	t_IpcShared tests;
+	tests.add_test("encodeIov", &t_IpcShared::testEncodeIov);
+	tests.add_test("truncated", &t_IpcShared::testTruncated);
+	tests.add_test("manyArgs", &t_IpcShared::testManyArgs);
+	tests.add_test("exceeds", &t_IpcShared::testExceeds);
+	return tests.run(argc, argv);
+}
@@ -1,3 +1,6 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <string>
 #include <fructose/fructose.h>
 #include "../../drivers/MarlinDriver.h"
@@ -69,13 +72,56 @@ struct t_MarlinDriver : public fructose::test_base<t_MarlinDriver>, public Marli
 		fructose_assert_eq(targetBedTemperature_, 0);
 	}
 
+	void testNumberedLines(const string& test_name) {
+		fructose_assert_eq(formatNumberedLine(0, "M110"), string("N0 M110*35"));
+		fructose_assert_eq(formatNumberedLine(1, "G28 X Y"), string("N1 G28 X Y*19"));
+	}
+
+	//the line number reset must itself be numbered and checksummed, Marlin ignores it otherwise
+	void testLineNumberReset(const string& test_name) {
+		int master = posix_openpt(O_RDWR | O_NOCTTY);
+		fructose_assert(master >= 0 && grantpt(master) == 0 && unlockpt(master) == 0);
+		fcntl(master, F_SETFL, O_NONBLOCK);
+		fructose_assert(serial_.open(ptsname(master)) >= 0);
+
+		string connect = "ok T:20.0 /0.0 B:20.0 /0.0";
+		readResponseCode(connect);
+		readPort(master);
+
+		appendGCode("G28\nG1 X10\n");
+		fructose_assert(startPrint(PRINTING));
+		fructose_assert_eq(readPort(master), string("N0 M110*35\nN1 G28*18\n"));
+
+		//a resend request for a line other than the one in flight makes the firmware expect that line again
+		string resend = "Resend: 5";
+		readResponseCode(resend);
+		fructose_assert_eq(readPort(master), string("N0 M110*35\n"));
+
+		serial_.close();
+		close(master);
+	}
+
 private:
 	Server s;
+
+	static string readPort(int fd) {
+		string data;
+		char buf[256];
+		ssize_t rv;
+		usleep(10000);
+		while ((rv = read(fd, buf, sizeof(buf))) > 0) data.append(buf, rv);
+
+		//the pseudo terminal translates newlines on output
+		for (size_t pos; (pos = data.find('\r')) != string::npos; ) data.erase(pos, 1);
+		return data;
+	}
 };
 
 int main(int argc, char** argv) {
 	t_MarlinDriver tests;
 	tests.add_test("temperatureParsing", &t_MarlinDriver::testTemperatureParsing);
 	tests.add_test("extractGCodeInfo", &t_MarlinDriver::testExtractGCodeInfo);
+	tests.add_test("numberedLines", &t_MarlinDriver::testNumberedLines);
+	tests.add_test("lineNumberReset", &t_MarlinDriver::testLineNumberReset);
 	return tests.run(argc, argv);
 }
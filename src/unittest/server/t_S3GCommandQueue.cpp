@@ -0,0 +1,72 @@
+#include <string>
+#include <fructose/fructose.h>
+#include "../../drivers/S3GCommandQueue.h"
+
+using std::string;
+
+struct t_S3GCommandQueue : public fructose::test_base<t_S3GCommandQueue> {
+	void testAppendPop(const string& test_name) {
+		S3GCommandQueue queue;
+		const uint8_t cmd1[] = { 137, 0x1f }, cmd2[] = { 10, 0, 2 };
+		const uint8_t *p;
+		size_t len;
+
+		fructose_assert(queue.empty());
+		fructose_assert(queue.front(&len) == NULL);
+		fructose_assert(!queue.append(cmd1, 0));
+
+		fructose_assert(queue.append(cmd1, sizeof(cmd1)));
+		fructose_assert(queue.append(cmd2, sizeof(cmd2)));
+		fructose_assert_eq(queue.size(), (size_t)2);
+		fructose_assert_eq(queue.getBytes(), (size_t)5);
+
+		p = queue.front(&len);
+		fructose_assert_eq(len, (size_t)2); fructose_assert_eq(p[0], 137); fructose_assert_eq(p[1], 0x1f);
+		queue.pop();
+		p = queue.front(&len);
+		fructose_assert_eq(len, (size_t)3); fructose_assert_eq(p[0], 10); fructose_assert_eq(p[2], 2);
+		queue.pop();
+		fructose_assert(queue.empty());
+		fructose_assert_eq(queue.getBytes(), (size_t)0);
+
+		fructose_assert(queue.append(255) != NULL);
+		fructose_assert(queue.append(256) == NULL);
+	}
+
+	//keeps a few commands queued while many pass through, so the ring wraps around (and grows) many times
+	void testWrapAndGrow(const string& test_name) {
+		S3GCommandQueue queue;
+		int written = 0, read = 0;
+
+		for (int round = 0; round < 200; round++) {
+			int toWrite = (round % 50 == 49) ? 100 : 3;
+			for (int i = 0; i < toWrite; i++, written++) {
+				size_t len = 1 + written % 40;
+				uint8_t *p = queue.append(len);
+				fructose_assert(p != NULL);
+				for (size_t j = 0; j < len; j++) p[j] = (uint8_t)(written + j);
+			}
+
+			while (queue.size() > 5) {
+				size_t len;
+				const uint8_t *p = queue.front(&len);
+				fructose_assert_eq(len, (size_t)(1 + read % 40));
+				for (size_t j = 0; j < len; j++) fructose_assert_eq(p[j], (uint8_t)(read + j));
+				queue.pop();
+				read++;
+			}
+		}
+
+		fructose_assert_eq(queue.size(), (size_t)(written - read));
+		queue.clear();
+		fructose_assert(queue.empty());
+		fructose_assert_eq(queue.getBytes(), (size_t)0);
+	}
+};
+
+int main(int argc, char** argv) {
+	t_S3GCommandQueue tests;
+	tests.add_test("appendPop", &t_S3GCommandQueue::testAppendPop);
+	tests.add_test("wrapAndGrow", &t_S3GCommandQueue::testWrapAndGrow);
+	return tests.run(argc, argv);
+}
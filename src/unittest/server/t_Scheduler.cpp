@@ -0,0 +1,117 @@
+#include <string>
+#include <unistd.h>
+#include <fructose/fructose.h>
+#include "../../drivers/Scheduler.h"
+
+using std::string;
+
+struct t_Scheduler : public fructose::test_base<t_Scheduler> {
+	void testOrdering(const string& test_name) {
+		Scheduler scheduler;
+
+		fructose_assert_eq(scheduler.getTimeout(), -1);
+		fructose_assert_eq(scheduler.popDueTask(), Scheduler::NO_TASK);
+
+		scheduler.schedule(3, 30);
+		scheduler.schedule(1, 10);
+		scheduler.schedule(2, 20);
+		scheduler.schedule(0, 0);
+		scheduler.schedule(4, 1000);
+		fructose_assert_eq(scheduler.getTimeout(), 0);
+
+		usleep(40 * 1000);
+		fructose_assert_eq(scheduler.popDueTask(), 0);
+		fructose_assert_eq(scheduler.popDueTask(), 1);
+		fructose_assert_eq(scheduler.popDueTask(), 2);
+		fructose_assert_eq(scheduler.popDueTask(), 3);
+		fructose_assert_eq(scheduler.popDueTask(), Scheduler::NO_TASK);
+
+		fructose_assert(!scheduler.isScheduled(3));
+		fructose_assert(scheduler.isScheduled(4));
+		int timeout = scheduler.getTimeout();
+		fructose_assert(timeout > 900 && timeout <= 1000);
+	}
+
+	void testCancel(const string& test_name) {
+		Scheduler scheduler;
+
+		scheduler.schedule(1, 0);
+		scheduler.schedule(2, 0);
+		scheduler.schedule(3, 1000);
+		scheduler.cancel(1);
+		scheduler.cancel(7); //never scheduled
+		fructose_assert(!scheduler.isScheduled(1));
+		fructose_assert(scheduler.isScheduled(2));
+
+		fructose_assert_eq(scheduler.popDueTask(), 2);
+		fructose_assert_eq(scheduler.popDueTask(), Scheduler::NO_TASK);
+
+		scheduler.cancel(3);
+		fructose_assert_eq(scheduler.getTimeout(), -1);
+
+		scheduler.schedule(1, 0);
+		scheduler.schedule(2, 500);
+		scheduler.cancelAll();
+		fructose_assert(!scheduler.isScheduled(1));
+		fructose_assert(!scheduler.isScheduled(2));
+		fructose_assert_eq(scheduler.getTimeout(), -1);
+		fructose_assert_eq(scheduler.popDueTask(), Scheduler::NO_TASK);
+
+		//cancelled tasks can be scheduled again
+		scheduler.schedule(2, 0);
+		fructose_assert_eq(scheduler.popDueTask(), 2);
+	}
+
+	//scheduling a task again replaces its deadline, whether that is earlier or later
+	void testRearm(const string& test_name) {
+		Scheduler scheduler;
+
+		scheduler.schedule(1, 10);
+		scheduler.schedule(2, 20);
+		scheduler.schedule(1, 40); //postponed behind task 2
+		usleep(30 * 1000);
+		fructose_assert_eq(scheduler.popDueTask(), 2);
+		fructose_assert_eq(scheduler.popDueTask(), Scheduler::NO_TASK);
+		fructose_assert(scheduler.getTimeout() > 0);
+		usleep(20 * 1000);
+		fructose_assert_eq(scheduler.popDueTask(), 1);
+
+		scheduler.schedule(3, 1000);
+		scheduler.schedule(3, 0); //brought forward
+		fructose_assert_eq(scheduler.getTimeout(), 0);
+		fructose_assert_eq(scheduler.popDueTask(), 3);
+		fructose_assert_eq(scheduler.popDueTask(), Scheduler::NO_TASK);
+		fructose_assert_eq(scheduler.getTimeout(), -1);
+
+		//a task re-armed from its own handler becomes due again
+		scheduler.schedule(3, 0);
+		fructose_assert_eq(scheduler.popDueTask(), 3);
+		scheduler.schedule(3, 0);
+		fructose_assert_eq(scheduler.popDueTask(), 3);
+	}
+
+	//rescheduling many times leaves obsolete heap entries behind, which must never be returned
+	void testManyReschedules(const string& test_name) {
+		Scheduler scheduler;
+
+		for (int i = 0; i < 1000; i++) {
+			int task = i % 5;
+			scheduler.schedule(task, (i % 2) ? 2000 - i : 1000 + i);
+		}
+		for (int task = 0; task < 5; task++) scheduler.schedule(task, 10 * (5 - task));
+
+		usleep(60 * 1000);
+		for (int task = 4; task >= 0; task--) fructose_assert_eq(scheduler.popDueTask(), task);
+		fructose_assert_eq(scheduler.popDueTask(), Scheduler::NO_TASK);
+		fructose_assert_eq(scheduler.getTimeout(), -1);
+	}
+};
+
+int main(int argc, char** argv) {
+	t_Scheduler tests;
+	tests.add_test("ordering", &t_Scheduler::testOrdering);
+	tests.add_test("cancel", &t_Scheduler::testCancel);
+	tests.add_test("rearm", &t_Scheduler::testRearm);
+	tests.add_test("manyReschedules", &t_Scheduler::testManyReschedules);
+	return tests.run(argc, argv);
+}
@@ -0,0 +1,194 @@
+#include <string>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <utime.h>
+#include <fructose/fructose.h>
+#include "../../drivers/X3GCache.h"
+
+using std::string;
+
+struct t_X3GCache : public fructose::test_base<t_X3GCache> {
+	void testMissAndHit(const string& test_name) {
+		string dir = makeDir();
+		X3GCache cache(dir, 1024 * 1024);
+		S3GCommandQueue commands;
+		const uint8_t cmd1[] = { 137, 0x1f }, cmd2[] = { 155, 1, 2, 3 }, cmd3[] = { 10, 0, 2 };
+		int32_t lines = 0;
+
+		fructose_assert(cache.isEnabled());
+		fructose_assert(!cache.openEntry(1));
+
+		fructose_assert(cache.beginEntry());
+		commands.append(cmd1, sizeof(cmd1));
+		commands.append(cmd2, sizeof(cmd2));
+		fructose_assert(cache.writeRecord(3, commands));
+		commands.clear();
+		commands.append(cmd3, sizeof(cmd3));
+		fructose_assert(cache.writeRecord(2, commands));
+		fructose_assert(!cache.openEntry(1)); //not visible until committed
+		fructose_assert(cache.commitEntry(1));
+		fructose_assert(!cache.isWriting());
+
+		fructose_assert(!cache.openEntry(2));
+		fructose_assert(cache.openEntry(1));
+		commands.clear();
+		fructose_assert_eq(cache.readRecord(&lines, commands), 1);
+		fructose_assert_eq(lines, 3);
+		fructose_assert_eq(commands.size(), (size_t)2);
+		fructose_assert_eq(commands.getBytes(), sizeof(cmd1) + sizeof(cmd2));
+		fructose_assert_eq(cache.readRecord(&lines, commands), 1);
+		fructose_assert_eq(lines, 2);
+		fructose_assert_eq(commands.size(), (size_t)3);
+		fructose_assert_eq(cache.readRecord(&lines, commands), 0);
+
+		size_t len;
+		const uint8_t *p = commands.front(&len);
+		fructose_assert_eq(len, sizeof(cmd1)); fructose_assert_eq(p[0], 137); fructose_assert_eq(p[1], 0x1f);
+		commands.pop();
+		p = commands.front(&len);
+		fructose_assert_eq(len, sizeof(cmd2)); fructose_assert_eq(p[0], 155); fructose_assert_eq(p[3], 3);
+		commands.pop();
+		p = commands.front(&len);
+		fructose_assert_eq(len, sizeof(cmd3)); fructose_assert_eq(p[0], 10); fructose_assert_eq(p[2], 2);
+		cache.closeEntry();
+
+		X3GCache disabled(dir, 0);
+		fructose_assert(!disabled.isEnabled());
+		fructose_assert(!disabled.openEntry(1));
+		fructose_assert(!disabled.beginEntry());
+
+		removeDir(dir);
+	}
+
+	//discarded, damaged and evicted entries must not be found
+	void testInvalidation(const string& test_name) {
+		string dir = makeDir();
+		X3GCache cache(dir, 1024 * 1024);
+		S3GCommandQueue commands;
+		const uint8_t cmd[] = { 137, 0x1f };
+		int32_t lines = 0;
+		commands.append(cmd, sizeof(cmd));
+
+		fructose_assert(cache.beginEntry());
+		fructose_assert(cache.writeRecord(1, commands));
+		cache.discardEntry();
+		fructose_assert(!cache.commitEntry(1));
+		fructose_assert(!cache.openEntry(1));
+		fructose_assert_eq(countEntries(dir), 0);
+
+		//an entry with a bad header is removed when opened
+		writeFile(entryPath(dir, 2), "garbage");
+		fructose_assert(!cache.openEntry(2));
+		fructose_assert(access(entryPath(dir, 2).c_str(), F_OK) < 0);
+
+		//a truncated record is reported as such
+		fructose_assert(cache.beginEntry());
+		fructose_assert(cache.writeRecord(1, commands));
+		fructose_assert(cache.commitEntry(3));
+		string path = entryPath(dir, 3);
+		fructose_assert_eq(truncate(path.c_str(), 6 + 8 + 1), 0);
+		fructose_assert(cache.openEntry(3));
+		commands.clear();
+		fructose_assert_eq(cache.readRecord(&lines, commands), -2);
+		fructose_assert(commands.empty());
+		cache.closeEntry();
+		unlink(path.c_str());
+
+		//with room for one entry only, committing another one evicts the least recently used one
+		X3GCache small(dir, 20);
+		commands.append(cmd, sizeof(cmd));
+		fructose_assert(small.beginEntry());
+		fructose_assert(small.writeRecord(1, commands));
+		fructose_assert(small.commitEntry(4));
+		struct utimbuf old = { 1000, 1000 };
+		utime(entryPath(dir, 4).c_str(), &old);
+		fructose_assert(small.beginEntry());
+		fructose_assert(small.writeRecord(1, commands));
+		fructose_assert(small.commitEntry(5));
+		fructose_assert(!small.openEntry(4));
+		fructose_assert(small.openEntry(5));
+		small.closeEntry();
+		fructose_assert_eq(countEntries(dir), 1);
+
+		removeDir(dir);
+	}
+
+	//keys are built like MakerbotDriver does: the job's source (including its terminating 0), then its gcode
+	void testKey(const string& test_name) {
+		fructose_assert_eq(X3GCache::hash(X3GCache::HASH_INIT, "", 0), X3GCache::HASH_INIT);
+		fructose_assert_eq(X3GCache::hash(X3GCache::HASH_INIT, "a", 1), 0xaf63dc4c8601ec8cULL); //FNV-1a test vector
+
+		string gcode = "G28\nG1 X10 Y10\nM104 S0\n";
+		uint64_t key = makeKey("job.gcode", gcode);
+		fructose_assert_eq(makeKey("job.gcode", gcode), key);
+		fructose_assert(makeKey("other.gcode", gcode) != key);
+		fructose_assert(makeKey("job.gcod", "e" + gcode) != key);
+		fructose_assert(makeKey("job.gcode", "G28\nG1 X10 Y11\nM104 S0\n") != key);
+
+		//hashing chunk by chunk gives the same key as hashing all at once
+		uint64_t h = X3GCache::hash(X3GCache::HASH_INIT, "job.gcode", 10);
+		h = X3GCache::hash(h, gcode.data(), 4);
+		h = X3GCache::hash(h, gcode.data() + 4, gcode.size() - 4);
+		fructose_assert_eq(h, key);
+	}
+
+private:
+	static uint64_t makeKey(const string& source, const string& gcode) {
+		uint64_t h = X3GCache::hash(X3GCache::HASH_INIT, source.c_str(), source.size() + 1);
+		return X3GCache::hash(h, gcode.data(), gcode.size());
+	}
+
+	static string makeDir() {
+		char path[] = "/tmp/t_x3gcache-XXXXXX";
+		return mkdtemp(path) ? path : "";
+	}
+
+	static string entryPath(const string& dir, uint64_t key) {
+		char name[32];
+		snprintf(name, sizeof(name), "/%016llx.x3g", (unsigned long long)key);
+		return dir + name;
+	}
+
+	static void writeFile(const string& path, const string& data) {
+		FILE *f = fopen(path.c_str(), "wb");
+		if (!f) return;
+		fwrite(data.data(), data.size(), 1, f);
+		fclose(f);
+	}
+
+	static int countEntries(const string& dir) {
+		DIR *d = opendir(dir.c_str());
+		if (!d) return -1;
+
+		int count = 0;
+		struct dirent *de;
+		while ((de = readdir(d)) != NULL) {
+			if (de->d_name[0] != '.') count++;
+		}
+		closedir(d);
+		return count;
+	}
+
+	static void removeDir(const string& dir) {
+		DIR *d = opendir(dir.c_str());
+		if (!d) return;
+
+		struct dirent *de;
+		while ((de = readdir(d)) != NULL) {
+			string name = de->d_name;
+			if (name != "." && name != "..") unlink((dir + "/" + name).c_str());
+		}
+		closedir(d);
+		rmdir(dir.c_str());
+	}
+};
+
+int main(int argc, char** argv) {
+	t_X3GCache tests;
+	tests.add_test("missAndHit", &t_X3GCache::testMissAndHit);
+	tests.add_test("invalidation", &t_X3GCache::testInvalidation);
+	tests.add_test("key", &t_X3GCache::testKey);
+	return tests.run(argc, argv);
+}
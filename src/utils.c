@@ -59,10 +59,23 @@ void store_nl(void *p, uint32_t v) {
 	memcpy(p, &nv, 4);
 }
 
+/*
+ * Both use the monotonic clock where available, the wall clock jumps when it is set (e.g. by NTP shortly after boot).
+ * NOTE: the result of getMillis() wraps around, so only use it for differences.
+ */
 uint32_t getMillis() {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	return (uint32_t)(getMicros() / 1000);
+}
+
+uint64_t getMicros() {
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
 //from: http://www.gnu.org/software/libc/manual/html_node/Elapsed-Time.html
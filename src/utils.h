@@ -26,6 +26,7 @@ uint32_t read_nl(const void *p);
 void store_ns(void *p, uint16_t v);
 void store_nl(void *p, uint32_t v);
 uint32_t getMillis();
+uint64_t getMicros();
 int timeval_subtract (struct timeval *result, struct timeval *x, struct timeval *y);
 int readAndAppendAvailableData(int fd, char **buf, int *buflen, int timeout, int onlyOnce);
 char *readFileContents(const char *file, int *size);